@@ -0,0 +1,490 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bufferPool.h"
+#include "pixelKernels.h"
+#include "processing.h"
+
+// Count every heap allocation made through operator new, including those
+// made inside OpenCV
+static std::atomic<uint64_t> heapAllocations{0};
+
+void* operator new(size_t size) {
+  heapAllocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+    return memory;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+// Define an allocator that counts the pixel buffers allocated for cv::Mat,
+// passing them on to the default or the pooled allocator
+class CountingAllocator : public cv::MatAllocator {
+ private:
+  const cv::MatAllocator* _allocator_;
+
+ public:
+  mutable std::atomic<uint64_t> allocations{0};
+
+  explicit CountingAllocator(const cv::MatAllocator* allocator)
+      : _allocator_(allocator) {}
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usageFlags) const override {
+    if (!data) {
+      allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return _allocator_->allocate(dims, sizes, type, data, step, flags,
+                                 usageFlags);
+  }
+
+  bool allocate(cv::UMatData* data, cv::AccessFlag flags,
+                cv::UMatUsageFlags usageFlags) const override {
+    return _allocator_->allocate(data, flags, usageFlags);
+  }
+
+  void deallocate(cv::UMatData* data) const override {
+    _allocator_->deallocate(data);
+  }
+};
+
+// Define a filter that runs the OpenCV call the SIMD kernels replaced, so
+// both paths can be compared on the same images
+class OpenCVFilter : public ImageFilter {
+ private:
+  std::function<void(cv::Mat& image, cv::Mat& newImage)> _apply_;
+
+ public:
+  explicit OpenCVFilter(
+      std::function<void(cv::Mat& image, cv::Mat& newImage)> apply)
+      : _apply_(std::move(apply)) {}
+
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override {
+    _apply_(image, newImage);
+  }
+};
+
+// Define a struct for one filter and parameter to measure
+struct BenchmarkCase {
+  std::string operation;
+  std::string param;
+  std::function<std::unique_ptr<ImageFilter>()> create;
+
+  // Colour conversions need three or four channels
+  bool needsColour;
+};
+
+// Define the image sizes, from a thumbnail up to 8K
+struct ImageSize {
+  std::string name;
+  int cols;
+  int rows;
+};
+
+std::vector<BenchmarkCase> benchmarkCases() {
+  std::vector<BenchmarkCase> cases;
+  for (double multiplier : {0.25, 0.5, 1.5}) {
+    cases.push_back({"resize", std::to_string(multiplier),
+                     [=] { return std::make_unique<ResizeFilter>(multiplier); },
+                     false});
+  }
+  for (double angle : {90.0, 180.0, -90.0, 45.0, 30.5, -17.0}) {
+    cases.push_back({"rotate", std::to_string(angle),
+                     [=] { return std::make_unique<RotateFilter>(angle); },
+                     false});
+  }
+  for (int flipCode : {0, 1, -1}) {
+    cases.push_back({"flip", std::to_string(flipCode),
+                     [=] { return std::make_unique<FlipFilter>(flipCode); },
+                     false});
+  }
+
+  // Measure a geometric chain resampled once against one step at a time,
+  // and right-angle rotations against the warp they replaced
+  auto geometricChain = [] {
+    auto chain = std::make_unique<FilterChain>();
+    chain->addFilter(std::make_unique<ResizeFilter>(0.5));
+    chain->addFilter(std::make_unique<RotateFilter>(30.0));
+    chain->addFilter(std::make_unique<FlipFilter>(1));
+    return chain;
+  };
+  cases.push_back({"chain", "resize+rotate+flip", geometricChain, false});
+  cases.push_back({"chain-unfused", "resize+rotate+flip", [] {
+                     return std::make_unique<OpenCVFilter>(
+                         [](cv::Mat& image, cv::Mat& newImage) {
+                           ResizeFilter resize(0.5);
+                           RotateFilter rotate(30.0);
+                           FlipFilter flip(1);
+                           cv::Mat resized, rotated;
+                           resize.applyFilter(image, resized);
+                           rotate.applyFilter(resized, rotated);
+                           flip.applyFilter(rotated, newImage);
+                         });
+                   },
+                   false});
+  for (double angle : {90.0, 180.0}) {
+    cases.push_back({"rotate-opencv", std::to_string(angle), [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             cv::Point2f centre(image.cols / 2.0F,
+                                                image.rows / 2.0F);
+                             cv::Mat rotateMatrix =
+                                 cv::getRotationMatrix2D(centre, angle, 1.0);
+                             cv::Rect2f boundRect =
+                                 cv::RotatedRect(cv::Point2f(), image.size(),
+                                                 angle)
+                                     .boundingRect2f();
+                             rotateMatrix.at<double>(0, 2) +=
+                                 boundRect.width / 2.0 - centre.x;
+                             rotateMatrix.at<double>(1, 2) +=
+                                 boundRect.height / 2.0 - centre.y;
+                             cv::warpAffine(image, newImage, rotateMatrix,
+                                            boundRect.size());
+                           });
+                     },
+                     false});
+  }
+  for (double alpha : {0.5, 1.5}) {
+    cases.push_back({"brightness", std::to_string(alpha),
+                     [=] { return std::make_unique<BrightnessFilter>(alpha); },
+                     false});
+  }
+  for (double beta : {-40.0, 40.0}) {
+    cases.push_back({"contrast", std::to_string(beta),
+                     [=] { return std::make_unique<ContrastFilter>(beta); },
+                     false});
+  }
+  for (double gamma : {0.5, 2.2}) {
+    cases.push_back({"gamma", std::to_string(gamma),
+                     [=] { return std::make_unique<GammaFilter>(gamma); },
+                     false});
+  }
+  cases.push_back(
+      {"colour", "rgb", [] { return std::make_unique<RGBFilter>(); }, true});
+  cases.push_back(
+      {"colour", "hsv", [] { return std::make_unique<HSVFilter>(); }, true});
+  cases.push_back(
+      {"colour", "grey", [] { return std::make_unique<GreyFilter>(); }, true});
+  cases.push_back(
+      {"colour", "ycc", [] { return std::make_unique<YCCFilter>(); }, true});
+  cases.push_back(
+      {"colour", "hsl", [] { return std::make_unique<HSLFilter>(); }, true});
+
+  // Measure the OpenCV paths of the point filters and swizzles, where gamma
+  // rebuilds its table on every call as it used to
+  for (double alpha : {0.5, 1.5}) {
+    cases.push_back({"brightness-opencv", std::to_string(alpha), [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             image.convertTo(newImage, -1, alpha, 0);
+                           });
+                     },
+                     false});
+  }
+  for (double beta : {-40.0, 40.0}) {
+    cases.push_back({"contrast-opencv", std::to_string(beta), [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             image.convertTo(newImage, -1, 1, beta);
+                           });
+                     },
+                     false});
+  }
+  for (double gamma : {0.5, 2.2}) {
+    cases.push_back({"gamma-opencv", std::to_string(gamma), [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             cv::Mat lookUp(1, 256, CV_8U);
+                             uchar* p = lookUp.ptr();
+                             for (int i = 0; i < 256; i++) {
+                               p[i] = cv::saturate_cast<uchar>(
+                                   pow(i / 255.0, gamma) * 255.0);
+                             }
+                             cv::LUT(image, lookUp, newImage);
+                           });
+                     },
+                     false});
+  }
+  // Measure a brightness and contrast run fused into one table against
+  // both OpenCV calls in turn
+  cases.push_back({"adjust", "brightness+contrast", [] {
+                     auto chain = std::make_unique<FilterChain>();
+                     chain->addFilter(std::make_unique<BrightnessFilter>(1.5));
+                     chain->addFilter(std::make_unique<ContrastFilter>(-40.0));
+                     return chain;
+                   },
+                   false});
+  cases.push_back({"adjust-opencv", "brightness+contrast", [] {
+                     return std::make_unique<OpenCVFilter>(
+                         [](cv::Mat& image, cv::Mat& newImage) {
+                           cv::Mat brightened;
+                           image.convertTo(brightened, -1, 1.5, 0);
+                           brightened.convertTo(newImage, -1, 1, -40.0);
+                         });
+                   },
+                   false});
+  for (const auto& conversion :
+       {std::make_pair("rgb", static_cast<int>(cv::COLOR_BGR2RGB)),
+        std::make_pair("grey", static_cast<int>(cv::COLOR_BGR2GRAY))}) {
+    int code = conversion.second;
+    cases.push_back({"colour-opencv", conversion.first, [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             cv::cvtColor(image, newImage, code);
+                           });
+                     },
+                     true});
+  }
+
+  cases.push_back({"smooth", "gauss",
+                   [] { return std::make_unique<GaussianFilter>(); }, false});
+  cases.push_back(
+      {"smooth", "box", [] { return std::make_unique<BoxFilter>(); }, false});
+  cases.push_back({"smooth", "sharp",
+                   [] { return std::make_unique<SharpFilter>(); }, false});
+
+  // Measure how the blurs scale with the radius, against the exact
+  // Gaussian kernel OpenCV would otherwise apply
+  for (int radius : {5, 20, 50, 150}) {
+    cases.push_back({"smooth", "gauss:" + std::to_string(radius), [=] {
+                       return std::make_unique<GaussianFilter>(radius);
+                     },
+                     false});
+    cases.push_back({"smooth", "box:" + std::to_string(radius), [=] {
+                       return std::make_unique<BoxFilter>(radius);
+                     },
+                     false});
+  }
+  for (int radius : {5, 20, 50}) {
+    cases.push_back({"smooth-opencv", "gauss:" + std::to_string(radius), [=] {
+                       return std::make_unique<OpenCVFilter>(
+                           [=](cv::Mat& image, cv::Mat& newImage) {
+                             int size = 2 * radius + 1;
+                             cv::GaussianBlur(image, newImage,
+                                              cv::Size(size, size), 0);
+                           });
+                     },
+                     false});
+  }
+  return cases;
+}
+
+// Compare the kernels with the OpenCV calls they replaced at every SIMD
+// level up to the current one, returning whether every output matched
+bool verifyKernels() {
+  // Verify only the operations meant to match OpenCV, as the blurs and
+  // right-angle rotations differ from it by design
+  const std::vector<std::string> operations = {"brightness", "contrast",
+                                               "gamma", "colour", "adjust"};
+  std::vector<BenchmarkCase> cases = benchmarkCases();
+
+  // Use odd sizes so the kernels finish rows on their scalar tails
+  const std::vector<ImageSize> sizes = {{"thumb", 160, 120},
+                                        {"odd", 641, 479}};
+
+  SimdLevel maxLevel = simdLevel();
+  bool matched = true;
+  int comparisons = 0;
+  for (int l = 0; l <= static_cast<int>(maxLevel); ++l) {
+    SimdLevel level = static_cast<SimdLevel>(l);
+    setSimdLevel(level);
+
+    for (const BenchmarkCase& kernel : cases) {
+      bool verified = false;
+      for (const std::string& operation : operations) {
+        verified = verified || kernel.operation == operation;
+      }
+      if (!verified) {
+        continue;
+      }
+
+      for (const BenchmarkCase& reference : cases) {
+        if (reference.operation != kernel.operation + "-opencv" ||
+            reference.param != kernel.param) {
+          continue;
+        }
+
+        // OpenCV converts to grey through IPP when it is built with it,
+        // which rounds some pixels differently from the fixed-point
+        // kernels, so grey may be off by one
+        double tolerance = kernel.param == "grey" ? 1.0 : 0.0;
+
+        for (const ImageSize& size : sizes) {
+          for (int channels : {1, 3, 4}) {
+            if (kernel.needsColour && channels == 1) {
+              continue;
+            }
+
+            cv::Mat image(size.rows, size.cols, CV_8UC(channels));
+            cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+            cv::Mat expected, actual;
+            reference.create()->applyFilter(image, expected);
+            kernel.create()->applyFilter(image, actual);
+            comparisons++;
+
+            double difference =
+                actual.size() == expected.size() &&
+                        actual.type() == expected.type()
+                    ? cv::norm(actual, expected, cv::NORM_INF)
+                    : 256.0;
+            if (difference > tolerance) {
+              std::cerr << "Error: " << kernel.operation << ' '
+                        << kernel.param << " with " << simdLevelName(level)
+                        << " kernels differs from OpenCV by " << difference
+                        << " on " << size.name << " images with "
+                        << channels << " channels!" << std::endl;
+              matched = false;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  setSimdLevel(maxLevel);
+  std::cerr << "Verified " << comparisons << " outputs up to "
+            << simdLevelName(maxLevel) << " kernels" << std::endl;
+  return matched;
+}
+
+int main(int argc, char** argv) {
+  std::string onlyOperation;
+  double minSeconds = 0.25;
+  int64_t maxPixels = 0;
+  bool pooled = false;
+  bool verify = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--filter" && i + 1 < argc) {
+      onlyOperation = argv[++i];
+    } else if (arg == "--min-time" && i + 1 < argc) {
+      minSeconds = std::stod(argv[++i]);
+    } else if (arg == "--max-pixels" && i + 1 < argc) {
+      maxPixels = std::stoll(argv[++i]);
+    } else if (arg == "--simd" && i + 1 < argc) {
+      SimdLevel level;
+      if (!parseSimdLevel(argv[++i], level)) {
+        std::cerr << "Error: Invalid SIMD level " << argv[i] << std::endl;
+        return -1;
+      }
+      setSimdLevel(level);
+    } else if (arg == "--pool") {
+      pooled = true;
+    } else if (arg == "--verify") {
+      verify = true;
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--filter <operation>] [--min-time <seconds>]"
+                << " [--max-pixels <pixels>]"
+                << " [--simd <scalar|sse4.2|avx2|avx512>] [--pool]"
+                << " [--verify]" << std::endl;
+      return -1;
+    }
+  }
+
+  // Report the kernels on stderr so the CSV stays comparable
+  std::cerr << "Using " << simdLevelName(simdLevel()) << " kernels"
+            << std::endl;
+
+  // Measure a single thread so results compare across machines
+  cv::setNumThreads(0);
+
+  // Check the kernels against OpenCV instead of measuring them
+  if (verify) {
+    return verifyKernels() ? 0 : -1;
+  }
+  CountingAllocator allocator(pooled ? &pooledMatAllocator()
+                                     : cv::Mat::getStdAllocator());
+  cv::Mat::setDefaultAllocator(&allocator);
+
+  const std::vector<ImageSize> sizes = {
+      {"thumb", 160, 120}, {"vga", 640, 480}, {"hd", 1920, 1080},
+      {"4k", 3840, 2160},  {"8k", 7680, 4320},
+  };
+
+  // Print one comma-separated row per case for comparing builds
+  std::cout << "operation,param,size,cols,rows,channels,iterations,"
+               "ns_per_pixel,mb_per_s,heap_allocs_per_call,"
+               "mat_allocs_per_call"
+            << std::endl;
+
+  for (const BenchmarkCase& benchmark : benchmarkCases()) {
+    if (!onlyOperation.empty() && benchmark.operation != onlyOperation) {
+      continue;
+    }
+
+    for (const ImageSize& size : sizes) {
+      int64_t pixels = static_cast<int64_t>(size.cols) * size.rows;
+      if (maxPixels > 0 && pixels > maxPixels) {
+        continue;
+      }
+
+      for (int channels : {1, 3, 4}) {
+        if (benchmark.needsColour && channels == 1) {
+          continue;
+        }
+
+        cv::Mat image(size.rows, size.cols, CV_8UC(channels));
+        cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+        auto filter = benchmark.create();
+
+        // Warm up once so the output buffer is reused like on the server
+        cv::Mat newImage;
+        filter->applyFilter(image, newImage);
+
+        uint64_t heapBefore = heapAllocations.load();
+        uint64_t matBefore = allocator.allocations.load();
+        int64_t iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{0};
+        while (iterations < 3 || elapsed.count() < minSeconds) {
+          filter->applyFilter(image, newImage);
+          iterations++;
+          elapsed = std::chrono::steady_clock::now() - start;
+        }
+        uint64_t heapCalls = heapAllocations.load() - heapBefore;
+        uint64_t matCalls = allocator.allocations.load() - matBefore;
+
+        double seconds = elapsed.count() / iterations;
+        double bytes = static_cast<double>(image.total() * image.elemSize());
+        std::cout << benchmark.operation << ',' << benchmark.param << ','
+                  << size.name << ',' << size.cols << ',' << size.rows << ','
+                  << channels << ',' << iterations << ','
+                  << seconds * 1e9 / pixels << ','
+                  << bytes / seconds / (1024.0 * 1024.0) << ','
+                  << static_cast<double>(heapCalls) / iterations << ','
+                  << static_cast<double>(matCalls) / iterations << std::endl;
+      }
+    }
+  }
+
+  cv::Mat::setDefaultAllocator(nullptr);
+
+  // Report how often pooled matrices reused an earlier buffer
+  if (pooled) {
+    BufferPool& pool = sharedBufferPool();
+    std::cerr << "Pool hits: " << pool.hits()
+              << ", misses: " << pool.misses()
+              << ", resident bytes: " << pool.residentBytes() << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "bufferPool.h"
+
+// Buffer pool class
+
+BufferPool::BufferPool(size_t shards, size_t maxIdleBytes)
+    : _maxIdleBytes_(maxIdleBytes) {
+  for (size_t i = 0; i < std::max<size_t>(shards, 1); i++) {
+    _shards_.push_back(std::make_unique<Shard>());
+  }
+}
+
+BufferPool::~BufferPool() {
+  for (auto& shard : _shards_) {
+    for (auto& blocks : shard->blocks) {
+      for (void* block : blocks) {
+        cv::fastFree(block);
+      }
+    }
+  }
+}
+
+int BufferPool::sizeClass(size_t bytes) {
+  if (bytes <= MIN_CLASS_BYTES) {
+    return 0;
+  }
+  if (bytes > MAX_CLASS_BYTES) {
+    return -1;
+  }
+
+  // Find the power of two just below the size, then the quarter above it
+  int shift = 6;
+  while ((size_t{2} << shift) < bytes) {
+    shift++;
+  }
+  size_t power = size_t{1} << shift;
+  size_t quarter = power / CLASSES_PER_DOUBLING;
+  size_t quarters = (bytes - power + quarter - 1) / quarter;
+  return (shift - 6) * CLASSES_PER_DOUBLING + static_cast<int>(quarters);
+}
+
+size_t BufferPool::classBytes(int sizeClass) {
+  if (sizeClass <= 0) {
+    return MIN_CLASS_BYTES;
+  }
+  int shift = 6 + (sizeClass - 1) / CLASSES_PER_DOUBLING;
+  size_t quarters = (sizeClass - 1) % CLASSES_PER_DOUBLING + 1;
+  size_t power = size_t{1} << shift;
+  return power + quarters * (power / CLASSES_PER_DOUBLING);
+}
+
+size_t BufferPool::_shardIndex_() const {
+  // Number threads as they first use a pool, so each worker has a shard
+  static std::atomic<size_t> nextThread{0};
+  thread_local size_t thread = nextThread.fetch_add(1);
+  return thread % _shards_.size();
+}
+
+void* BufferPool::_takeBlock_(int sizeClass) {
+  // Look in the shard of this thread before the others
+  size_t first = _shardIndex_();
+  for (size_t i = 0; i < _shards_.size(); i++) {
+    Shard& shard = *_shards_[(first + i) % _shards_.size()];
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto& blocks = shard.blocks[sizeClass];
+    if (!blocks.empty()) {
+      void* block = blocks.back();
+      blocks.pop_back();
+      return block;
+    }
+  }
+  return nullptr;
+}
+
+bool BufferPool::_takeVector_(int sizeClass, std::vector<uchar>& buffer) {
+  size_t first = _shardIndex_();
+  for (size_t i = 0; i < _shards_.size(); i++) {
+    Shard& shard = *_shards_[(first + i) % _shards_.size()];
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto& vectors = shard.vectors[sizeClass];
+    if (!vectors.empty()) {
+      buffer = std::move(vectors.back());
+      vectors.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BufferPool::_keepIdle_(size_t bytes) {
+  size_t idle = _idleBytes_.load();
+  do {
+    if (idle + bytes > _maxIdleBytes_.load()) {
+      return false;
+    }
+  } while (!_idleBytes_.compare_exchange_weak(idle, idle + bytes));
+  return true;
+}
+
+void* BufferPool::acquire(size_t bytes) {
+  // Sizes beyond the largest class go straight to the heap
+  int index = sizeClass(bytes);
+  if (index < 0) {
+    _misses_++;
+    return cv::fastMalloc(bytes);
+  }
+
+  size_t capacity = classBytes(index);
+  void* block = _takeBlock_(index);
+  if (block) {
+    _hits_++;
+    _idleBytes_ -= capacity;
+  } else {
+    _misses_++;
+    block = cv::fastMalloc(capacity);
+  }
+  _blockBytesInUse_ += capacity;
+  return block;
+}
+
+void BufferPool::release(void* block, size_t bytes) {
+  int index = sizeClass(bytes);
+  if (index < 0) {
+    cv::fastFree(block);
+    return;
+  }
+
+  // Free the block if the pool already holds enough idle bytes
+  size_t capacity = classBytes(index);
+  _blockBytesInUse_ -= capacity;
+  if (!_keepIdle_(capacity)) {
+    cv::fastFree(block);
+    return;
+  }
+
+  Shard& shard = *_shards_[_shardIndex_()];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.blocks[index].push_back(block);
+}
+
+std::vector<uchar> BufferPool::_emptyBytes_(size_t bytes) {
+  // Vectors of a class hold at least the bytes of the class
+  std::vector<uchar> buffer;
+  int index = sizeClass(bytes);
+  if (index >= 0 && _takeVector_(index, buffer)) {
+    _hits_++;
+    _idleBytes_ -= buffer.capacity();
+  } else {
+    _misses_++;
+    if (index >= 0) {
+      buffer.reserve(classBytes(index));
+    }
+  }
+  buffer.clear();
+  return buffer;
+}
+
+std::vector<uchar> BufferPool::acquireBytes(size_t bytes) {
+  std::vector<uchar> buffer = _emptyBytes_(bytes);
+  buffer.resize(bytes);
+  return buffer;
+}
+
+void BufferPool::releaseBytes(std::vector<uchar>&& buffer) {
+  // File the vector under the largest class its capacity covers
+  size_t capacity = buffer.capacity();
+  int index = sizeClass(capacity);
+  if (index >= 0 && classBytes(index) > capacity) {
+    index--;
+  }
+  if (index < 0 || !_keepIdle_(capacity)) {
+    return;
+  }
+
+  Shard& shard = *_shards_[_shardIndex_()];
+  std::lock_guard<std::mutex> guard(shard.mutex);
+  shard.vectors[index].push_back(std::move(buffer));
+}
+
+void BufferPool::setMaxIdleBytes(size_t bytes) {
+  _maxIdleBytes_ = bytes;
+
+  // Free the largest idle buffers first until the limit is met
+  for (int index = CLASS_COUNT - 1; index >= 0; index--) {
+    for (auto& shard : _shards_) {
+      std::lock_guard<std::mutex> guard(shard->mutex);
+      auto& blocks = shard->blocks[index];
+      while (!blocks.empty() && _idleBytes_.load() > bytes) {
+        cv::fastFree(blocks.back());
+        blocks.pop_back();
+        _idleBytes_ -= classBytes(index);
+      }
+      auto& vectors = shard->vectors[index];
+      while (!vectors.empty() && _idleBytes_.load() > bytes) {
+        _idleBytes_ -= vectors.back().capacity();
+        vectors.pop_back();
+      }
+    }
+  }
+}
+
+uint64_t BufferPool::hits() const { return _hits_.load(); }
+
+uint64_t BufferPool::misses() const { return _misses_.load(); }
+
+size_t BufferPool::idleBytes() const { return _idleBytes_.load(); }
+
+size_t BufferPool::residentBytes() const {
+  return _blockBytesInUse_.load() + _idleBytes_.load();
+}
+
+// Pooled matrix allocator class
+
+PooledMatAllocator::PooledMatAllocator(BufferPool& pool) : _pool_(pool) {}
+
+cv::UMatData* PooledMatAllocator::allocate(int dims, const int* sizes,
+                                           int type, void* data,
+                                           size_t* step, cv::AccessFlag,
+                                           cv::UMatUsageFlags) const {
+  // Lay the rows out the same way as the default allocator
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; i--) {
+    if (step) {
+      if (data && step[i] != CV_AUTOSTEP) {
+        CV_Assert(total <= step[i]);
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= sizes[i];
+  }
+
+  // Take the bookkeeping from the pool too, so a matrix costs no heap
+  // allocation once the pool is warm
+  auto* matData =
+      new (_pool_.acquire(sizeof(cv::UMatData))) cv::UMatData(this);
+  if (data) {
+    matData->data = matData->origdata = static_cast<uchar*>(data);
+    matData->flags |= cv::UMatData::USER_ALLOCATED;
+  } else {
+    matData->data = matData->origdata =
+        static_cast<uchar*>(_pool_.acquire(total));
+  }
+  matData->size = total;
+  return matData;
+}
+
+bool PooledMatAllocator::allocate(cv::UMatData* data, cv::AccessFlag,
+                                  cv::UMatUsageFlags) const {
+  return data != nullptr;
+}
+
+void PooledMatAllocator::deallocate(cv::UMatData* data) const {
+  if (!data) {
+    return;
+  }
+  CV_Assert(data->urefcount == 0);
+  CV_Assert(data->refcount == 0);
+
+  if (!(data->flags & cv::UMatData::USER_ALLOCATED)) {
+    _pool_.release(data->origdata, data->size);
+  }
+  data->~UMatData();
+  _pool_.release(data, sizeof(cv::UMatData));
+}
+
+BufferPool& sharedBufferPool() {
+  // Give every hardware thread a shard and keep up to 256 MB idle
+  static BufferPool* pool = new BufferPool(
+      std::max(1U, std::thread::hardware_concurrency()), 256 * 1024 * 1024);
+  return *pool;
+}
+
+PooledMatAllocator& pooledMatAllocator() {
+  static PooledMatAllocator* allocator =
+      new PooledMatAllocator(sharedBufferPool());
+  return *allocator;
+}
@@ -0,0 +1,124 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifndef SRC_BUFFERPOOL_H_
+#define SRC_BUFFERPOOL_H_
+
+// Define a pool of pixel blocks and byte vectors in size classes, which
+// keeps the buffers of finished requests so later requests of a similar
+// size reuse them instead of going back to the heap and faulting in fresh
+// pages. Each thread returns buffers to its own shard and takes from it
+// first, only locking the other shards when its own has none to spare.
+class BufferPool {
+ public:
+  // Define the smallest and largest pooled sizes, where larger buffers
+  // always come from the heap
+  static constexpr size_t MIN_CLASS_BYTES = 64;
+  static constexpr size_t MAX_CLASS_BYTES = size_t{1} << 30;
+
+  // Define four classes per power of two, so a buffer is at most a quarter
+  // larger than asked for
+  static constexpr int CLASSES_PER_DOUBLING = 4;
+  static constexpr int CLASS_COUNT = 1 + 24 * CLASSES_PER_DOUBLING;
+
+ private:
+  // Define the idle buffers of one shard, by size class
+  struct Shard {
+    std::mutex mutex;
+    std::array<std::vector<void*>, CLASS_COUNT> blocks;
+    std::array<std::vector<std::vector<uchar>>, CLASS_COUNT> vectors;
+  };
+
+  std::vector<std::unique_ptr<Shard>> _shards_;
+
+  // Define the most idle bytes kept, beyond which buffers are freed
+  std::atomic<size_t> _maxIdleBytes_;
+
+  // Define the counters reported by the server
+  std::atomic<uint64_t> _hits_{0};
+  std::atomic<uint64_t> _misses_{0};
+  std::atomic<size_t> _idleBytes_{0};
+  std::atomic<size_t> _blockBytesInUse_{0};
+
+  // Define functions to find the shard of the calling thread and to take
+  // an idle buffer of a class from any shard
+  size_t _shardIndex_() const;
+  void* _takeBlock_(int sizeClass);
+  bool _takeVector_(int sizeClass, std::vector<uchar>& buffer);
+
+  // Define a function to return an empty vector with room for the bytes
+  std::vector<uchar> _emptyBytes_(size_t bytes);
+
+  // Define a function to count idle bytes, returning false if keeping
+  // the buffer would exceed the limit
+  bool _keepIdle_(size_t bytes);
+
+ public:
+  BufferPool(size_t shards, size_t maxIdleBytes);
+  ~BufferPool();
+
+  // Define functions to map a size to its class, returning -1 for sizes
+  // that are not pooled, and a class to the bytes its buffers hold
+  static int sizeClass(size_t bytes);
+  static size_t classBytes(int sizeClass);
+
+  // Return a 64-byte aligned block of at least the given size, and give it
+  // back with the same size once it is no longer used
+  void* acquire(size_t bytes);
+  void release(void* block, size_t bytes);
+
+  // Return a byte vector of the given size whose capacity may come from an
+  // earlier request, and give a vector back to keep its capacity
+  std::vector<uchar> acquireBytes(size_t bytes);
+  void releaseBytes(std::vector<uchar>&& buffer);
+
+  // Set the most idle bytes kept, freeing idle buffers beyond it
+  void setMaxIdleBytes(size_t bytes);
+
+  uint64_t hits() const;
+  uint64_t misses() const;
+  size_t idleBytes() const;
+
+  // Return the bytes of blocks in use plus every idle buffer
+  size_t residentBytes() const;
+};
+
+// Define a cv::Mat allocator that takes pixel storage and the bookkeeping
+// of each matrix from a buffer pool
+class PooledMatAllocator : public cv::MatAllocator {
+ private:
+  BufferPool& _pool_;
+
+ public:
+  explicit PooledMatAllocator(BufferPool& pool);
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usageFlags) const override;
+
+  bool allocate(cv::UMatData* data, cv::AccessFlag flags,
+                cv::UMatUsageFlags usageFlags) const override;
+
+  void deallocate(cv::UMatData* data) const override;
+};
+
+// Return the pool and matrix allocator shared by the whole process, which
+// are never destroyed so matrices freed during shutdown can still return
+BufferPool& sharedBufferPool();
+PooledMatAllocator& pooledMatAllocator();
+
+#endif  // SRC_BUFFERPOOL_H_
@@ -2,64 +2,39 @@
 
 #include "client.h"
 
-bool Client::_validateFilterInput_(const std::string& operation,
-                                   const std::string& param) {
-  // Look up the operation in the map
-  auto it = _filterRequirements_.find(operation);
-
-  // If the operation is not found, alert user
-  if (it == _filterRequirements_.end()) {
-    throw std::invalid_argument("Error: Invalid filter operation!");
-  }
-
-  // Get the requirement for the operation
-  const auto& requirement = it->second;
-
-  // Check the parameter type and validate
-  switch (requirement.paramType) {
-    case ParamType::Integer:
-      // Check if all characters are digits
-      return (param[0] == '-' &&
-              std::all_of(param.begin() + 1, param.end(), ::isdigit)) ||
-             (std::all_of(param.begin(), param.end(), ::isdigit));
-    case ParamType::Double:
-      // Check if the string can be a double
-      char* end;
-      strtod(param.c_str(), &end);
-      return end != param.c_str() && *end == '\0';
-    case ParamType::String: {
-      // Split the expected values and check for a match
-      std::istringstream iss(requirement.expectedValue);
-      std::string token;
-      while (std::getline(iss, token, '|')) {
-        if (param == token) {
-          return true;
-        }
-      }
-      return false;
-    }
-    default:
-      // Throw an exception otherwise
-      throw std::invalid_argument("Error: Unknown parameter type");
-  }
+void Client::setFormat(ImageFormat format) { _format_ = format; }
+
+void Client::setUseStore(bool useStore) { _useStore_ = useStore; }
+
+void Client::setDeadline(uint32_t milliseconds) {
+  _deadlineMs_ = milliseconds;
 }
 
-void Client::operateClient(const std::string& serverAddress,
-                           const std::string& imagePath,
-                           const std::string& operation,
-                           const std::string& param) {
-  // Validate the operation and parameter inputs
-  if (!_validateFilterInput_(operation, param)) {
-    std::cerr << "Error: Invalid operation/parameter input!" << std::endl;
-    std::cout << "Check the README for appropriate inputs." << std::endl;
+void Client::_validateChain_(const std::vector<FilterStep>& steps) {
+  // Validate the operation and parameter inputs of every step
+  if (steps.empty() || steps.size() > MAX_CHAIN_LENGTH) {
+    std::cerr << "Error: Invalid number of filter steps!" << std::endl;
     exit(EXIT_FAILURE);
   }
+  for (const FilterStep& step : steps) {
+    // Only encoded replies can end with the codec they are encoded with
+    const OperationInfo* operation = findOperation(step.opcode);
+    bool isEncode = step.opcode == Opcode::Encode && &step == &steps.back() &&
+                    _format_ != ImageFormat::Raw;
+    if (!operation || !(operation->isFilter || isEncode)) {
+      std::cerr << "Error: Invalid operation/parameter input!" << std::endl;
+      std::cout << "Check the README for appropriate inputs." << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+}
 
+int Client::_connect_(const std::string& serverAddress) {
   // Extract server IP and port from the address
   size_t pos = serverAddress.find(':');
   if (pos == std::string::npos) {
     std::cerr << "Error: Invalid server address format!" << std::endl;
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   std::string serverIP = serverAddress.substr(0, pos);
@@ -69,8 +44,9 @@ void Client::operateClient(const std::string& serverAddress,
   int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
   if (clientSocket == -1) {
     std::cerr << "Error: Socket could not be created!" << std::endl;
-    exit(EXIT_FAILURE);
+    return -1;
   }
+  configureSocket(clientSocket);
 
   // Prepare the destination server address and port information
   sockaddr_in serverAddr{};
@@ -88,20 +64,474 @@ void Client::operateClient(const std::string& serverAddress,
 #else
     close(clientSocket);
 #endif  // _WIN32
+    return -1;
+  }
+
+  return clientSocket;
+}
+
+void Client::operateClient(const std::string& serverAddress,
+                           const std::vector<std::string>& imagePaths,
+                           const std::vector<FilterStep>& steps) {
+  _validateChain_(steps);
+
+  int clientSocket = _connect_(serverAddress);
+  if (clientSocket == -1) {
     exit(EXIT_FAILURE);
   }
 
   // Confirm server connection to the user
   std::cout << "Connected to server." << std::endl;
 
+  // Process every image over the same connection
+  for (const std::string& imagePath : imagePaths) {
+    _processImage_(clientSocket, imagePath, steps);
+  }
+
+  // Close the client socket to end the session
+#ifdef _WIN32
+  closesocket(clientSocket);
+#else
+  close(clientSocket);
+#endif  // _WIN32
+}
+
+void Client::operateVideo(const std::string& serverAddress,
+                          const std::string& source,
+                          const std::vector<FilterStep>& steps,
+                          const std::string& outputPath, size_t inFlight,
+                          size_t maxFrames) {
+  _validateChain_(steps);
+  if (_useStore_) {
+    std::cerr << "Error: Video mode does not support --store!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Open a camera by its index, or a video file or stream URL
+  cv::VideoCapture capture;
+  bool isCamera = std::all_of(source.begin(), source.end(), ::isdigit);
+  if (isCamera) {
+    capture.open(std::stoi(source));
+  } else {
+    capture.open(source);
+  }
+  if (!capture.isOpened()) {
+    std::cerr << "Error: Could not open " << source << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  double sourceFps = capture.get(cv::CAP_PROP_FPS);
+
+  int clientSocket = _connect_(serverAddress);
+  if (clientSocket == -1) {
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "Connected to server." << std::endl;
+
+  // Name the stream so the server builds its filters once for every frame
+  std::random_device random;
+  uint64_t streamId = static_cast<uint64_t>(random()) << 32 | random();
+  std::vector<FilterStep> frameSteps = {{Opcode::Stream, streamId}};
+  frameSteps.insert(frameSteps.end(), steps.begin(), steps.end());
+
+  // Define the frames awaited, keyed by the ID of their request, with when
+  // each was captured, and the frames received but held back until every
+  // earlier frame has come back
+  std::map<uint32_t, std::chrono::steady_clock::time_point> pending;
+  std::map<uint32_t, cv::Mat> finished;
+  bool sendingDone = false;
+  std::atomic<bool> stopped{false};
+  std::mutex pendingMutex;
+  std::condition_variable pendingChanged;
+
+  LatencyHistogram latencies;
+  std::atomic<uint64_t> shown{0};
+  std::atomic<uint64_t> dropped{0};
+  auto start = std::chrono::steady_clock::now();
+
+  // Receive frames on their own thread as the server finishes them, and
+  // show or write them in the order they were captured
+  std::thread receiver([&]() {
+    cv::VideoWriter writer;
+    auto lastReport = start;
+    uint64_t shownAtReport = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(pendingMutex);
+        pendingChanged.wait(lock,
+                            [&] { return !pending.empty() || sendingDone; });
+        if (pending.empty()) break;
+      }
+
+      ReplyHeader reply;
+      cv::Mat modifiedImage;
+      uint64_t receivedBytes = 0;
+      bool isReceived =
+          _receiveResult_(clientSocket, reply, modifiedImage, receivedBytes);
+      auto received = std::chrono::steady_clock::now();
+
+      std::unique_lock<std::mutex> lock(pendingMutex);
+      auto awaited = pending.find(reply.requestId);
+      if (!isReceived || awaited == pending.end()) {
+        // Give up on every frame still awaited
+        std::cerr << "Error: Connection lost with " << pending.size()
+                  << " frames in flight" << std::endl;
+        dropped += pending.size();
+        pending.clear();
+        stopped = true;
+        pendingChanged.notify_all();
+        break;
+      }
+      latencies.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                           received - awaited->second)
+                           .count());
+      pending.erase(awaited);
+
+      // Skip frames the server shed, dropped or could not filter
+      if (reply.status != ReplyStatus::Ok || modifiedImage.empty()) {
+        dropped++;
+      } else {
+        finished.emplace(reply.requestId, std::move(modifiedImage));
+      }
+
+      // Take every finished frame that no awaited frame comes before
+      std::vector<cv::Mat> ready;
+      while (!finished.empty() &&
+             (pending.empty() ||
+              finished.begin()->first < pending.begin()->first)) {
+        ready.push_back(std::move(finished.begin()->second));
+        finished.erase(finished.begin());
+      }
+      pendingChanged.notify_all();
+      lock.unlock();
+
+      for (const cv::Mat& frame : ready) {
+        if (outputPath.empty()) {
+          // Stop when a key is pressed in the window
+          cv::imshow("Modified Video", frame);
+          if (cv::waitKey(1) >= 0) {
+            stopped = true;
+          }
+        } else {
+          // Open the writer at the size of the first filtered frame
+          int codec = cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+          double fps = sourceFps > 0 ? sourceFps : 30.0;
+          if (!writer.isOpened() &&
+              !writer.open(outputPath, codec, fps, frame.size(),
+                           frame.channels() != 1)) {
+            std::cerr << "Error: Could not write " << outputPath
+                      << std::endl;
+            stopped = true;
+            break;
+          }
+          writer.write(frame);
+        }
+        shown++;
+      }
+
+      // Report the frame rate of the last second
+      std::chrono::duration<double> sinceReport = received - lastReport;
+      if (sinceReport.count() >= 1.0) {
+        std::cout << (shown - shownAtReport) / sinceReport.count()
+                  << " frames/s, " << dropped << " dropped" << std::endl;
+        lastReport = received;
+        shownAtReport = shown;
+      }
+    }
+  });
+
+  // Send frames as they are captured, keeping up to the chosen number in
+  // flight
+  uint64_t captured = 0;
+  cv::Mat frame;
+  while (!stopped && (maxFrames == 0 || captured < maxFrames)) {
+    if (!capture.read(frame) || frame.empty()) break;
+    captured++;
+    auto capturedAt = std::chrono::steady_clock::now();
+
+    uint32_t requestId;
+    {
+      std::unique_lock<std::mutex> lock(pendingMutex);
+      if (isCamera) {
+        // Drop live frames rather than fall behind the camera
+        if (pending.size() >= inFlight) {
+          dropped++;
+          continue;
+        }
+      } else {
+        // Read files no faster than the server filters them
+        pendingChanged.wait(
+            lock, [&] { return pending.size() < inFlight || stopped; });
+        if (stopped) break;
+      }
+
+      // Await the reply before sending, as it may arrive before the send
+      // ends
+      requestId = _nextRequestId_++;
+      pending.emplace(requestId, capturedAt);
+    }
+    pendingChanged.notify_all();
+
+    if (!_sendRequest_(clientSocket, requestId, frameSteps, frame)) {
+      // Wake the receiver, which reports the frames it was waiting for
+#ifdef _WIN32
+      shutdown(clientSocket, SD_BOTH);
+#else
+      shutdown(clientSocket, SHUT_RDWR);
+#endif  // _WIN32
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(pendingMutex);
+    sendingDone = true;
+  }
+  pendingChanged.notify_all();
+  receiver.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+#ifdef _WIN32
+  closesocket(clientSocket);
+#else
+  close(clientSocket);
+#endif  // _WIN32
+
+  // Report the sustained frame rate and the latency from capture to reply
+  auto millis = [](uint64_t micros) { return micros / 1000.0; };
+  std::cout << "Streamed " << shown << " of " << captured << " frames in "
+            << elapsed.count() << " s ("
+            << shown / std::max(elapsed.count(), 1e-9) << " frames/s), "
+            << dropped << " dropped." << std::endl;
+  std::cout << "Frame latency (ms): p50 " << millis(latencies.percentile(50))
+            << ", p90 " << millis(latencies.percentile(90)) << ", p99 "
+            << millis(latencies.percentile(99)) << ", max "
+            << millis(latencies.max()) << std::endl;
+}
+
+void Client::operateStats(const std::string& serverAddress,
+                          const std::string& statsFormat) {
+  int clientSocket = _connect_(serverAddress);
+  if (clientSocket == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  // Ask for the snapshot without an image
+  std::vector<FilterStep> statsSteps(1);
+  if (!parseStep("stats", statsFormat, statsSteps[0])) {
+    std::cerr << "Error: Invalid stats format!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::vector<uchar> reply;
+  if (!_exchange_(clientSocket, statsSteps, {}, reply)) {
+    std::cerr << "Error: Server metrics could not be received!" << std::endl;
+  } else {
+    std::cout.write(reinterpret_cast<const char*>(reply.data()),
+                    reply.size());
+  }
+
+#ifdef _WIN32
+  closesocket(clientSocket);
+#else
+  close(clientSocket);
+#endif  // _WIN32
+}
+
+void Client::operateBatch(const std::string& serverAddress,
+                          const std::vector<std::string>& imagePaths,
+                          const std::vector<FilterStep>& steps,
+                          const std::string& outputDir, size_t connections,
+                          size_t inFlight) {
+  _validateChain_(steps);
+  if (_useStore_) {
+    std::cerr << "Error: Batch mode does not support --store!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Create the output directory, which must not hold the inputs
+  std::error_code error;
+  std::filesystem::create_directories(outputDir, error);
+  if (error) {
+    std::cerr << "Error: Could not create the output directory!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Spread the images in flight over the connections
+  connections = std::max<size_t>(1, std::min(connections, imagePaths.size()));
+  size_t depth = std::max<size_t>(1, (inFlight + connections - 1) / connections);
+
+  BatchProgress progress;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < connections; ++i) {
+    workers.emplace_back([&]() {
+      _runBatchConnection_(serverAddress, imagePaths, steps, outputDir, depth,
+                           progress);
+    });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  // Report the throughput of the whole batch
+  size_t succeeded = progress.succeeded;
+  size_t failed = imagePaths.size() - succeeded;
+  std::cout << "Processed " << succeeded << " of " << imagePaths.size()
+            << " images in " << elapsed.count() << " s ("
+            << succeeded / std::max(elapsed.count(), 1e-9) << " images/s, "
+            << progress.bytesReceived / (1024.0 * 1024.0) /
+                   std::max(elapsed.count(), 1e-9)
+            << " MB/s received)";
+  if (failed > 0) {
+    std::cout << ", " << failed << " failed";
+  }
+  if (progress.shed > 0) {
+    std::cout << ", " << progress.shed << " shed";
+  }
+  std::cout << "." << std::endl;
+}
+
+void Client::_runBatchConnection_(const std::string& serverAddress,
+                                  const std::vector<std::string>& imagePaths,
+                                  const std::vector<FilterStep>& steps,
+                                  const std::string& outputDir, size_t depth,
+                                  BatchProgress& progress) {
+  int clientSocket = _connect_(serverAddress);
+  if (clientSocket == -1) {
+    return;
+  }
+
+  // Define the images sent on this connection whose replies are awaited,
+  // keyed by the ID of their request
+  std::unordered_map<uint32_t, std::string> pending;
+  bool sendingDone = false;
+  bool broken = false;
+  std::mutex pendingMutex;
+  std::condition_variable pendingChanged;
+
+  // Receive replies on their own thread as the server finishes them, so the
+  // server never blocks writing a reply while the next request is sent
+  std::thread receiver([&]() {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(pendingMutex);
+        pendingChanged.wait(lock,
+                            [&] { return !pending.empty() || sendingDone; });
+        if (pending.empty()) break;
+      }
+
+      ReplyHeader reply;
+      cv::Mat modifiedImage;
+      uint64_t receivedBytes = 0;
+      bool isReceived =
+          _receiveResult_(clientSocket, reply, modifiedImage, receivedBytes);
+      progress.bytesReceived += receivedBytes;
+
+      std::unique_lock<std::mutex> lock(pendingMutex);
+      auto awaited = pending.find(reply.requestId);
+      if (!isReceived || awaited == pending.end()) {
+        // Give up on everything still awaited on this connection
+        std::cerr << "Error: Connection lost with " << pending.size()
+                  << " images in flight" << std::endl;
+        pending.clear();
+        broken = true;
+        pendingChanged.notify_all();
+        break;
+      }
+      std::string imagePath = std::move(awaited->second);
+      pending.erase(awaited);
+      pendingChanged.notify_all();
+      lock.unlock();
+
+      // Write the result beside the other outputs, never over the input
+      std::filesystem::path outputPath =
+          std::filesystem::path(outputDir) /
+          std::filesystem::path(imagePath).filename();
+      std::error_code error;
+      if (reply.status != ReplyStatus::Ok) {
+        std::cerr << "Error: Server "
+                  << (reply.status == ReplyStatus::Busy ? "was too busy for "
+                                                         : "dropped ")
+                  << imagePath << std::endl;
+        progress.shed++;
+      } else if (modifiedImage.empty()) {
+        std::cerr << "Error: Server could not process " << imagePath
+                  << std::endl;
+      } else if (std::filesystem::equivalent(imagePath, outputPath, error)) {
+        std::cerr << "Error: Output would overwrite " << imagePath
+                  << std::endl;
+      } else if (!cv::imwrite(outputPath.string(), modifiedImage)) {
+        std::cerr << "Error: Could not write " << outputPath.string()
+                  << std::endl;
+      } else {
+        progress.succeeded++;
+      }
+    }
+  });
+
+  // Keep up to the chosen number of images in flight on this connection
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(pendingMutex);
+      pendingChanged.wait(lock,
+                          [&] { return pending.size() < depth || broken; });
+      if (broken) break;
+    }
+
+    size_t index = progress.next++;
+    if (index >= imagePaths.size()) break;
+
+    cv::Mat originalImage = cv::imread(imagePaths[index], cv::IMREAD_COLOR);
+    if (originalImage.empty()) {
+      std::cerr << "Error: Could not read " << imagePaths[index] << std::endl;
+      continue;
+    }
+
+    // Await the reply before sending, as it may arrive before the send ends
+    uint32_t requestId = _nextRequestId_++;
+    {
+      std::lock_guard<std::mutex> guard(pendingMutex);
+      pending.emplace(requestId, imagePaths[index]);
+    }
+    pendingChanged.notify_all();
+
+    if (!_sendRequest_(clientSocket, requestId, steps, originalImage)) {
+      // Wake the receiver, which reports the images it was waiting for
+#ifdef _WIN32
+      shutdown(clientSocket, SD_BOTH);
+#else
+      shutdown(clientSocket, SHUT_RDWR);
+#endif  // _WIN32
+      break;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(pendingMutex);
+    sendingDone = true;
+  }
+  pendingChanged.notify_all();
+  receiver.join();
+
+#ifdef _WIN32
+  closesocket(clientSocket);
+#else
+  close(clientSocket);
+#endif  // _WIN32
+}
+
+void Client::_processImage_(const int socket, const std::string& imagePath,
+                            const std::vector<FilterStep>& steps) {
   // Read in the image
   cv::Mat originalImage = cv::imread(imagePath, cv::IMREAD_COLOR);
   if (originalImage.empty()) {
     std::cerr << "Error: Could not read the image file!" << std::endl;
 #ifdef _WIN32
-    closesocket(clientSocket);
+    closesocket(socket);
 #else
-    close(clientSocket);
+    close(socket);
 #endif  // _WIN32
     exit(EXIT_FAILURE);
   }
@@ -109,20 +539,46 @@ void Client::operateClient(const std::string& serverAddress,
   // Display the original image using imshow
   cv::imshow("Original Image", originalImage);
 
-  // Send the instruction
-  _sendInstruction_(clientSocket, operation, param);
+  // Upload the image at most once and name it by its handle, or send the
+  // image along with the instruction
+  bool isSent;
+  uint32_t requestId = _nextRequestId_++;
+  if (_useStore_) {
+    uint64_t handle = 0;
+    isSent = _storeImage_(socket, originalImage, handle);
+    if (isSent) {
+      std::vector<FilterStep> handleSteps = {{Opcode::Handle, handle}};
+      handleSteps.insert(handleSteps.end(), steps.begin(), steps.end());
+      isSent = _sendRequest_(socket, requestId, handleSteps, cv::Mat());
+    }
+  } else {
+    isSent = _sendRequest_(socket, requestId, steps, originalImage);
+  }
 
-  // Send image
-  std::vector<uchar> sendBuffer;
-  cv::imencode(".jpg", originalImage, sendBuffer);
-  sendImage(clientSocket, sendBuffer);
+  // Receive the modified image in the chosen format
+  cv::Mat modifiedImage;
+  uint64_t receivedBytes;
+  ReplyHeader reply;
+  bool isReceived =
+      isSent && _receiveResult_(socket, reply, modifiedImage, receivedBytes);
 
-  // Receive modified image
-  std::vector<uchar> receiveBuffer;
-  receiveImage(clientSocket, receiveBuffer);
+  if (!isReceived || reply.requestId != requestId || modifiedImage.empty()) {
+    if (isReceived && reply.status == ReplyStatus::Busy) {
+      std::cerr << "Error: Server is too busy, try again later!" << std::endl;
+    } else if (isReceived && reply.status == ReplyStatus::Expired) {
+      std::cerr << "Error: Server missed the deadline!" << std::endl;
+    } else {
+      std::cerr << "Error: Server could not process the image!" << std::endl;
+    }
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif  // _WIN32
+    exit(EXIT_FAILURE);
+  }
 
   // Display modified image
-  cv::Mat modifiedImage = cv::imdecode(receiveBuffer, cv::IMREAD_COLOR);
   cv::imshow("Modified Image", modifiedImage);
 
   // Wait 10 seconds for user to press a key
@@ -137,34 +593,148 @@ void Client::operateClient(const std::string& serverAddress,
   if (!isSaved) {
     std::cerr << "Error: Could not write the image file!" << std::endl;
 #ifdef _WIN32
-    closesocket(clientSocket);
+    closesocket(socket);
 #else
-    close(clientSocket);
+    close(socket);
 #endif  // _WIN32
     exit(EXIT_FAILURE);
   }
+}
 
-  // Close the client socket
-#ifdef _WIN32
-  closesocket(clientSocket);
-#else
-  close(clientSocket);
-#endif  // _WIN32
+bool Client::_receiveResult_(const int socket, ReplyHeader& reply,
+                             cv::Mat& modifiedImage, uint64_t& receivedBytes) {
+  if (_format_ == ImageFormat::Raw) {
+    // Receive the modified pixels straight into the image
+    if (!receiveFrame(socket, reply, modifiedImage)) {
+      return false;
+    }
+    receivedBytes = modifiedImage.total() * modifiedImage.elemSize();
+    return true;
+  }
+
+  // Receive modified image, keeping single-channel results as they are
+  std::vector<uchar> receiveBuffer;
+  if (!receiveImage(socket, reply, receiveBuffer)) {
+    return false;
+  }
+  receivedBytes = receiveBuffer.size();
+  if (!receiveBuffer.empty()) {
+    modifiedImage = cv::imdecode(receiveBuffer, cv::IMREAD_UNCHANGED);
+  }
+  return true;
 }
 
-void Client::_sendInstruction_(const int socket, const std::string& operation,
-                               const std::string& param) {
-  // Prepare length-prefixed messages
-  uint32_t opLength = htonl(operation.size());
-  uint32_t paramLength = htonl(param.size());
+void Client::_encodePayload_(const cv::Mat& image, std::vector<uchar>& encoded,
+                             std::vector<BufferView>& payload) {
+  // Point at raw pixels straight in the image or at the JPEG encoding,
+  // leaving no payload for an empty image
+  if (!image.empty() && _format_ == ImageFormat::Raw) {
+    encoded = frameHeader(image);
+    payload.push_back({encoded.data(), encoded.size()});
+    size_t rowBytes = image.cols * image.elemSize();
+    if (image.isContinuous()) {
+      payload.push_back({image.data, rowBytes * image.rows});
+    } else {
+      for (int row = 0; row < image.rows; ++row) {
+        payload.push_back({image.ptr(row), rowBytes});
+      }
+    }
+  } else if (!image.empty()) {
+    cv::imencode(".jpg", image, encoded);
+    payload.push_back({encoded.data(), encoded.size()});
+  }
+}
 
-  // Send operation length and operation
-  send(socket, &opLength, sizeof(opLength), 0);
-  send(socket, operation.c_str(), operation.size(), 0);
+bool Client::_sendRequest_(const int socket, uint32_t requestId,
+                           const std::vector<FilterStep>& steps,
+                           const cv::Mat& image) {
+  std::vector<uchar> encoded;
+  std::vector<BufferView> payload;
+  _encodePayload_(image, encoded, payload);
+  return sendRequest(socket, steps, _format_, requestId, payload,
+                     _deadlineMs_);
+}
 
-  // Send parameter length and parameter
-  send(socket, &paramLength, sizeof(paramLength), 0);
-  send(socket, param.c_str(), param.size(), 0);
+bool Client::_exchange_(const int socket, const std::vector<FilterStep>& steps,
+                        const std::vector<BufferView>& payload,
+                        std::vector<uchar>& reply) {
+  uint32_t requestId = _nextRequestId_++;
+  ReplyHeader header;
+  return sendRequest(socket, steps, _format_, requestId, payload,
+                     _deadlineMs_) &&
+         receiveImage(socket, header, reply) &&
+         header.requestId == requestId && header.status == ReplyStatus::Ok;
+}
+
+bool Client::_storeImage_(const int socket, const cv::Mat& image,
+                          uint64_t& handle) {
+  // Name the image by the hash of the bytes uploaded, which the server
+  // checks against what it receives
+  std::vector<uchar> encoded;
+  std::vector<BufferView> payload;
+  _encodePayload_(image, encoded, payload);
+  handle = hashBuffers(payload, 0);
+
+  // Ask whether the server already holds the image
+  std::vector<FilterStep> storeSteps = {{Opcode::Store, handle}};
+  std::vector<uchar> reply;
+  if (!_exchange_(socket, storeSteps, {}, reply)) {
+    return false;
+  }
+  if (!reply.empty()) {
+    return true;
+  }
+
+  // Upload the image once, the server replying with its handle
+  return _exchange_(socket, storeSteps, payload, reply) && !reply.empty();
+}
+
+// Collect the images of a batch from a directory or a manifest file listing
+// one image path per line
+bool collectBatchImages(const std::string& source,
+                        std::vector<std::string>& imagePaths) {
+  std::error_code error;
+  if (std::filesystem::is_directory(source, error)) {
+    const std::vector<std::string> extensions = {
+        ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp"};
+    for (const auto& entry :
+         std::filesystem::directory_iterator(source, error)) {
+      std::string extension = entry.path().extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(),
+                     ::tolower);
+      if (entry.is_regular_file() &&
+          std::find(extensions.begin(), extensions.end(), extension) !=
+              extensions.end()) {
+        imagePaths.push_back(entry.path().string());
+      }
+    }
+    std::sort(imagePaths.begin(), imagePaths.end());
+    return !error;
+  }
+
+  // Skip blank lines and comments in a manifest
+  std::ifstream manifest(source);
+  if (!manifest) {
+    return false;
+  }
+  // Results are written under their file names alone, so skip an image
+  // whose name an earlier one already took rather than overwrite its result
+  std::unordered_map<std::string, std::string> outputNames;
+  std::string line;
+  while (std::getline(manifest, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (line.empty() || line[0] == '#') continue;
+
+    std::string name = std::filesystem::path(line).filename().string();
+    auto taken = outputNames.emplace(name, line);
+    if (!taken.second) {
+      std::cerr << "Error: Skipping " << line << ", whose file name "
+                << taken.first->second << " already uses" << std::endl;
+      continue;
+    }
+    imagePaths.push_back(line);
+  }
+  return true;
 }
 
 int main(int argc, char** argv) {
@@ -178,22 +748,130 @@ int main(int argc, char** argv) {
   }
 #endif  // _WIN32
 
-  if (argc != 5) {
-    std::cerr << "Usage: " << argv[0]
-              << " <server_ip:port> <image_path> <operation> <param>"
+  // Separate options from positional arguments
+  Client client;
+  std::vector<std::string> args;
+  std::string batchSource;
+  std::string videoSource;
+  std::string statsFormat;
+  std::string outputPath;
+  size_t connections = 4;
+  size_t inFlight = 8;
+  size_t maxFrames = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--batch" && i + 1 < argc) {
+      batchSource = argv[++i];
+    } else if (arg == "--video" && i + 1 < argc) {
+      videoSource = argv[++i];
+    } else if (arg == "--frames" && i + 1 < argc) {
+      maxFrames = std::stoul(argv[++i]);
+    } else if (arg == "--stats" && i + 1 < argc) {
+      statsFormat = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      outputPath = argv[++i];
+    } else if (arg == "--connections" && i + 1 < argc) {
+      connections = std::stoul(argv[++i]);
+    } else if (arg == "--inflight" && i + 1 < argc) {
+      inFlight = std::stoul(argv[++i]);
+    } else if (arg == "--raw") {
+      client.setFormat(ImageFormat::Raw);
+    } else if (arg == "--store") {
+      client.setUseStore(true);
+    } else if (arg == "--deadline" && i + 1 < argc) {
+      client.setDeadline(static_cast<uint32_t>(std::stoul(argv[++i])));
+    } else if (arg == "--buffer" && i + 1 < argc) {
+      int bufferBytes = std::stoi(argv[++i]);
+      client.setSocketBuffers(bufferBytes, bufferBytes);
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  // Only the server address is needed to ask for its metrics
+  if (!statsFormat.empty() && args.size() == 1) {
+    client.operateStats(args[0], statsFormat);
+#ifdef _WIN32
+    WSACleanup();
+#endif  // _WIN32
+    return 0;
+  }
+
+  // Batch and video modes take their images from --batch or --video
+  // instead of the arguments
+  bool isBatch = !batchSource.empty();
+  bool isVideo = !videoSource.empty();
+  size_t chainArg = isBatch || isVideo ? 1 : 2;
+  if (args.size() < chainArg + 2 || (isBatch && isVideo) ||
+      ((isBatch || isVideo) && args.size() > 3)) {
+    std::cerr << "Usage: " << argv[0] << " [--raw] [--store] [--buffer <bytes>]"
+              << " [--deadline <ms>]"
+              << " <server_ip:port> <image_path> <operation>[,<operation>...]"
+              << " <param>[,<param>...] [<image_path>...]" << std::endl;
+    std::cerr << "       " << argv[0]
+              << " --batch <directory|manifest> [--output <directory>]"
+              << " [--connections <n>] [--inflight <n>] [--raw]"
+              << " [--buffer <bytes>] [--deadline <ms>] <server_ip:port>"
+              << " <operation>[,<operation>...] <param>[,<param>...]"
+              << std::endl;
+    std::cerr << "       " << argv[0]
+              << " --video <camera_index|video_path> [--output <video_path>]"
+              << " [--inflight <n>] [--frames <n>] [--raw]"
+              << " [--deadline <ms>] <server_ip:port>"
+              << " <operation>[,<operation>...] <param>[,<param>...]"
+              << std::endl;
+    std::cerr << "       " << argv[0] << " --stats <text|json> <server_ip:port>"
               << std::endl;
     return -1;
   }
 
   // Extract command-line arguments
-  std::string serverAddress = argv[1];
-  std::string imagePath = argv[2];
-  std::string operation = argv[3];
-  std::string param = argv[4];
+  std::string serverAddress = args[0];
 
-  Client client;
+  // Split comma-separated operations and parameters into a filter chain
+  std::vector<FilterStep> steps;
+  std::istringstream operations(args[chainArg]);
+  std::istringstream params(args[chainArg + 1]);
+  std::string operation, param;
+  while (std::getline(operations, operation, ',')) {
+    if (!std::getline(params, param, ',')) {
+      std::cerr << "Error: Every operation needs a parameter!" << std::endl;
+      return -1;
+    }
 
-  client.operateClient(serverAddress, imagePath, operation, param);
+    // Look the operation up in the registry shared with the server
+    FilterStep step;
+    if (!parseStep(operation, param, step)) {
+      std::cerr << "Error: Invalid operation/parameter input!" << std::endl;
+      std::cout << "Check the README for appropriate inputs." << std::endl;
+      return -1;
+    }
+    steps.push_back(step);
+  }
+  if (std::getline(params, param, ',')) {
+    std::cerr << "Error: Every parameter needs an operation!" << std::endl;
+    return -1;
+  }
+
+  if (isBatch) {
+    std::vector<std::string> imagePaths;
+    if (!collectBatchImages(batchSource, imagePaths) || imagePaths.empty()) {
+      std::cerr << "Error: No images found in " << batchSource << std::endl;
+      return -1;
+    }
+    client.operateBatch(serverAddress, imagePaths, steps,
+                        outputPath.empty() ? "output" : outputPath,
+                        connections, inFlight);
+  } else if (isVideo) {
+    client.operateVideo(serverAddress, videoSource, steps, outputPath,
+                        std::max<size_t>(1, inFlight), maxFrames);
+  } else {
+    // Collect any further images to send over the same connection
+    std::vector<std::string> imagePaths = {args[1]};
+    imagePaths.insert(imagePaths.end(), args.begin() + 4, args.end());
+
+    client.operateClient(serverAddress, imagePaths, steps);
+  }
 
 #ifdef _WIN32
   WSACleanup();
@@ -1,57 +1,135 @@
 // Copyright 2023 Stewart Charles Fisher II
 
 // Import libraries
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/opencv.hpp>
+#include <random>
+#include <thread>
 #include <unordered_map>
 
+#include "histogram.h"
 #include "peer.h"
 
 #ifndef SRC_CLIENT_H_
 #define SRC_CLIENT_H_
 
-// Define an enumeration for parameter types
-enum class ParamType {
-  Double,
-  Integer,
-  String,
-};
-
-// Define s struct for the filter requirements
-struct FilterRequirement {
-  ParamType paramType;
-  std::string expectedValue;
+// Define a struct for the progress shared by the connections of a batch
+struct BatchProgress {
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> succeeded{0};
+  std::atomic<size_t> shed{0};
+  std::atomic<uint64_t> bytesReceived{0};
 };
 
 class Client : public Peer {
  private:
-  // Define a map to hold the requirements for each filter
-  std::unordered_map<std::string, FilterRequirement> _filterRequirements_ = {
-      {"resize", {ParamType::Double, ""}},
-      {"rotate", {ParamType::Double, ""}},
-      {"flip", {ParamType::Integer, ""}},
-      {"brightness", {ParamType::Double, ""}},
-      {"contrast", {ParamType::Double, ""}},
-      {"gamma", {ParamType::Double, ""}},
-      {"colour", {ParamType::String, "rgb|hsv|grey|ycc|hsl"}},
-      {"smooth", {ParamType::String, "gauss|box|sharp"}},
-  };
-
-  // Define a function to validate the user input
-  bool _validateFilterInput_(const std::string& operation,
-                             const std::string& param);
-
-  // Send the instruction
-  void _sendInstruction_(const int socket, const std::string& operation,
-                         const std::string& param);
+  // Define the image format used on the wire
+  ImageFormat _format_ = ImageFormat::Jpeg;
+
+  // Define whether images are uploaded once and named by handle
+  bool _useStore_ = false;
+
+  // Define how long each request may wait for a worker, where 0 leaves it
+  // to the server
+  uint32_t _deadlineMs_ = 0;
+
+  // Define a function to reject unusable filter chains
+  void _validateChain_(const std::vector<FilterStep>& steps);
+
+  // Define a function to connect to the server, returning -1 on failure
+  int _connect_(const std::string& serverAddress);
+
+  // Define the ID of the next request sent by this client
+  std::atomic<uint32_t> _nextRequestId_{1};
+
+  // Encode the image in the chosen format as the buffers of a payload,
+  // where encoded holds any bytes the buffers point into
+  void _encodePayload_(const cv::Mat& image, std::vector<uchar>& encoded,
+                       std::vector<BufferView>& payload);
+
+  // Send the instruction and the image in the chosen format, or no payload
+  // for an empty image, tagged with the given request ID
+  bool _sendRequest_(const int socket, uint32_t requestId,
+                     const std::vector<FilterStep>& steps,
+                     const cv::Mat& image);
+
+  // Receive the modified image in the chosen format along with the header
+  // of the reply, where the image is empty if the server could not process
+  // it or shed the request
+  bool _receiveResult_(const int socket, ReplyHeader& reply,
+                       cv::Mat& modifiedImage, uint64_t& receivedBytes);
+
+  // Send a request with an encoded payload, which may be empty, and wait
+  // for its reply bytes, failing if the reply answers another request
+  bool _exchange_(const int socket, const std::vector<FilterStep>& steps,
+                  const std::vector<BufferView>& payload,
+                  std::vector<uchar>& reply);
+
+  // Make sure the server holds the image, uploading it only if it does not,
+  // and set the handle it is stored under
+  bool _storeImage_(const int socket, const cv::Mat& image, uint64_t& handle);
+
+  // Define a function to filter a single image over an open session
+  void _processImage_(const int socket, const std::string& imagePath,
+                      const std::vector<FilterStep>& steps);
+
+  // Define a function to run one connection of a batch, keeping up to the
+  // given number of images in flight and matching their replies by ID, as
+  // the server answers them in the order they finish
+  void _runBatchConnection_(const std::string& serverAddress,
+                            const std::vector<std::string>& imagePaths,
+                            const std::vector<FilterStep>& steps,
+                            const std::string& outputDir, size_t depth,
+                            BatchProgress& progress);
 
  public:
-  // Define a function to manage client operation
+  // Define a function to choose the image format used on the wire
+  void setFormat(ImageFormat format);
+
+  // Define a function to upload each image once and name it by handle
+  void setUseStore(bool useStore);
+
+  // Define a function to set the deadline sent with each request
+  void setDeadline(uint32_t milliseconds);
+
+  // Define a function to manage client operation, reusing one connection
+  // for every image in the session
   void operateClient(const std::string& serverAddress,
-                     const std::string& imagePath, const std::string& operation,
-                     const std::string& param);
+                     const std::vector<std::string>& imagePaths,
+                     const std::vector<FilterStep>& steps);
+
+  // Define a function to print a snapshot of the server metrics, as text
+  // or as JSON
+  void operateStats(const std::string& serverAddress,
+                    const std::string& statsFormat);
+
+  // Define a function to filter a batch of images without any windows,
+  // keeping several images in flight over several connections and writing
+  // the results to a separate directory
+  void operateBatch(const std::string& serverAddress,
+                    const std::vector<std::string>& imagePaths,
+                    const std::vector<FilterStep>& steps,
+                    const std::string& outputDir, size_t connections,
+                    size_t inFlight);
+
+  // Define a function to filter a camera or video stream frame by frame
+  // over one connection, keeping several frames in flight, showing the
+  // results in order or writing them to a video file, and reporting the
+  // frame rate, dropped frames and latency per frame
+  void operateVideo(const std::string& serverAddress,
+                    const std::string& source,
+                    const std::vector<FilterStep>& steps,
+                    const std::string& outputPath, size_t inFlight,
+                    size_t maxFrames);
 };
 
 #endif  // SRC_CLIENT_H_
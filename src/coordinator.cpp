@@ -0,0 +1,242 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "coordinator.h"
+
+TileCoordinator::~TileCoordinator() {
+  // Close every connection left open for later images
+  for (auto& worker : _workers_) {
+    for (int socket : worker->idleSockets) {
+      _closeSocket_(socket);
+    }
+  }
+}
+
+void TileCoordinator::setWorkers(const std::vector<std::string>& addresses) {
+  _workers_.clear();
+  for (const std::string& address : addresses) {
+    auto worker = std::make_unique<Worker>();
+    worker->address = address;
+    _workers_.push_back(std::move(worker));
+  }
+}
+
+size_t TileCoordinator::workerCount() const { return _workers_.size(); }
+
+bool TileCoordinator::shouldScatter(const cv::Mat& image,
+                                    const ImageFilter& chain) const {
+  // Only chains that read nearby rows can be split into independent tiles
+  return !_workers_.empty() && chain.tileMode() == TileMode::Local &&
+         image.total() >= MIN_SCATTER_PIXELS;
+}
+
+int TileCoordinator::_connect_(const std::string& address) {
+  // Extract the worker IP and port from the address
+  size_t pos = address.find(':');
+  if (pos == std::string::npos) {
+    return -1;
+  }
+  std::string workerIP = address.substr(0, pos);
+  int workerPort = std::atoi(address.c_str() + pos + 1);
+
+  int workerSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (workerSocket == -1) {
+    return -1;
+  }
+  configureSocket(workerSocket);
+
+  // Treat a worker that stops answering, or cannot be reached, as dead
+#ifdef _WIN32
+  DWORD timeout = WORKER_TIMEOUT_SECONDS * 1000;
+#else
+  timeval timeout{};
+  timeout.tv_sec = WORKER_TIMEOUT_SECONDS;
+#endif  // _WIN32
+  setsockopt(workerSocket, SOL_SOCKET, SO_RCVTIMEO,
+             reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+  setsockopt(workerSocket, SOL_SOCKET, SO_SNDTIMEO,
+             reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+
+  sockaddr_in workerAddr{};
+  workerAddr.sin_family = AF_INET;
+  workerAddr.sin_port = htons(workerPort);
+  workerAddr.sin_addr.s_addr = inet_addr(workerIP.c_str());
+  if (connect(workerSocket, (struct sockaddr*)&workerAddr,
+              sizeof(workerAddr)) == -1) {
+    _closeSocket_(workerSocket);
+    return -1;
+  }
+  return workerSocket;
+}
+
+int TileCoordinator::_acquire_(Worker& worker) {
+  {
+    std::lock_guard<std::mutex> guard(_socketMutex_);
+    if (!worker.idleSockets.empty()) {
+      int socket = worker.idleSockets.back();
+      worker.idleSockets.pop_back();
+      return socket;
+    }
+  }
+  return _connect_(worker.address);
+}
+
+void TileCoordinator::_release_(Worker& worker, int socket) {
+  std::lock_guard<std::mutex> guard(_socketMutex_);
+  worker.idleSockets.push_back(socket);
+}
+
+void TileCoordinator::_closeSocket_(int socket) {
+#ifdef _WIN32
+  closesocket(socket);
+#else
+  close(socket);
+#endif  // _WIN32
+}
+
+TileCoordinator::TileResult TileCoordinator::_filterTile_(
+    int socket, const std::vector<FilterStep>& steps, const cv::Mat& tile,
+    cv::Mat& result) {
+  // Send the rows straight from the image as a raw frame
+  uint32_t requestId = _nextRequestId_++;
+  std::vector<uchar> header = frameHeader(tile);
+  if (!sendRequest(socket, steps, ImageFormat::Raw, requestId,
+                   {{header.data(), header.size()},
+                    {tile.data, tile.total() * tile.elemSize()}})) {
+    return TileResult::Lost;
+  }
+
+  // A reply to another request means the connection is out of step, and a
+  // busy worker may still take the tile after the others
+  ReplyHeader reply;
+  if (!receiveFrame(socket, reply, result) || reply.requestId != requestId ||
+      reply.status != ReplyStatus::Ok) {
+    return TileResult::Lost;
+  }
+  return result.empty() ? TileResult::Rejected : TileResult::Filtered;
+}
+
+bool TileCoordinator::apply(const std::vector<FilterStep>& steps,
+                            ImageFilter& chain, const cv::Mat& image,
+                            cv::Mat& newImage) {
+  // Send whole rows straight from a continuous image
+  cv::Mat source = image.isContinuous() ? image : image.clone();
+  int halo = chain.haloRows();
+  int tileCount = static_cast<int>(_workers_.size()) * TILES_PER_WORKER;
+  int tileRows =
+      std::max(MIN_TILE_ROWS, (source.rows + tileCount - 1) / tileCount);
+
+  // Define the tiles still to be filtered, shared by one thread per worker
+  std::deque<cv::Range> pending;
+  for (int start = 0; start < source.rows; start += tileRows) {
+    pending.emplace_back(start, std::min(source.rows, start + tileRows));
+  }
+  size_t inFlight = 0;
+  bool rejected = false;
+  std::mutex mutex;
+  std::condition_variable changed;
+
+  // Copy the rows that belong to a filtered tile, dropping its halo, where
+  // the output type is only known once the first tile is back
+  cv::Mat output;
+  auto stitch = [&](const cv::Range& rows, int haloStart, int haloEnd,
+                    const cv::Mat& result) {
+    if (result.rows != haloEnd - haloStart || result.cols != source.cols) {
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      if (output.empty()) {
+        output.create(source.rows, result.cols, result.type());
+      } else if (output.type() != result.type()) {
+        return false;
+      }
+    }
+    result.rowRange(rows.start - haloStart, rows.end - haloStart)
+        .copyTo(output.rowRange(rows));
+    return true;
+  };
+
+  auto runWorker = [&](Worker& worker) {
+    int socket = _acquire_(worker);
+    int failures = 0;
+    while (socket != -1) {
+      // Wait while tiles sent to other workers may still come back
+      cv::Range rows;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] {
+          return !pending.empty() || inFlight == 0 || rejected;
+        });
+        if (pending.empty() || rejected) break;
+        rows = pending.front();
+        pending.pop_front();
+        inFlight++;
+      }
+
+      int haloStart = std::max(0, rows.start - halo);
+      int haloEnd = std::min(source.rows, rows.end + halo);
+      cv::Mat result;
+      TileResult outcome = _filterTile_(
+          socket, steps, source.rowRange(haloStart, haloEnd), result);
+      _tilesSent_++;
+      bool stitched = outcome == TileResult::Filtered &&
+                      stitch(rows, haloStart, haloEnd, result);
+
+      // Hand a lost tile back for another worker to take
+      {
+        std::lock_guard<std::mutex> guard(mutex);
+        inFlight--;
+        if (outcome == TileResult::Lost) {
+          pending.push_back(rows);
+          _tilesRetried_++;
+        } else if (!stitched) {
+          rejected = true;
+        }
+      }
+      changed.notify_all();
+
+      // Reconnect after a dropped connection, giving up on a dead worker
+      if (outcome == TileResult::Lost) {
+        _closeSocket_(socket);
+        socket = ++failures < MAX_WORKER_FAILURES ? _connect_(worker.address)
+                                                  : -1;
+      }
+    }
+    if (socket != -1) {
+      _release_(worker, socket);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (auto& worker : _workers_) {
+    threads.emplace_back(runWorker, std::ref(*worker));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (rejected) {
+    return false;
+  }
+
+  // Filter whatever is left on this server once every worker is gone
+  for (const cv::Range& rows : pending) {
+    int haloStart = std::max(0, rows.start - halo);
+    int haloEnd = std::min(source.rows, rows.end + halo);
+    cv::Mat tile = source.rowRange(haloStart, haloEnd);
+    cv::Mat result;
+    chain.applyFilter(tile, result);
+    _tilesLocal_++;
+    if (!stitch(rows, haloStart, haloEnd, result)) {
+      return false;
+    }
+  }
+
+  newImage = output;
+  return true;
+}
+
+uint64_t TileCoordinator::tilesSent() const { return _tilesSent_; }
+
+uint64_t TileCoordinator::tilesRetried() const { return _tilesRetried_; }
+
+uint64_t TileCoordinator::tilesLocal() const { return _tilesLocal_; }
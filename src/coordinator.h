@@ -0,0 +1,110 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "peer.h"
+#include "processing.h"
+
+#ifndef SRC_COORDINATOR_H_
+#define SRC_COORDINATOR_H_
+
+// Define a coordinator that scatters the stripes of a large image across
+// worker servers, gathers the filtered stripes and stitches them together
+class TileCoordinator : public Peer {
+ private:
+  // Define the smallest image worth sending to the workers
+  const size_t MIN_SCATTER_PIXELS = 4 * 1024 * 1024;
+
+  // Define how many tiles each worker is given, so faster workers can take
+  // more of them
+  const int TILES_PER_WORKER = 4;
+
+  // Define the smallest tile height
+  const int MIN_TILE_ROWS = 64;
+
+  // Define how long a worker may stay silent before it is treated as dead
+  const int WORKER_TIMEOUT_SECONDS = 10;
+
+  // Define how often a worker may drop a connection during one image
+  // before its tiles are left to the other workers
+  const int MAX_WORKER_FAILURES = 2;
+
+  // Define a struct for one worker server and its open connections
+  struct Worker {
+    std::string address;
+    std::vector<int> idleSockets;
+  };
+
+  // Define the outcomes of sending one tile
+  enum class TileResult {
+    Filtered,
+    // The worker could not filter the tile, so no worker can
+    Rejected,
+    // The connection failed, so the tile should go to another worker
+    Lost,
+  };
+
+  // Define the workers and a mutex guarding their idle connections
+  std::vector<std::unique_ptr<Worker>> _workers_;
+  std::mutex _socketMutex_;
+
+  // Define the ID of the next request sent to any worker
+  std::atomic<uint32_t> _nextRequestId_{1};
+
+  // Define counters for the stats snapshot
+  std::atomic<uint64_t> _tilesSent_{0};
+  std::atomic<uint64_t> _tilesRetried_{0};
+  std::atomic<uint64_t> _tilesLocal_{0};
+
+  // Define functions to reuse connections to a worker, returning -1 if the
+  // worker cannot be reached
+  int _connect_(const std::string& address);
+  int _acquire_(Worker& worker);
+  void _release_(Worker& worker, int socket);
+  void _closeSocket_(int socket);
+
+  // Define a function to send a tile as a raw frame and receive the
+  // filtered tile
+  TileResult _filterTile_(int socket, const std::vector<FilterStep>& steps,
+                          const cv::Mat& tile, cv::Mat& result);
+
+ public:
+  ~TileCoordinator();
+
+  // Define a function to set the worker servers as "<ip>:<port>" addresses
+  void setWorkers(const std::vector<std::string>& addresses);
+
+  size_t workerCount() const;
+
+  // Decide whether a chain over an image is worth scattering, which needs
+  // a chain that only reads nearby rows
+  bool shouldScatter(const cv::Mat& image, const ImageFilter& chain) const;
+
+  // Filter an image by scattering its tiles, each with the halo the chain
+  // reads, retrying tiles of a dead worker on the others and filtering
+  // them locally with the chain once every worker is gone, returning false
+  // if a worker rejected a tile
+  bool apply(const std::vector<FilterStep>& steps, ImageFilter& chain,
+             const cv::Mat& image, cv::Mat& newImage);
+
+  uint64_t tilesSent() const;
+  uint64_t tilesRetried() const;
+  uint64_t tilesLocal() const;
+};
+
+#endif  // SRC_COORDINATOR_H_
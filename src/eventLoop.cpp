@@ -0,0 +1,1052 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "eventLoop.h"
+
+#ifdef __linux__
+
+#include <arpa/inet.h>
+
+// Define the epoll tags for the two non-client descriptors
+static const uint64_t SERVER_TAG = 0;
+static const uint64_t WAKE_TAG = 1;
+
+#ifdef HAVE_IO_URING
+// Define the io_uring operations, kept in the low bits of the user data
+// below the tag
+static const uint64_t RECEIVE_OPERATION = 0;
+static const uint64_t SEND_OPERATION = 1;
+static const int OPERATION_BITS = 1;
+
+// Define the group the receive buffers are provided in
+static const uint16_t RECEIVE_GROUP = 0;
+#endif  // HAVE_IO_URING
+
+EventLoop::EventLoop(int serverSocket, int idleTimeoutSeconds,
+                     RequestHandler handler, StreamPredicate streamable)
+    : _serverSocket_(serverSocket),
+      _idleTimeoutSeconds_(idleTimeoutSeconds),
+      _handler_(std::move(handler)),
+      _streamable_(std::move(streamable)),
+      _readBuffer_(READ_CHUNK_SIZE) {
+  // Make the server socket non-blocking so accept can be drained
+  int flags = fcntl(_serverSocket_, F_GETFL, 0);
+  fcntl(_serverSocket_, F_SETFL, flags | O_NONBLOCK);
+
+  // Create the epoll instance and the worker wake-up descriptor
+  _epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  _wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_epollFd_ == -1 || _wakeFd_ == -1) {
+    std::cerr << "Error: Event loop could not be created!" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // Register both descriptors for edge-triggered reads
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = SERVER_TAG;
+  epoll_ctl(_epollFd_, EPOLL_CTL_ADD, _serverSocket_, &event);
+  event.data.u64 = WAKE_TAG;
+  epoll_ctl(_epollFd_, EPOLL_CTL_ADD, _wakeFd_, &event);
+}
+
+EventLoop::~EventLoop() {
+  // Close every remaining client connection
+  for (auto& entry : _connections_) {
+    close(entry.second->socket);
+  }
+#ifdef HAVE_IO_URING
+  for (auto& entry : _closing_) {
+    close(entry.second->socket);
+  }
+#endif  // HAVE_IO_URING
+  close(_wakeFd_);
+  close(_epollFd_);
+}
+
+void EventLoop::setMetrics(ServerMetrics* metrics) { _metrics_ = metrics; }
+
+void EventLoop::setBufferPool(BufferPool* pool) { _buffers_ = pool; }
+
+void EventLoop::setMaxInFlight(size_t requests) {
+  _maxInFlight_ = std::max<size_t>(1, requests);
+}
+
+void EventLoop::setMaxConnections(size_t connections) {
+  _maxConnections_ = std::max<size_t>(1, connections);
+}
+
+uint64_t EventLoop::refusedConnections() const {
+  return _refusedConnections_;
+}
+
+bool EventLoop::useIoUring() {
+#ifdef HAVE_IO_URING
+  auto ring = std::make_unique<IoUring>();
+  if (!ring->open(RING_ENTRIES) ||
+      !ring->provideBuffers(RECEIVE_GROUP, RECEIVE_BUFFER_COUNT,
+                            RECEIVE_BUFFER_SIZE)) {
+    return false;
+  }
+  _ring_ = std::move(ring);
+  return true;
+#else
+  return false;
+#endif  // HAVE_IO_URING
+}
+
+void EventLoop::_countSystemCalls_(uint64_t calls) {
+  if (_metrics_) _metrics_->addSystemCalls(calls);
+}
+
+void EventLoop::run() {
+#ifdef HAVE_IO_URING
+  if (_ring_) {
+    _runRing_();
+    return;
+  }
+#endif  // HAVE_IO_URING
+
+  std::vector<epoll_event> events(256);
+  auto lastSweep = std::chrono::steady_clock::now();
+
+  while (true) {
+    // Wake at least once a second to expire idle connections
+    int ready = epoll_wait(_epollFd_, events.data(),
+                           static_cast<int>(events.size()), 1000);
+    _countSystemCalls_(1);
+    if (ready == -1) {
+      if (errno == EINTR) continue;
+      std::cerr << "Error: Event loop wait failed!" << std::endl;
+      return;
+    }
+
+    for (int i = 0; i < ready; ++i) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == SERVER_TAG) {
+        _acceptConnections_();
+        continue;
+      }
+      if (tag == WAKE_TAG) {
+        // Reset the wake-up counter before taking the responses
+        uint64_t signal;
+        while (read(_wakeFd_, &signal, sizeof(signal)) > 0) {
+          _countSystemCalls_(1);
+        }
+        _countSystemCalls_(1);
+        _drainCompleted_();
+        continue;
+      }
+
+      // Look up the client connection, which may already be closed
+      auto it = _connections_.find(tag);
+      if (it == _connections_.end()) continue;
+      Connection& connection = *it->second;
+
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        _closeConnection_(tag);
+        continue;
+      }
+      if (events[i].events & EPOLLOUT) {
+        if (!_writeConnection_(tag, connection)) {
+          _closeConnection_(tag);
+          continue;
+        }
+        if (connection.peerClosed && connection.inFlight == 0 &&
+            connection.outgoing.empty()) {
+          _closeConnection_(tag);
+          continue;
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+        _readConnection_(tag, connection);
+      }
+    }
+
+    // Expire idle connections
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastSweep >= std::chrono::seconds(1)) {
+      _closeIdleConnections_();
+      _resumeAccepting_();
+      lastSweep = now;
+    }
+  }
+}
+
+void EventLoop::respond(uint64_t connectionId, uint32_t requestId,
+                        ImageReply reply) {
+  // Move the reply in, whose bytes are given back to the pool once written
+  _complete_(
+      {connectionId, requestId, CompletionKind::Reply, std::move(reply)});
+}
+
+void EventLoop::respondPart(uint64_t connectionId, uint32_t requestId,
+                            ImageReply part) {
+  _complete_({connectionId, requestId, CompletionKind::Part, std::move(part)});
+}
+
+void EventLoop::endResponse(uint64_t connectionId, uint32_t requestId,
+                            bool complete) {
+  _complete_({connectionId, requestId,
+              complete ? CompletionKind::End : CompletionKind::Abort,
+              ImageReply()});
+}
+
+void EventLoop::_complete_(Completion completion) {
+  bool idle;
+  {
+    std::lock_guard<std::mutex> guard(_completedMutex_);
+    idle = _completed_.empty();
+    _completed_.push_back(std::move(completion));
+  }
+
+  // Wake the loop to write the response, where only the first response
+  // since the loop last took them needs to wake it
+  if (!idle) return;
+  uint64_t signal = 1;
+  ssize_t written = write(_wakeFd_, &signal, sizeof(signal));
+  (void)written;
+  _countSystemCalls_(1);
+}
+
+void EventLoop::_acceptConnections_() {
+  // Accept until the backlog is drained
+  while (true) {
+    sockaddr_in clientAddr{};
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    int clientSocket =
+        accept4(_serverSocket_, (struct sockaddr*)&clientAddr, &clientAddrLen,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+    _countSystemCalls_(1);
+    if (clientSocket == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        _pauseAccepting_();
+        return;
+      }
+
+      // Report the next failure again once the backlog has drained
+      _acceptFailureReported_ = false;
+      return;
+    }
+    _addConnection_(clientSocket, clientAddr);
+  }
+}
+
+void EventLoop::_pauseAccepting_() {
+  // The connections left in the backlog raise no new edge, and accepting
+  // again would fail at once, so wait until a socket closes, reporting the
+  // failure only once
+  if (!_acceptFailureReported_) {
+    std::cerr << "Error: Client connection could not be established!"
+              << std::endl;
+    _acceptFailureReported_ = true;
+  }
+  _acceptPaused_ = true;
+}
+
+void EventLoop::_resumeAccepting_() {
+  if (!_acceptPaused_) return;
+  _acceptPaused_ = false;
+
+#ifdef HAVE_IO_URING
+  // The next pass of the ring queues the accept again
+  if (_ring_) return;
+#endif  // HAVE_IO_URING
+  _acceptConnections_();
+}
+
+void EventLoop::_addConnection_(int clientSocket,
+                                const sockaddr_in& clientAddr) {
+  // Refuse connections beyond the limit instead of queueing their work
+  if (_connections_.size() >= _maxConnections_) {
+    close(clientSocket);
+    _countSystemCalls_(1);
+    _refusedConnections_++;
+    return;
+  }
+
+  // Send replies as soon as they are written
+  int noDelay = 1;
+  setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+             sizeof(noDelay));
+  _countSystemCalls_(1);
+
+  // Register the connection with the loop
+  uint64_t connectionId = _nextConnectionId_++;
+  auto connection = std::make_unique<Connection>();
+  connection->socket = clientSocket;
+  connection->clientAddress = clientAddr.sin_addr.s_addr;
+  connection->lastActivity = std::chrono::steady_clock::now();
+
+  bool ringDriven = false;
+#ifdef HAVE_IO_URING
+  ringDriven = _ring_ != nullptr;
+#endif  // HAVE_IO_URING
+  if (!ringDriven) {
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = connectionId;
+    _countSystemCalls_(1);
+    if (epoll_ctl(_epollFd_, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+      close(clientSocket);
+      return;
+    }
+  }
+  Connection& added = *connection;
+  _connections_.emplace(connectionId, std::move(connection));
+  if (_metrics_) _metrics_->connectionOpened();
+
+  char clientIP[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
+  std::cout << "Client connected: " << clientIP << std::endl;
+
+  // Start receiving straight away, as io_uring reports no readiness
+  if (ringDriven) {
+    _readConnection_(connectionId, added);
+  }
+}
+
+void EventLoop::_readConnection_(uint64_t connectionId,
+                                 Connection& connection) {
+#ifdef HAVE_IO_URING
+  if (_ring_) {
+    _queueReceive_(connectionId, connection);
+    return;
+  }
+#endif  // HAVE_IO_URING
+
+  // Read until the socket would block
+  while (true) {
+    uchar* destination;
+    size_t length;
+    if (!_receiveTarget_(connection, destination, length)) {
+      connection.readPaused = true;
+      return;
+    }
+
+    bool direct = destination != nullptr;
+    ssize_t bytesReceived =
+        recv(connection.socket, direct ? destination : _readBuffer_.data(),
+             direct ? length : _readBuffer_.size(), 0);
+    _countSystemCalls_(1);
+
+    if (bytesReceived > 0) {
+      if (!_received_(connectionId, connection,
+                      direct ? nullptr : _readBuffer_.data(),
+                      bytesReceived)) {
+        return;
+      }
+      continue;
+    }
+
+    if (bytesReceived == 0) {
+      connection.peerClosed = true;
+      break;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+
+    // Treat any other error as a closed connection
+    connection.peerClosed = true;
+    break;
+  }
+
+  _finishReading_(connectionId, connection);
+}
+
+bool EventLoop::_receiveTarget_(Connection& connection, uchar*& destination,
+                                size_t& length) {
+  // Stop reading while the connection is at its limit, leaving the rest
+  // in the socket so TCP flow control slows the client down
+  bool atLimit = connection.inFlight >= _maxInFlight_ && !connection.stream;
+  if (atLimit && connection.backlog.size() >= READ_CHUNK_SIZE) {
+    return false;
+  }
+
+  // Receive image bytes straight into the request, or the stream of a
+  // request in flight, when nothing is queued
+  destination = nullptr;
+  length = READ_CHUNK_SIZE;
+  if (!atLimit && connection.backlog.empty() &&
+      connection.state == ReadState::Image) {
+    uchar* payload = connection.stream ? connection.stream->data()
+                                       : connection.request.image.data();
+    destination = payload + connection.filled;
+    length = connection.pendingLength - connection.filled;
+  }
+  return true;
+}
+
+bool EventLoop::_received_(uint64_t connectionId, Connection& connection,
+                           const uchar* data, size_t length) {
+  // Take bytes received elsewhere into the backlog, where bytes received
+  // straight into the request have no data to copy
+  connection.lastActivity = std::chrono::steady_clock::now();
+  if (_metrics_) _metrics_->addBytesReceived(length);
+  if (data) {
+    connection.backlog.insert(connection.backlog.end(), data, data + length);
+  } else {
+    connection.filled += length;
+  }
+
+  // Dispatch requests once they have fully arrived
+  _dispatchNext_(connectionId, connection);
+  return _connections_.find(connectionId) != _connections_.end();
+}
+
+void EventLoop::_finishReading_(uint64_t connectionId,
+                                Connection& connection) {
+  // A payload cut short will never finish streaming
+  if (connection.peerClosed && connection.stream) {
+    connection.stream->fail();
+    connection.stream.reset();
+  }
+
+  // Close once the client has gone and nothing is left to deliver
+  if (connection.peerClosed && connection.inFlight == 0 &&
+      connection.outgoing.empty()) {
+    _closeConnection_(connectionId);
+  }
+}
+
+EventLoop::ParseResult EventLoop::_parseBytes_(Connection& connection,
+                                               const uchar* data,
+                                               size_t length,
+                                               size_t& consumed) {
+  consumed = 0;
+  Request& request = connection.request;
+
+  while (true) {
+    switch (connection.state) {
+      case ReadState::Header: {
+        // Collect the fixed header
+        size_t take = std::min(REQUEST_HEADER_SIZE - connection.filled,
+                               length - consumed);
+        if (take > 0 && connection.filled == 0) {
+          connection.requestStarted = std::chrono::steady_clock::now();
+        }
+        if (take > 0) {
+          std::memcpy(connection.headerBytes + connection.filled,
+                      data + consumed, take);
+        }
+        connection.filled += take;
+        consumed += take;
+        if (connection.filled < REQUEST_HEADER_SIZE) {
+          return ParseResult::Incomplete;
+        }
+
+        RequestHeader header;
+        if (!decodeRequestHeader(connection.headerBytes, header)) {
+          return ParseResult::Invalid;
+        }
+
+        // Size the steps and remember the payload length that follows them
+        request.requestId = header.requestId;
+        request.deadlineMs = header.deadlineMs;
+        request.clientAddress = connection.clientAddress;
+        request.format = header.format;
+        request.steps.resize(header.stepCount);
+        connection.stepBytes.resize(header.stepCount * REQUEST_STEP_SIZE);
+        connection.pendingLength = header.payloadLength;
+        connection.filled = 0;
+        connection.state = ReadState::Steps;
+        break;
+      }
+      case ReadState::Steps: {
+        // Collect every step
+        size_t take = std::min(connection.stepBytes.size() - connection.filled,
+                               length - consumed);
+        if (take > 0) {
+          std::memcpy(connection.stepBytes.data() + connection.filled,
+                      data + consumed, take);
+        }
+        connection.filled += take;
+        consumed += take;
+        if (connection.filled < connection.stepBytes.size()) {
+          return ParseResult::Incomplete;
+        }
+        decodeRequestSteps(connection.stepBytes.data(), request.steps);
+        connection.filled = 0;
+        connection.state = ReadState::Image;
+
+        if (_streamable_ && _streamable_(request, connection.pendingLength)) {
+          // Dispatch now and stream the payload to the request
+          connection.stream =
+              std::make_shared<ImageStream>(connection.pendingLength);
+          request.stream = connection.stream;
+          return ParseResult::Streaming;
+        }
+        if (_buffers_) {
+          request.image = _buffers_->acquireBytes(connection.pendingLength);
+        } else {
+          request.image.resize(connection.pendingLength);
+        }
+        break;
+      }
+      case ReadState::Image: {
+        // Copy the payload bytes into the request or its stream
+        uchar* destination = connection.stream ? connection.stream->data()
+                                               : request.image.data();
+        size_t take = std::min(connection.pendingLength - connection.filled,
+                               length - consumed);
+        if (take > 0) {
+          std::memcpy(destination + connection.filled, data + consumed, take);
+        }
+        connection.filled += take;
+        consumed += take;
+        if (connection.stream) {
+          connection.stream->publish(connection.filled);
+        }
+        if (connection.filled < connection.pendingLength) {
+          return ParseResult::Incomplete;
+        }
+
+        // Move on to the next request
+        connection.filled = 0;
+        connection.state = ReadState::Header;
+        if (connection.stream) {
+          connection.stream.reset();
+          return ParseResult::Streamed;
+        }
+        return ParseResult::Complete;
+      }
+    }
+  }
+}
+
+void EventLoop::_dispatchNext_(uint64_t connectionId, Connection& connection) {
+  // Dispatch requests until the connection reaches its limit, but a
+  // streamed payload keeps arriving while its request is processed
+  while (connection.inFlight < _maxInFlight_ || connection.stream) {
+    size_t consumed;
+    ParseResult result =
+        _parseBytes_(connection, connection.backlog.data(),
+                     connection.backlog.size(), consumed);
+    connection.backlog.erase(connection.backlog.begin(),
+                             connection.backlog.begin() + consumed);
+
+    if (result == ParseResult::Invalid) {
+      std::cerr << "Error: Client sent an invalid request!" << std::endl;
+      _closeConnection_(connectionId);
+      return;
+    }
+    if (result == ParseResult::Incomplete) return;
+
+    // Record the time from the first byte of the request to its last
+    if (_metrics_ && result != ParseResult::Streaming) {
+      _metrics_->recordStage(Stage::Receive, connection.requestStarted);
+    }
+    if (result == ParseResult::Streamed) continue;
+
+    // Hand the request to the worker threads without waiting for it
+    connection.inFlight++;
+    Request request = std::move(connection.request);
+    connection.request = Request();
+    _handler_(connectionId, std::move(request));
+  }
+}
+
+bool EventLoop::_writeConnection_(uint64_t connectionId,
+                                  Connection& connection) {
+#ifdef HAVE_IO_URING
+  if (_ring_) {
+    return _queueSend_(connectionId, connection);
+  }
+#else
+  (void)connectionId;
+#endif  // HAVE_IO_URING
+
+  // Write queued responses, gathered into one call, until the socket
+  // would block
+  while (true) {
+    _releaseWritten_(connection);
+    _gatherOutgoing_(connection, _sendVectors_);
+    if (_sendVectors_.empty()) return true;
+
+    size_t gathered = 0;
+    for (const iovec& vector : _sendVectors_) gathered += vector.iov_len;
+    msghdr message{};
+    message.msg_iov = _sendVectors_.data();
+    message.msg_iovlen = _sendVectors_.size();
+    ssize_t bytesSent = sendmsg(connection.socket, &message, MSG_NOSIGNAL);
+    _countSystemCalls_(1);
+    if (bytesSent >= 0) {
+      connection.outgoingOffset += bytesSent;
+      if (_metrics_) _metrics_->addBytesSent(bytesSent);
+
+      // A short send means the socket buffer is full, so wait for the next
+      // edge instead of calling again only to be told so
+      if (static_cast<size_t>(bytesSent) < gathered) {
+        _releaseWritten_(connection);
+        return true;
+      }
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+    return false;
+  }
+}
+
+void EventLoop::_gatherOutgoing_(const Connection& connection,
+                                 std::vector<iovec>& vectors) {
+  // Gather the bytes and pixels of the queued replies, skipping what has
+  // already been written
+  vectors.clear();
+  size_t skip = connection.outgoingOffset;
+  for (const Outgoing& entry : connection.outgoing) {
+    if (vectors.size() + 3 > MAX_SEND_VECTORS) break;
+    for (const BufferView& piece : entry.reply.pieces()) {
+      if (skip < piece.length) {
+        uchar* data = static_cast<uchar*>(const_cast<void*>(piece.data));
+        vectors.push_back({data + skip, piece.length - skip});
+        skip = 0;
+      } else {
+        skip -= piece.length;
+      }
+    }
+  }
+}
+
+void EventLoop::_releaseWritten_(Connection& connection) {
+  // Drop the replies at the front of the queue that have been written
+  while (!connection.outgoing.empty()) {
+    Outgoing& entry = connection.outgoing.front();
+    size_t length = entry.reply.length();
+    if (connection.outgoingOffset < length) return;
+
+    // Record how long the finished reply took to write
+    if (entry.endsReply && _metrics_) {
+      _metrics_->recordStage(Stage::Send, entry.queued);
+    }
+    if (_buffers_) {
+      _buffers_->releaseBytes(std::move(entry.reply.bytes));
+    }
+    connection.outgoingOffset -= length;
+    connection.outgoing.pop_front();
+  }
+}
+
+void EventLoop::_queueCompletion_(Connection& connection,
+                                  Completion completion) {
+  // Hold back other replies until a streamed reply has been written
+  if (connection.replyStreaming &&
+      completion.requestId != connection.streamingId) {
+    connection.deferred.push_back(std::move(completion));
+    return;
+  }
+
+  Outgoing entry;
+  entry.queued = std::chrono::steady_clock::now();
+  switch (completion.kind) {
+    case CompletionKind::Reply: {
+      // Queue the header naming the request, then the reply without
+      // copying it
+      const ImageReply& reply = completion.reply;
+      Outgoing header;
+      header.reply.bytes = encodeReplyHeader(completion.requestId,
+                                             reply.length(), reply.status);
+      connection.outgoing.push_back(std::move(header));
+
+      entry.reply = std::move(completion.reply);
+      entry.endsReply = true;
+      connection.outgoing.push_back(std::move(entry));
+      connection.inFlight--;
+      break;
+    }
+    case CompletionKind::Part:
+      // The first part carries the reply header, so the parts that follow
+      // must not be separated from it
+      connection.replyStreaming = true;
+      connection.streamingId = completion.requestId;
+      entry.reply = std::move(completion.reply);
+      connection.outgoing.push_back(std::move(entry));
+      break;
+    case CompletionKind::End: {
+      entry.endsReply = true;
+      connection.outgoing.push_back(std::move(entry));
+      connection.inFlight--;
+
+      // Release the replies that finished while the stream was written
+      connection.replyStreaming = false;
+      std::vector<Completion> deferred;
+      deferred.swap(connection.deferred);
+      for (Completion& held : deferred) {
+        _queueCompletion_(connection, std::move(held));
+      }
+      break;
+    }
+    case CompletionKind::Abort:
+      break;
+  }
+}
+
+void EventLoop::_drainCompleted_() {
+  // Take every finished response in one go
+  std::vector<Completion> completed;
+  {
+    std::lock_guard<std::mutex> guard(_completedMutex_);
+    completed.swap(_completed_);
+  }
+
+  for (Completion& completion : completed) {
+    uint64_t connectionId = completion.connectionId;
+    auto it = _connections_.find(connectionId);
+    if (it == _connections_.end()) continue;
+    Connection& connection = *it->second;
+
+    // The framing of a cut-short streamed reply cannot be recovered
+    if (completion.kind == CompletionKind::Abort) {
+      _closeConnection_(connectionId);
+      continue;
+    }
+
+    _queueCompletion_(connection, std::move(completion));
+    connection.lastActivity = std::chrono::steady_clock::now();
+
+    if (!_writeConnection_(connectionId, connection)) {
+      _closeConnection_(connectionId);
+      continue;
+    }
+    if (connection.peerClosed) {
+      if (connection.inFlight == 0 && connection.outgoing.empty()) {
+        _closeConnection_(connectionId);
+      }
+      continue;
+    }
+
+    // Start on any requests that arrived while the connection was at its
+    // limit, then carry on reading if that had stopped
+    _dispatchNext_(connectionId, connection);
+    if (_connections_.find(connectionId) == _connections_.end()) continue;
+    if (connection.readPaused && connection.inFlight < _maxInFlight_) {
+      connection.readPaused = false;
+      _readConnection_(connectionId, connection);
+    }
+  }
+}
+
+void EventLoop::_closeIdleConnections_() {
+  auto now = std::chrono::steady_clock::now();
+  auto timeout = std::chrono::seconds(_idleTimeoutSeconds_);
+
+  // Collect idle connections first so the map is not modified mid-iteration
+  std::vector<uint64_t> idle;
+  for (auto& entry : _connections_) {
+    const Connection& connection = *entry.second;
+    // A stalled upload holds a worker, so close it even with replies queued
+    if ((connection.stream ||
+         (connection.inFlight == 0 && connection.outgoing.empty())) &&
+        now - connection.lastActivity > timeout) {
+      idle.push_back(entry.first);
+    }
+  }
+
+  for (uint64_t connectionId : idle) {
+    _closeConnection_(connectionId);
+  }
+}
+
+void EventLoop::_closeConnection_(uint64_t connectionId) {
+  auto it = _connections_.find(connectionId);
+  if (it == _connections_.end()) return;
+
+  // Release a worker still waiting on the payload
+  if (it->second->stream) {
+    it->second->stream->fail();
+  }
+
+#ifdef HAVE_IO_URING
+  if (_ring_) {
+    std::unique_ptr<Connection> connection = std::move(it->second);
+    _connections_.erase(it);
+    if (_metrics_) _metrics_->connectionClosed();
+
+    // Cut short a receive or send in flight and keep its buffers until the
+    // kernel hands them back, closing the socket then
+    if (connection->receiving || connection->sending) {
+      shutdown(connection->socket, SHUT_RDWR);
+      _countSystemCalls_(1);
+      _closing_.emplace(connectionId, std::move(connection));
+      return;
+    }
+    close(connection->socket);
+    _countSystemCalls_(1);
+    _resumeAccepting_();
+    return;
+  }
+#endif  // HAVE_IO_URING
+
+  // Deregister and close the socket
+  epoll_ctl(_epollFd_, EPOLL_CTL_DEL, it->second->socket, nullptr);
+  close(it->second->socket);
+  _countSystemCalls_(2);
+  _connections_.erase(it);
+  if (_metrics_) _metrics_->connectionClosed();
+  _resumeAccepting_();
+}
+
+#ifdef HAVE_IO_URING
+
+void EventLoop::_runRing_() {
+  auto lastSweep = std::chrono::steady_clock::now();
+
+  while (true) {
+    // Queue the accept and the wake-up read again once they have ended
+    if (!_acceptQueued_ && !_acceptPaused_) _queueAccept_();
+    if (!_wakeQueued_) _queueWake_();
+
+    // Retry the receives and sends that could not be queued before
+    std::vector<uint64_t> retry;
+    retry.swap(_retry_);
+    for (uint64_t connectionId : retry) {
+      auto it = _connections_.find(connectionId);
+      if (it == _connections_.end()) continue;
+      _readConnection_(connectionId, *it->second);
+      _writeConnection_(connectionId, *it->second);
+    }
+
+    // Submit everything queued in this pass with one call, waking at least
+    // once a second to expire idle connections
+    int result = _ring_->submitAndWait(1000);
+    if (result < 0 && result != -EAGAIN && result != -EBUSY) {
+      std::cerr << "Error: Event loop wait failed!" << std::endl;
+      return;
+    }
+
+    io_uring_cqe completion;
+    while (_ring_->nextCompletion(completion)) {
+      _handleCompletion_(completion);
+    }
+
+    uint64_t enterCalls = _ring_->enterCalls();
+    _countSystemCalls_(enterCalls - _enterCallsCounted_);
+    _enterCallsCounted_ = enterCalls;
+
+    // Expire idle connections
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastSweep >= std::chrono::seconds(1)) {
+      _closeIdleConnections_();
+      _resumeAccepting_();
+      lastSweep = now;
+    }
+  }
+}
+
+io_uring_sqe* EventLoop::_queueEntry_(uint64_t tag, uint64_t operation) {
+  io_uring_sqe* entry = _ring_->nextEntry();
+  if (entry) {
+    entry->user_data = (tag << OPERATION_BITS) | operation;
+  }
+  return entry;
+}
+
+void EventLoop::_queueAccept_() {
+  io_uring_sqe* entry = _queueEntry_(SERVER_TAG, RECEIVE_OPERATION);
+  if (!entry) return;
+
+  // One multishot accept keeps accepting until it fails
+  entry->opcode = IORING_OP_ACCEPT;
+  entry->fd = _serverSocket_;
+  entry->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  if (_acceptMultishot_) {
+    entry->ioprio = IORING_ACCEPT_MULTISHOT;
+  }
+  _acceptQueued_ = true;
+}
+
+void EventLoop::_queueWake_() {
+  io_uring_sqe* entry = _queueEntry_(WAKE_TAG, RECEIVE_OPERATION);
+  if (!entry) return;
+
+  // Reading the counter resets it, so no further call is needed
+  entry->opcode = IORING_OP_READ;
+  entry->fd = _wakeFd_;
+  entry->addr = reinterpret_cast<uint64_t>(&_wakeCount_);
+  entry->len = sizeof(_wakeCount_);
+  _wakeQueued_ = true;
+}
+
+void EventLoop::_queueReceive_(uint64_t connectionId,
+                               Connection& connection) {
+  if (connection.receiving || connection.peerClosed) return;
+
+  uchar* destination;
+  size_t length;
+  if (!_receiveTarget_(connection, destination, length)) {
+    connection.readPaused = true;
+    return;
+  }
+
+  io_uring_sqe* entry = _queueEntry_(connectionId, RECEIVE_OPERATION);
+  if (!entry) {
+    _retry_.push_back(connectionId);
+    return;
+  }
+  entry->opcode = IORING_OP_RECV;
+  entry->fd = connection.socket;
+  if (destination) {
+    entry->addr = reinterpret_cast<uint64_t>(destination);
+    entry->len = static_cast<uint32_t>(std::min<size_t>(length, INT32_MAX));
+  } else {
+    // Let the kernel pick a buffer once bytes arrive, so idle connections
+    // hold none
+    entry->flags = IOSQE_BUFFER_SELECT;
+    entry->buf_group = RECEIVE_GROUP;
+  }
+  connection.receiving = true;
+}
+
+bool EventLoop::_queueSend_(uint64_t connectionId, Connection& connection) {
+  if (connection.sending) return true;
+  _releaseWritten_(connection);
+
+  // Gather the bytes and pixels of the queued replies into one send
+  std::vector<iovec>& vectors = connection.sendVectors;
+  _gatherOutgoing_(connection, vectors);
+  if (vectors.empty()) return true;
+
+  io_uring_sqe* entry = _queueEntry_(connectionId, SEND_OPERATION);
+  if (!entry) {
+    _retry_.push_back(connectionId);
+    return true;
+  }
+  connection.sendMessage = msghdr{};
+  connection.sendMessage.msg_iov = vectors.data();
+  connection.sendMessage.msg_iovlen = vectors.size();
+  entry->opcode = IORING_OP_SENDMSG;
+  entry->fd = connection.socket;
+  entry->addr = reinterpret_cast<uint64_t>(&connection.sendMessage);
+  entry->len = 1;
+  entry->msg_flags = MSG_NOSIGNAL;
+  connection.sending = true;
+  return true;
+}
+
+void EventLoop::_handleCompletion_(const io_uring_cqe& completion) {
+  uint64_t tag = completion.user_data >> OPERATION_BITS;
+  uint64_t operation = completion.user_data & ((1u << OPERATION_BITS) - 1);
+
+  if (tag == SERVER_TAG) {
+    if (!(completion.flags & IORING_CQE_F_MORE)) _acceptQueued_ = false;
+
+    // Fall back to one accept at a time on kernels without multishot
+    if (completion.res == -EINVAL && _acceptMultishot_) {
+      _acceptMultishot_ = false;
+      return;
+    }
+    if (completion.res < 0) {
+      if (completion.res == -EINTR || completion.res == -EAGAIN ||
+          completion.res == -ECONNABORTED) {
+        return;
+      }
+
+      _pauseAccepting_();
+      return;
+    }
+    _acceptFailureReported_ = false;
+
+    // Look up the client address, which a multishot accept cannot return
+    sockaddr_in clientAddr{};
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    getpeername(completion.res, (struct sockaddr*)&clientAddr,
+                &clientAddrLen);
+    _countSystemCalls_(1);
+    _addConnection_(completion.res, clientAddr);
+    return;
+  }
+  if (tag == WAKE_TAG) {
+    _wakeQueued_ = false;
+    _drainCompleted_();
+    return;
+  }
+
+  // Give back a buffer the kernel picked for a receive that is not used
+  bool selected = completion.flags & IORING_CQE_F_BUFFER;
+  uint16_t bufferId =
+      static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+
+  // Close the socket of a closed connection once the kernel is done with it
+  auto closing = _closing_.find(tag);
+  if (closing != _closing_.end()) {
+    Connection& connection = *closing->second;
+    if (selected) _ring_->recycleBuffer(bufferId);
+    if (operation == RECEIVE_OPERATION) {
+      connection.receiving = false;
+    } else {
+      connection.sending = false;
+    }
+    if (!connection.receiving && !connection.sending) {
+      close(connection.socket);
+      _countSystemCalls_(1);
+      _closing_.erase(closing);
+      _resumeAccepting_();
+    }
+    return;
+  }
+
+  auto it = _connections_.find(tag);
+  if (it == _connections_.end()) {
+    if (selected) _ring_->recycleBuffer(bufferId);
+    return;
+  }
+  if (operation == RECEIVE_OPERATION) {
+    _ringReceived_(tag, *it->second, completion);
+  } else {
+    _ringSent_(tag, *it->second, completion.res);
+  }
+}
+
+void EventLoop::_ringReceived_(uint64_t connectionId, Connection& connection,
+                               const io_uring_cqe& completion) {
+  connection.receiving = false;
+  bool selected = completion.flags & IORING_CQE_F_BUFFER;
+  uint16_t bufferId =
+      static_cast<uint16_t>(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+  int result = completion.res;
+
+  if (result > 0) {
+    // Copy the bytes out of a buffer the kernel picked and give it back
+    const uchar* data = selected ? _ring_->buffer(bufferId) : nullptr;
+    bool open = _received_(connectionId, connection, data, result);
+    if (selected) _ring_->recycleBuffer(bufferId);
+    if (open) _readConnection_(connectionId, connection);
+    return;
+  }
+  if (selected) _ring_->recycleBuffer(bufferId);
+
+  // Retry on the next pass, once buffers have been given back
+  if (result == -ENOBUFS || result == -EINTR || result == -EAGAIN) {
+    _retry_.push_back(connectionId);
+    return;
+  }
+
+  // Treat the end of the stream or any error as a closed connection
+  connection.peerClosed = true;
+  _finishReading_(connectionId, connection);
+}
+
+void EventLoop::_ringSent_(uint64_t connectionId, Connection& connection,
+                           int result) {
+  connection.sending = false;
+  if (result < 0 && result != -EINTR && result != -EAGAIN) {
+    _closeConnection_(connectionId);
+    return;
+  }
+  if (result > 0) {
+    connection.outgoingOffset += result;
+    if (_metrics_) _metrics_->addBytesSent(result);
+  }
+
+  // Send what was queued meanwhile, closing once the client has gone and
+  // nothing is left to deliver
+  _writeConnection_(connectionId, connection);
+  if (connection.peerClosed && connection.inFlight == 0 &&
+      connection.outgoing.empty()) {
+    _closeConnection_(connectionId);
+  }
+}
+
+#endif  // HAVE_IO_URING
+
+#endif  // __linux__
@@ -0,0 +1,333 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#ifdef __linux__
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif  // __linux__
+
+#include <opencv2/core/hal/interface.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bufferPool.h"
+#include "imageStream.h"
+#include "ioUring.h"
+#include "metrics.h"
+#include "peer.h"
+
+#ifndef SRC_EVENTLOOP_H_
+#define SRC_EVENTLOOP_H_
+
+#ifdef __linux__
+
+// Define a struct for a fully received request
+struct Request {
+  uint32_t requestId = 0;
+  uint32_t deadlineMs = 0;
+
+  // The IPv4 address of the client in network byte order
+  uint32_t clientAddress = 0;
+  std::vector<FilterStep> steps;
+  ImageFormat format = ImageFormat::Jpeg;
+  std::vector<uchar> image;
+
+  // The payload as it arrives, set instead of the image for requests that
+  // are dispatched before their payload has fully arrived
+  std::shared_ptr<ImageStream> stream;
+};
+
+// Define an edge-triggered epoll reactor that owns every client socket and
+// only hands fully received requests to the request handler, which can be
+// driven through io_uring instead where the kernel supports it
+class EventLoop {
+ public:
+  // Define the callback used to dispatch a complete request
+  using RequestHandler =
+      std::function<void(uint64_t connectionId, Request request)>;
+
+  // Define the callback that chooses requests to dispatch while their
+  // payload is still arriving
+  using StreamPredicate =
+      std::function<bool(const Request& request, size_t imageLength)>;
+
+ private:
+  // Define the read size for header bytes
+  const size_t READ_CHUNK_SIZE = 64 * 1024;
+
+  // Define an enumeration for the incremental request parser
+  enum class ReadState {
+    Header,
+    Steps,
+    Image,
+  };
+
+  // Define the outcomes of feeding bytes to the parser
+  enum class ParseResult {
+    Incomplete,
+    Complete,
+    Invalid,
+    // The request was dispatched and its payload is being streamed to it
+    Streaming,
+    // The streamed payload has fully arrived
+    Streamed,
+  };
+
+  // Define how a finished piece of work is handed back to a connection
+  enum class CompletionKind {
+    // A whole reply, sent after a length prefix
+    Reply,
+    // Part of a streamed reply, sent as it is
+    Part,
+    // The end of a streamed reply
+    End,
+    // A streamed reply that could not be finished
+    Abort,
+  };
+
+  // Define a struct for a piece of work handed back by a worker thread
+  struct Completion {
+    uint64_t connectionId;
+    uint32_t requestId;
+    CompletionKind kind;
+    ImageReply reply;
+  };
+
+  // Define a struct for bytes queued on a connection, where the send stage
+  // is recorded once the last piece of a reply has been written
+  struct Outgoing {
+    ImageReply reply;
+    bool endsReply = false;
+    std::chrono::steady_clock::time_point queued;
+  };
+
+  // Define a struct holding the state of one client connection
+  struct Connection {
+    int socket;
+    uint32_t clientAddress;
+    ReadState state = ReadState::Header;
+    size_t pendingLength = 0;
+    size_t filled = 0;
+    uchar headerBytes[REQUEST_HEADER_SIZE];
+    std::vector<uchar> stepBytes;
+    Request request;
+
+    // The payload being streamed to a request that is already in flight
+    std::shared_ptr<ImageStream> stream;
+
+    // Bytes received beyond the request currently being parsed
+    std::vector<uchar> backlog;
+
+    // Responses waiting to be written, with the offset into the first one
+    std::deque<Outgoing> outgoing;
+    size_t outgoingOffset = 0;
+
+    // The requests dispatched and not yet answered, and whether reading
+    // stopped because there were too many of them
+    size_t inFlight = 0;
+    bool readPaused = false;
+
+    // The request whose streamed reply is being written, and the replies
+    // held back until it ends, as its parts cannot be interleaved with them
+    bool replyStreaming = false;
+    uint32_t streamingId = 0;
+    std::vector<Completion> deferred;
+
+    bool peerClosed = false;
+    std::chrono::steady_clock::time_point lastActivity;
+
+    // When the current request started arriving
+    std::chrono::steady_clock::time_point requestStarted;
+
+#ifdef HAVE_IO_URING
+    // The io_uring receive and send in flight, and the pieces of the queued
+    // replies gathered into the send
+    bool receiving = false;
+    bool sending = false;
+    std::vector<iovec> sendVectors;
+    msghdr sendMessage{};
+#endif  // HAVE_IO_URING
+  };
+
+  // Define the sockets owned by the loop
+  int _serverSocket_;
+  int _epollFd_;
+  int _wakeFd_;
+
+  // Define the idle timeout for connections without work in flight
+  int _idleTimeoutSeconds_;
+
+  // Define how many requests of one connection may be in flight at once
+  size_t _maxInFlight_ = 1;
+
+  // Define how many connections may be open at once, where connections
+  // beyond the limit are closed as soon as they are accepted
+  size_t _maxConnections_ = SIZE_MAX;
+  std::atomic<uint64_t> _refusedConnections_{0};
+
+  // Define whether accepting stopped after a failure that would repeat at
+  // once, such as a full descriptor table, until a socket closes or the
+  // next idle sweep, and whether it was reported since the last accept
+  bool _acceptPaused_ = false;
+  bool _acceptFailureReported_ = false;
+
+  // Define the handler for complete requests
+  RequestHandler _handler_;
+
+  // Define the predicate for requests that are streamed
+  StreamPredicate _streamable_;
+
+  // Define the metrics that connections and traffic are recorded in
+  ServerMetrics* _metrics_ = nullptr;
+
+  // Define the pool that payloads are received into, where written replies
+  // give their bytes back
+  BufferPool* _buffers_ = nullptr;
+
+  // Define the open connections, keyed by connection ID
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> _connections_;
+  uint64_t _nextConnectionId_ = 2;
+
+  // Define the responses handed back by worker threads
+  std::vector<Completion> _completed_;
+  std::mutex _completedMutex_;
+
+  // Define a scratch buffer for socket reads
+  std::vector<uchar> _readBuffer_;
+
+  // Define the most pieces of queued replies gathered into one send, and
+  // a scratch array for the pieces of a gathered send
+  const size_t MAX_SEND_VECTORS = 64;
+  std::vector<iovec> _sendVectors_;
+
+#ifdef HAVE_IO_URING
+  // Define the size of the io_uring queue, and the number and size of the
+  // buffers the kernel receives into
+  const unsigned RING_ENTRIES = 4096;
+  const unsigned RECEIVE_BUFFER_COUNT = 1024;
+  const size_t RECEIVE_BUFFER_SIZE = 16 * 1024;
+
+  // Define connections closed with a receive or send still in flight, kept
+  // until the kernel hands back the buffers they use
+  std::unordered_map<uint64_t, std::unique_ptr<Connection>> _closing_;
+
+  // Define the io_uring instance, set when the loop is driven through it
+  std::unique_ptr<IoUring> _ring_;
+
+  // Define whether the accept and the wake-up read are queued, whether
+  // the kernel takes multishot accepts, and the counter the wake-up read
+  // fills in
+  bool _acceptQueued_ = false;
+  bool _acceptMultishot_ = true;
+  bool _wakeQueued_ = false;
+  uint64_t _wakeCount_ = 0;
+
+  // Define connections whose receive or send could not be queued, retried
+  // on the next pass, and the io_uring_enter calls already counted
+  std::vector<uint64_t> _retry_;
+  uint64_t _enterCallsCounted_ = 0;
+#endif  // HAVE_IO_URING
+
+  // Define functions to drive the loop
+  void _acceptConnections_();
+  void _pauseAccepting_();
+  void _resumeAccepting_();
+  void _addConnection_(int clientSocket, const sockaddr_in& clientAddr);
+  void _readConnection_(uint64_t connectionId, Connection& connection);
+  bool _receiveTarget_(Connection& connection, uchar*& destination,
+                       size_t& length);
+  bool _received_(uint64_t connectionId, Connection& connection,
+                  const uchar* data, size_t length);
+  void _finishReading_(uint64_t connectionId, Connection& connection);
+  ParseResult _parseBytes_(Connection& connection, const uchar* data,
+                           size_t length, size_t& consumed);
+  void _dispatchNext_(uint64_t connectionId, Connection& connection);
+  bool _writeConnection_(uint64_t connectionId, Connection& connection);
+  void _gatherOutgoing_(const Connection& connection,
+                        std::vector<iovec>& vectors);
+  void _releaseWritten_(Connection& connection);
+  void _queueCompletion_(Connection& connection, Completion completion);
+  void _drainCompleted_();
+  void _closeIdleConnections_();
+  void _closeConnection_(uint64_t connectionId);
+  void _complete_(Completion completion);
+  void _countSystemCalls_(uint64_t calls);
+
+#ifdef HAVE_IO_URING
+  // Define functions to drive the loop through io_uring, where every
+  // receive and send is queued and submitted once per pass
+  void _runRing_();
+  io_uring_sqe* _queueEntry_(uint64_t tag, uint64_t operation);
+  void _queueAccept_();
+  void _queueWake_();
+  void _queueReceive_(uint64_t connectionId, Connection& connection);
+  bool _queueSend_(uint64_t connectionId, Connection& connection);
+  void _handleCompletion_(const io_uring_cqe& completion);
+  void _ringReceived_(uint64_t connectionId, Connection& connection,
+                      const io_uring_cqe& completion);
+  void _ringSent_(uint64_t connectionId, Connection& connection, int result);
+#endif  // HAVE_IO_URING
+
+ public:
+  EventLoop(int serverSocket, int idleTimeoutSeconds, RequestHandler handler,
+            StreamPredicate streamable = nullptr);
+  ~EventLoop();
+
+  // Record connections, traffic and the receive and send stages
+  void setMetrics(ServerMetrics* metrics);
+
+  // Receive payloads into buffers from the pool and give the bytes of
+  // written replies back to it
+  void setBufferPool(BufferPool* pool);
+
+  // Let each connection have up to the given number of requests in flight,
+  // answered in the order they finish
+  void setMaxInFlight(size_t requests);
+
+  // Limit the open connections, returning how many were refused so far
+  void setMaxConnections(size_t connections);
+  uint64_t refusedConnections() const;
+
+  // Drive the sockets through io_uring instead of epoll, returning false if
+  // the kernel or the build does not support it
+  bool useIoUring();
+
+  // Run the reactor until an unrecoverable error occurs
+  void run();
+
+  // Hand a finished response back to the loop from any thread, which takes
+  // its bytes over
+  void respond(uint64_t connectionId, uint32_t requestId, ImageReply reply);
+
+  // Hand part of a streamed response, already framed, back to the loop
+  void respondPart(uint64_t connectionId, uint32_t requestId,
+                   ImageReply part);
+
+  // End a streamed response, closing the connection if it was cut short
+  void endResponse(uint64_t connectionId, uint32_t requestId, bool complete);
+};
+
+#endif  // __linux__
+
+#endif  // SRC_EVENTLOOP_H_
@@ -0,0 +1,148 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "filterRegistry.h"
+
+const OperationInfo* findOperation(const std::string& name) {
+  for (const OperationInfo& operation : OPERATION_REGISTRY) {
+    if (name == operation.name) {
+      return &operation;
+    }
+  }
+  return nullptr;
+}
+
+const OperationInfo* findOperation(Opcode opcode) {
+  size_t index = operationIndex(opcode);
+  return index < OPERATION_COUNT ? &OPERATION_REGISTRY[index] : nullptr;
+}
+
+// Find the position of a name among the choices of an operation
+static bool findChoice(const OperationInfo& info, const std::string& name,
+                       uint64_t& index) {
+  std::istringstream choices(info.choices);
+  std::string token;
+  for (index = 0; std::getline(choices, token, '|'); ++index) {
+    if (name == token) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parseStep(const std::string& operation, const std::string& param,
+               FilterStep& step) {
+  const OperationInfo* info = findOperation(operation);
+  if (!info || param.empty()) {
+    return false;
+  }
+  step.opcode = info->opcode;
+
+  // Check the parameter type and convert it to its wire form
+  switch (info->paramType) {
+    case ParamType::Integer: {
+      // Check if all characters are digits
+      size_t digits = param[0] == '-' ? 1 : 0;
+      if (digits == param.size() ||
+          !std::all_of(param.begin() + digits, param.end(), ::isdigit)) {
+        return false;
+      }
+      errno = 0;
+      long long value = std::strtoll(param.c_str(), nullptr, 10);
+      step.param = static_cast<uint64_t>(value);
+      return errno == 0;
+    }
+    case ParamType::Double: {
+      // Check if the string can be a double
+      char* end;
+      double value = std::strtod(param.c_str(), &end);
+      if (end == param.c_str() || *end != '\0') {
+        return false;
+      }
+      std::memcpy(&step.param, &value, sizeof(value));
+      return true;
+    }
+    case ParamType::Choice:
+      // Send the position of the matching choice
+      return findChoice(*info, param, step.param);
+    case ParamType::Kernel: {
+      // Split the choice from the optional radius and sigma
+      std::istringstream fields(param);
+      std::string name, radiusText, sigmaText, extra;
+      std::getline(fields, name, ':');
+      std::getline(fields, radiusText, ':');
+      std::getline(fields, sigmaText, ':');
+      uint64_t index;
+      if (std::getline(fields, extra) || !findChoice(*info, name, index)) {
+        return false;
+      }
+
+      // Check the radius is a whole number in range
+      uint64_t radius = 0;
+      if (!radiusText.empty()) {
+        if (radiusText.size() > 3 ||
+            !std::all_of(radiusText.begin(), radiusText.end(), ::isdigit)) {
+          return false;
+        }
+        radius = std::strtoull(radiusText.c_str(), nullptr, 10);
+        if (radius < 1 || radius > MAX_KERNEL_RADIUS) {
+          return false;
+        }
+      }
+
+      // Check the sigma is a positive number in range
+      float sigma = 0;
+      if (!sigmaText.empty()) {
+        char* end;
+        double value = std::strtod(sigmaText.c_str(), &end);
+        if (end == sigmaText.c_str() || *end != '\0' || !(value > 0) ||
+            value > MAX_KERNEL_RADIUS) {
+          return false;
+        }
+        sigma = static_cast<float>(value);
+      } else if (param.back() == ':') {
+        return false;
+      }
+
+      // Pack the fields into the parameter
+      uint32_t sigmaBits;
+      std::memcpy(&sigmaBits, &sigma, sizeof(sigmaBits));
+      step.param = index | radius << 16;
+      step.param |= static_cast<uint64_t>(sigmaBits) << 32;
+      return true;
+    }
+    case ParamType::Codec: {
+      // Split the choice from the optional quality
+      size_t colon = param.find(':');
+      uint64_t index;
+      if (!findChoice(*info, param.substr(0, colon), index)) {
+        return false;
+      }
+      step.param = index;
+      if (colon == std::string::npos) {
+        return true;
+      }
+
+      // Check the quality is a whole number in range
+      std::string qualityText = param.substr(colon + 1);
+      if (qualityText.empty() || qualityText.size() > 3 ||
+          !std::all_of(qualityText.begin(), qualityText.end(), ::isdigit)) {
+        return false;
+      }
+      uint64_t quality = std::strtoull(qualityText.c_str(), nullptr, 10);
+      if (quality > MAX_CODEC_QUALITY) {
+        return false;
+      }
+      step.param |= (quality + 1) << 16;
+      return true;
+    }
+    case ParamType::Handle:
+      // Accept the lowercase hexadecimal form produced by the client
+      if (param.size() > 16 ||
+          param.find_first_not_of("0123456789abcdef") != std::string::npos) {
+        return false;
+      }
+      step.param = std::strtoull(param.c_str(), nullptr, 16);
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,168 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#ifndef SRC_FILTERREGISTRY_H_
+#define SRC_FILTERREGISTRY_H_
+
+// Define the numeric opcode of every operation, which is part of the wire
+// protocol, so existing opcodes must never be renumbered
+enum class Opcode : uint16_t {
+  Resize = 1,
+  Rotate = 2,
+  Flip = 3,
+  Brightness = 4,
+  Contrast = 5,
+  Gamma = 6,
+  Colour = 7,
+  Smooth = 8,
+
+  // Reserved operations that upload an image once and name it by its
+  // handle in later requests
+  Store = 64,
+  Handle = 65,
+
+  // Reserved operation that replies with a snapshot of the server metrics
+  Stats = 66,
+
+  // Reserved operation that ends a chain, choosing the codec and quality
+  // of an encoded reply
+  Encode = 67,
+
+  // Reserved operation that starts the chain of every frame of a video
+  // stream, naming the stream so its filters are built once
+  Stream = 68,
+};
+
+// Define an enumeration for parameter types
+enum class ParamType : uint16_t {
+  Double,
+  Integer,
+  // One of the names listed in the operation's choices
+  Choice,
+  // A 64-bit image handle, written as up to 16 hexadecimal digits
+  Handle,
+  // A choice followed by an optional kernel radius and sigma, written as
+  // "<choice>[:<radius>[:<sigma>]]"
+  Kernel,
+  // A choice followed by an optional quality, written as
+  // "<choice>[:<quality>]"
+  Codec,
+};
+
+// Define the largest radius and sigma a kernel parameter may ask for
+constexpr int MAX_KERNEL_RADIUS = 255;
+
+// Define the largest quality a codec parameter may ask for
+constexpr int MAX_CODEC_QUALITY = 100;
+
+// Define a struct describing one operation to the client and the server
+struct OperationInfo {
+  Opcode opcode;
+  const char* name;
+  ParamType paramType;
+
+  // The accepted names of a choice parameter, separated by '|', where the
+  // parameter is sent as the position of the name
+  const char* choices;
+
+  // Whether the operation filters pixels and can be chained
+  bool isFilter;
+};
+
+// Define the registry of every operation, shared by the client and server
+constexpr OperationInfo OPERATION_REGISTRY[] = {
+    {Opcode::Resize, "resize", ParamType::Double, "", true},
+    {Opcode::Rotate, "rotate", ParamType::Double, "", true},
+    {Opcode::Flip, "flip", ParamType::Integer, "", true},
+    {Opcode::Brightness, "brightness", ParamType::Double, "", true},
+    {Opcode::Contrast, "contrast", ParamType::Double, "", true},
+    {Opcode::Gamma, "gamma", ParamType::Double, "", true},
+    {Opcode::Colour, "colour", ParamType::Choice, "rgb|hsv|grey|ycc|hsl",
+     true},
+    {Opcode::Smooth, "smooth", ParamType::Kernel, "gauss|box|sharp", true},
+    {Opcode::Store, "store", ParamType::Handle, "", false},
+    {Opcode::Handle, "handle", ParamType::Handle, "", false},
+    {Opcode::Stats, "stats", ParamType::Choice, "text|json", false},
+    {Opcode::Encode, "encode", ParamType::Codec, "jpeg|png|webp", false},
+    {Opcode::Stream, "stream", ParamType::Handle, "", false},
+};
+
+constexpr size_t OPERATION_COUNT =
+    sizeof(OPERATION_REGISTRY) / sizeof(OPERATION_REGISTRY[0]);
+
+// Find the registry position of an opcode, or OPERATION_COUNT if unknown
+constexpr size_t operationIndex(Opcode opcode) {
+  for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+    if (OPERATION_REGISTRY[i].opcode == opcode) {
+      return i;
+    }
+  }
+  return OPERATION_COUNT;
+}
+
+// Define the choices of the stats operation
+enum class StatsFormat : uint64_t {
+  Text = 0,
+  Json = 1,
+};
+
+// Define the choices of the encode operation
+enum class Codec : uint64_t {
+  Jpeg = 0,
+  Png = 1,
+  Webp = 2,
+};
+
+// Define a struct for one step of a filter chain, holding its parameter
+// in wire form: the bits of a double, a two's complement integer, the
+// position of a choice, a packed kernel or codec, or an image handle
+struct FilterStep {
+  Opcode opcode;
+  uint64_t param = 0;
+
+  // Read the parameter as the type given by the registry
+  double number() const {
+    double value;
+    std::memcpy(&value, &param, sizeof(value));
+    return value;
+  }
+  int64_t integer() const { return static_cast<int64_t>(param); }
+
+  // Read a kernel parameter, packed as the choice in the low 16 bits, the
+  // radius in the next 16 and the bits of a float sigma in the top 32, where
+  // a zero radius or sigma is left for the server to choose
+  uint64_t choice() const { return param & 0xFFFF; }
+  int radius() const { return static_cast<int>((param >> 16) & 0xFFFF); }
+  double sigma() const {
+    uint32_t bits = static_cast<uint32_t>(param >> 32);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  // Read a codec parameter, packed as the choice in the low 16 bits and one
+  // more than the quality in the next 16, returning -1 when the quality is
+  // left for the server to choose
+  int quality() const { return static_cast<int>((param >> 16) & 0xFFFF) - 1; }
+};
+
+// Find an operation by name or by opcode, returning nullptr if unknown
+const OperationInfo* findOperation(const std::string& name);
+const OperationInfo* findOperation(Opcode opcode);
+
+// Build a step from the text of an operation and its parameter, returning
+// false if either is unusable
+bool parseStep(const std::string& operation, const std::string& param,
+               FilterStep& step);
+
+#endif  // SRC_FILTERREGISTRY_H_
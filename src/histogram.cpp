@@ -0,0 +1,107 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "histogram.h"
+
+int LatencyHistogram::_bucketOf_(uint64_t value) {
+  // Small values get a bucket each
+  if (value < SUB_BUCKETS) {
+    return static_cast<int>(value);
+  }
+
+  // Larger values share one of 64 buckets within their power of two
+#if defined(__GNUC__) || defined(__clang__)
+  int exponent = 63 - __builtin_clzll(value);
+#else
+  int exponent = 0;
+  while (value >> (exponent + 1)) exponent++;
+#endif  // __GNUC__ || __clang__
+  int shift = exponent - SUB_BUCKET_BITS;
+  int bucket = (shift + 1) * SUB_BUCKETS +
+               static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+  return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t LatencyHistogram::_upperBoundOf_(int bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return static_cast<uint64_t>(bucket);
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t offset = static_cast<uint64_t>(bucket % SUB_BUCKETS);
+  return ((SUB_BUCKETS + offset + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t micros) {
+  _counts_[_bucketOf_(micros)].fetch_add(1, std::memory_order_relaxed);
+  _total_.fetch_add(1, std::memory_order_relaxed);
+  _sum_.fetch_add(micros, std::memory_order_relaxed);
+
+  uint64_t seen = _max_.load(std::memory_order_relaxed);
+  while (micros > seen &&
+         !_max_.compare_exchange_weak(seen, micros,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int i = 0; i < BUCKETS; ++i) {
+    uint64_t count = other._counts_[i].load(std::memory_order_relaxed);
+    if (count > 0) {
+      _counts_[i].fetch_add(count, std::memory_order_relaxed);
+    }
+  }
+  _total_.fetch_add(other.count(), std::memory_order_relaxed);
+  _sum_.fetch_add(other._sum_.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+
+  uint64_t otherMax = other.max();
+  uint64_t seen = _max_.load(std::memory_order_relaxed);
+  while (otherMax > seen &&
+         !_max_.compare_exchange_weak(seen, otherMax,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::reset() {
+  for (auto& count : _counts_) {
+    count.store(0, std::memory_order_relaxed);
+  }
+  _total_.store(0, std::memory_order_relaxed);
+  _sum_.store(0, std::memory_order_relaxed);
+  _max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::count() const {
+  return _total_.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const {
+  return _max_.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+  uint64_t total = count();
+  return total == 0 ? 0.0
+                    : static_cast<double>(
+                          _sum_.load(std::memory_order_relaxed)) /
+                          total;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+  uint64_t total = count();
+  if (total == 0) {
+    return 0;
+  }
+
+  // Find the bucket holding the requested rank
+  uint64_t rank = static_cast<uint64_t>(percent / 100.0 * total + 0.5);
+  rank = rank < 1 ? 1 : (rank > total ? total : rank);
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += _counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t bound = _upperBoundOf_(i);
+      return bound < max() ? bound : max();
+    }
+  }
+  return max();
+}
@@ -0,0 +1,47 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#ifndef SRC_HISTOGRAM_H_
+#define SRC_HISTOGRAM_H_
+
+// Define a log-linear histogram of latencies in microseconds that can be
+// recorded from many threads, accurate to within about 1.6%
+class LatencyHistogram {
+ private:
+  // Define 64 linear buckets for every power of two up to about 2^40 us
+  static const int SUB_BUCKET_BITS = 6;
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int BUCKETS = 36 * SUB_BUCKETS;
+
+  std::array<std::atomic<uint64_t>, BUCKETS> _counts_{};
+  std::atomic<uint64_t> _total_{0};
+  std::atomic<uint64_t> _sum_{0};
+  std::atomic<uint64_t> _max_{0};
+
+  // Define functions to map between values and buckets
+  static int _bucketOf_(uint64_t value);
+  static uint64_t _upperBoundOf_(int bucket);
+
+ public:
+  // Record one latency
+  void record(uint64_t micros);
+
+  // Add every latency recorded in another histogram
+  void merge(const LatencyHistogram& other);
+
+  // Forget every recorded latency
+  void reset();
+
+  // Report the recorded latencies, where the percentile is in [0, 100]
+  uint64_t count() const;
+  uint64_t max() const;
+  double mean() const;
+  uint64_t percentile(double percent) const;
+};
+
+#endif  // SRC_HISTOGRAM_H_
@@ -0,0 +1,56 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "imageStore.h"
+
+ImageStore::ImageStore(size_t byteBudget) : _byteBudget_(byteBudget) {}
+
+bool ImageStore::contains(uint64_t handle) { return !find(handle).empty(); }
+
+cv::Mat ImageStore::find(uint64_t handle) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  auto it = _index_.find(handle);
+  if (it == _index_.end()) {
+    return cv::Mat();
+  }
+
+  // Mark the image as most recently used
+  _entries_.splice(_entries_.begin(), _entries_, it->second);
+  return it->second->image;
+}
+
+bool ImageStore::insert(uint64_t handle, const cv::Mat& image) {
+  size_t size = image.total() * image.elemSize();
+
+  std::lock_guard<std::mutex> guard(_mutex_);
+  if (size > _byteBudget_) {
+    return false;
+  }
+
+  // Keep any image already stored under the handle, marking it as used
+  auto it = _index_.find(handle);
+  if (it != _index_.end()) {
+    _entries_.splice(_entries_.begin(), _entries_, it->second);
+    return true;
+  }
+
+  _entries_.push_front({handle, image, size});
+  _index_[handle] = _entries_.begin();
+  _bytesUsed_ += size;
+  _evict_();
+  return true;
+}
+
+void ImageStore::_evict_() {
+  while (_bytesUsed_ > _byteBudget_ && !_entries_.empty()) {
+    Entry& oldest = _entries_.back();
+    _bytesUsed_ -= oldest.size;
+    _index_.erase(oldest.handle);
+    _entries_.pop_back();
+  }
+}
+
+void ImageStore::setByteBudget(size_t byteBudget) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  _byteBudget_ = byteBudget;
+  _evict_();
+}
@@ -0,0 +1,58 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#ifndef SRC_IMAGESTORE_H_
+#define SRC_IMAGESTORE_H_
+
+// Define an in-memory store of decoded images, addressed by the hash of the
+// uploaded bytes, so an image is uploaded and decoded only once
+class ImageStore {
+ private:
+  // Define a struct for one stored image
+  struct Entry {
+    uint64_t handle;
+    cv::Mat image;
+    size_t size;
+  };
+
+  // Define the most bytes of pixels kept at once
+  size_t _byteBudget_;
+  size_t _bytesUsed_ = 0;
+
+  // Define the images, most recently used first, and their index
+  std::list<Entry> _entries_;
+  std::unordered_map<uint64_t, std::list<Entry>::iterator> _index_;
+
+  // Define a mutex to synchronise access to the tables
+  std::mutex _mutex_;
+
+  // Define a function to drop images until the budget is met
+  void _evict_();
+
+ public:
+  ImageStore(size_t byteBudget);
+
+  // Check whether an image is held, marking it as recently used
+  bool contains(uint64_t handle);
+
+  // Find a stored image, returning an empty image once it has been evicted
+  cv::Mat find(uint64_t handle);
+
+  // Store a decoded image, keeping any image already stored under the
+  // handle, and returning false if it can never fit
+  bool insert(uint64_t handle, const cv::Mat& image);
+
+  // Set the byte budget, evicting images that no longer fit
+  void setByteBudget(size_t byteBudget);
+};
+
+#endif  // SRC_IMAGESTORE_H_
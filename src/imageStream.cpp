@@ -0,0 +1,31 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "imageStream.h"
+
+ImageStream::ImageStream(size_t length) : _bytes_(length) {}
+
+uchar* ImageStream::data() { return _bytes_.data(); }
+
+size_t ImageStream::size() const { return _bytes_.size(); }
+
+void ImageStream::publish(size_t filled) {
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+    _filled_ = filled;
+  }
+  _arrived_.notify_all();
+}
+
+void ImageStream::fail() {
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+    _failed_ = true;
+  }
+  _arrived_.notify_all();
+}
+
+size_t ImageStream::waitFor(size_t length) {
+  std::unique_lock<std::mutex> lock(_mutex_);
+  _arrived_.wait(lock, [&] { return _failed_ || _filled_ >= length; });
+  return _failed_ ? 0 : _filled_;
+}
@@ -0,0 +1,45 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core/hal/interface.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#ifndef SRC_IMAGESTREAM_H_
+#define SRC_IMAGESTREAM_H_
+
+// Define a payload buffer that is filled by the receiving thread while a
+// worker already processes the bytes that have arrived
+class ImageStream {
+ private:
+  // Define the payload and how much of it has arrived
+  std::vector<uchar> _bytes_;
+  size_t _filled_ = 0;
+  bool _failed_ = false;
+
+  // Define the synchronisation between receiver and worker
+  std::mutex _mutex_;
+  std::condition_variable _arrived_;
+
+ public:
+  ImageStream(size_t length);
+
+  // Access the payload, only reading the bytes that have arrived
+  uchar* data();
+  size_t size() const;
+
+  // Record that the payload has arrived up to the given length
+  void publish(size_t filled);
+
+  // Record that the rest of the payload will never arrive
+  void fail();
+
+  // Wait until at least the given length has arrived, returning the length
+  // that has arrived, or 0 if the payload will never arrive
+  size_t waitFor(size_t length);
+};
+
+#endif  // SRC_IMAGESTREAM_H_
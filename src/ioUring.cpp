@@ -0,0 +1,238 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "ioUring.h"
+
+#ifdef HAVE_IO_URING
+
+IoUring::~IoUring() {
+  if (_buffers_ != MAP_FAILED) {
+    munmap(_buffers_, _bufferSize_ * _bufferCount_);
+  }
+  if (_sqes_ != MAP_FAILED) {
+    munmap(_sqes_, _sqesLength_);
+  }
+  if (_rings_ != MAP_FAILED) {
+    munmap(_rings_, _ringsLength_);
+  }
+  if (_ringFd_ != -1) {
+    close(_ringFd_);
+  }
+}
+
+bool IoUring::open(unsigned entries) {
+  // Size the completion queue beyond the submission queue, as multishot
+  // entries post many completions each, and let the kernel run completion
+  // work only when the loop enters it
+  io_uring_params params{};
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                 IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = entries * 4;
+  _ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  if (_ringFd_ == -1 && errno == EINVAL) {
+    // Retry without the flags older kernels do not know
+    params = io_uring_params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    _ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+  }
+  if (_ringFd_ == -1) {
+    return false;
+  }
+
+  // Require both queues in one mapping, completions that are never dropped
+  // and waits with a timeout
+  const unsigned required =
+      IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if ((params.features & required) != required) {
+    return false;
+  }
+  _skipSuccess_ = params.features & IORING_FEAT_CQE_SKIP;
+
+  // Map the queues and the submission entries
+  size_t sqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqLength =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  _ringsLength_ = std::max(sqLength, cqLength);
+  _rings_ = mmap(nullptr, _ringsLength_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ringFd_, IORING_OFF_SQ_RING);
+  if (_rings_ == MAP_FAILED) {
+    return false;
+  }
+  _sqesLength_ = params.sq_entries * sizeof(io_uring_sqe);
+  _sqes_ = static_cast<io_uring_sqe*>(
+      mmap(nullptr, _sqesLength_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, _ringFd_, IORING_OFF_SQES));
+  if (_sqes_ == MAP_FAILED) {
+    return false;
+  }
+
+  uchar* rings = static_cast<uchar*>(_rings_);
+  _sqHead_ = reinterpret_cast<unsigned*>(rings + params.sq_off.head);
+  _sqTail_ = reinterpret_cast<unsigned*>(rings + params.sq_off.tail);
+  _sqArray_ = reinterpret_cast<unsigned*>(rings + params.sq_off.array);
+  _sqMask_ = *reinterpret_cast<unsigned*>(rings + params.sq_off.ring_mask);
+  _sqEntries_ = params.sq_entries;
+  _sqLocalTail_ = *_sqTail_;
+  _sqSubmitted_ = _sqLocalTail_;
+
+  _cqHead_ = reinterpret_cast<unsigned*>(rings + params.cq_off.head);
+  _cqTail_ = reinterpret_cast<unsigned*>(rings + params.cq_off.tail);
+  _cqMask_ = *reinterpret_cast<unsigned*>(rings + params.cq_off.ring_mask);
+  _cqes_ = reinterpret_cast<io_uring_cqe*>(rings + params.cq_off.cqes);
+  return true;
+}
+
+bool IoUring::provideBuffers(uint16_t group, unsigned count, size_t size) {
+  // Buffer IDs are 16 bits wide
+  if (count == 0 || count > 65536) {
+    return false;
+  }
+  _buffers_ = static_cast<uchar*>(mmap(nullptr, count * size,
+                                       PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (_buffers_ == MAP_FAILED) {
+    return false;
+  }
+  _bufferCount_ = count;
+  _bufferSize_ = size;
+  _bufferGroup_ = group;
+
+  // Hand every buffer to the kernel in one entry and wait for the result
+  io_uring_sqe* entry = nextEntry();
+  if (!entry) {
+    return false;
+  }
+  entry->opcode = IORING_OP_PROVIDE_BUFFERS;
+  entry->fd = static_cast<int>(count);
+  entry->addr = reinterpret_cast<uint64_t>(_buffers_);
+  entry->len = static_cast<uint32_t>(size);
+  entry->buf_group = group;
+  entry->user_data = RING_TAG;
+  if (_enter_(1, 1000) < 0) {
+    return false;
+  }
+  unsigned head = *_cqHead_;
+  if (head == __atomic_load_n(_cqTail_, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  int result = _cqes_[head & _cqMask_].res;
+  __atomic_store_n(_cqHead_, head + 1, __ATOMIC_RELEASE);
+  return result >= 0;
+}
+
+io_uring_sqe* IoUring::nextEntry() {
+  // Make room by submitting what is queued
+  if (_sqLocalTail_ - __atomic_load_n(_sqHead_, __ATOMIC_ACQUIRE) >=
+      _sqEntries_) {
+    _enter_(0, 0);
+    if (_sqLocalTail_ - __atomic_load_n(_sqHead_, __ATOMIC_ACQUIRE) >=
+        _sqEntries_) {
+      return nullptr;
+    }
+  }
+
+  unsigned index = _sqLocalTail_ & _sqMask_;
+  io_uring_sqe* entry = &_sqes_[index];
+  std::memset(entry, 0, sizeof(*entry));
+  _sqArray_[index] = index;
+  _sqLocalTail_++;
+  return entry;
+}
+
+int IoUring::_enter_(unsigned waitFor, int timeoutMs) {
+  // Publish the queued entries to the kernel
+  __atomic_store_n(_sqTail_, _sqLocalTail_, __ATOMIC_RELEASE);
+  unsigned pending = _sqLocalTail_ - _sqSubmitted_;
+
+  unsigned flags = 0;
+  __kernel_timespec timeout{};
+  io_uring_getevents_arg wait{};
+  if (waitFor > 0) {
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+    wait.sigmask_sz = _NSIG / 8;
+    wait.ts = reinterpret_cast<uint64_t>(&timeout);
+  }
+
+  _enterCalls_++;
+  long submitted = syscall(__NR_io_uring_enter, _ringFd_, pending, waitFor,
+                           flags, waitFor > 0 ? &wait : nullptr,
+                           waitFor > 0 ? sizeof(wait) : 0);
+  if (submitted == -1) {
+    return -errno;
+  }
+  _sqSubmitted_ += static_cast<unsigned>(submitted);
+  return static_cast<int>(submitted);
+}
+
+void IoUring::_provideRecycled_() {
+  size_t provided = 0;
+  for (uint16_t id : _recycled_) {
+    // Keep the rest for the next submission if the queue is full
+    io_uring_sqe* entry = nextEntry();
+    if (!entry) {
+      break;
+    }
+    entry->opcode = IORING_OP_PROVIDE_BUFFERS;
+    entry->fd = 1;
+    entry->addr = reinterpret_cast<uint64_t>(buffer(id));
+    entry->len = static_cast<uint32_t>(_bufferSize_);
+    entry->off = id;
+    entry->buf_group = _bufferGroup_;
+    entry->user_data = RING_TAG;
+    if (_skipSuccess_) {
+      entry->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+    provided++;
+  }
+  _recycled_.erase(_recycled_.begin(), _recycled_.begin() + provided);
+}
+
+int IoUring::submitAndWait(int timeoutMs) {
+  _provideRecycled_();
+
+  // Only submit when completions are already waiting to be taken
+  bool ready = *_cqHead_ != __atomic_load_n(_cqTail_, __ATOMIC_ACQUIRE);
+  if (ready && _sqLocalTail_ == _sqSubmitted_) {
+    return 0;
+  }
+
+  int result = _enter_(ready ? 0 : 1, timeoutMs);
+  if (result == -ETIME || result == -EINTR) {
+    return 0;
+  }
+  return result;
+}
+
+bool IoUring::nextCompletion(io_uring_cqe& completion) {
+  while (true) {
+    unsigned head = *_cqHead_;
+    if (head == __atomic_load_n(_cqTail_, __ATOMIC_ACQUIRE)) {
+      return false;
+    }
+    completion = _cqes_[head & _cqMask_];
+    __atomic_store_n(_cqHead_, head + 1, __ATOMIC_RELEASE);
+    if (completion.user_data != RING_TAG) {
+      return true;
+    }
+
+    // Take the completions of the ring's own entries here
+    if (completion.res < 0) {
+      std::cerr << "Error: Receive buffers could not be returned!"
+                << std::endl;
+    }
+  }
+}
+
+uchar* IoUring::buffer(uint16_t id) const {
+  return _buffers_ + static_cast<size_t>(id) * _bufferSize_;
+}
+
+void IoUring::recycleBuffer(uint16_t id) {
+  // Queue the buffer ahead of any receive queued after it
+  _recycled_.push_back(id);
+  _provideRecycled_();
+}
+
+#endif  // HAVE_IO_URING
@@ -0,0 +1,120 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif  // HAVE_IO_URING
+
+#include <opencv2/core/hal/interface.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#ifndef SRC_IOURING_H_
+#define SRC_IOURING_H_
+
+#ifdef HAVE_IO_URING
+
+// Define a minimal io_uring instance driven through the raw system calls,
+// with one group of receive buffers that the kernel picks from as data
+// arrives. Entries are only queued until submitAndWait, so everything
+// queued in one pass of the event loop costs a single system call. The
+// user data UINT64_MAX is reserved for the ring's own entries.
+class IoUring {
+ private:
+  // Define the user data of the ring's own entries
+  static const uint64_t RING_TAG = UINT64_MAX;
+
+  // Define the ring descriptor and the mapped rings
+  int _ringFd_ = -1;
+  void* _rings_ = MAP_FAILED;
+  size_t _ringsLength_ = 0;
+  io_uring_sqe* _sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t _sqesLength_ = 0;
+
+  // Define the submission queue, where entries are filled up to the local
+  // tail and handed to the kernel when the shared tail is published
+  unsigned* _sqHead_ = nullptr;
+  unsigned* _sqTail_ = nullptr;
+  unsigned* _sqArray_ = nullptr;
+  unsigned _sqMask_ = 0;
+  unsigned _sqEntries_ = 0;
+  unsigned _sqLocalTail_ = 0;
+  unsigned _sqSubmitted_ = 0;
+
+  // Define the completion queue
+  unsigned* _cqHead_ = nullptr;
+  unsigned* _cqTail_ = nullptr;
+  unsigned _cqMask_ = 0;
+  io_uring_cqe* _cqes_ = nullptr;
+
+  // Define the receive buffers provided to the kernel, and the ones given
+  // back that are still to be queued
+  uchar* _buffers_ = static_cast<uchar*>(MAP_FAILED);
+  size_t _bufferSize_ = 0;
+  unsigned _bufferCount_ = 0;
+  uint16_t _bufferGroup_ = 0;
+  std::vector<uint16_t> _recycled_;
+
+  // Define whether successful entries of the ring itself can skip their
+  // completions
+  bool _skipSuccess_ = false;
+
+  // Define the number of io_uring_enter calls made so far
+  std::atomic<uint64_t> _enterCalls_{0};
+
+  // Define a function to hand queued entries to the kernel, waiting for at
+  // least one completion if a timeout is given, and returning -errno on
+  // failure
+  int _enter_(unsigned waitFor, int timeoutMs);
+
+  // Define a function to queue the buffers given back, keeping any that
+  // do not fit in the queue for the next submission
+  void _provideRecycled_();
+
+ public:
+  IoUring() = default;
+  ~IoUring();
+  IoUring(const IoUring&) = delete;
+  IoUring& operator=(const IoUring&) = delete;
+
+  // Set up a ring with room for the given number of queued entries,
+  // returning false if the kernel does not support it
+  bool open(unsigned entries);
+
+  // Provide a group of receive buffers, returning false on failure
+  bool provideBuffers(uint16_t group, unsigned count, size_t size);
+
+  // Take an empty submission entry, submitting the queued ones first when
+  // the queue is full
+  io_uring_sqe* nextEntry();
+
+  // Submit every queued entry and wait up to the timeout for a completion,
+  // returning -errno on failure other than a timeout or a signal
+  int submitAndWait(int timeoutMs);
+
+  // Take the next completion, returning false when none is left
+  bool nextCompletion(io_uring_cqe& completion);
+
+  // Find a receive buffer picked by the kernel, and give it back once its
+  // bytes have been copied out
+  uchar* buffer(uint16_t id) const;
+  void recycleBuffer(uint16_t id);
+
+  // Report the io_uring_enter calls made so far
+  uint64_t enterCalls() const { return _enterCalls_; }
+};
+
+#endif  // HAVE_IO_URING
+
+#endif  // SRC_IOURING_H_
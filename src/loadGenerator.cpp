@@ -0,0 +1,399 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "loadGenerator.h"
+
+void LoadGenerator::setFormat(ImageFormat format) { _format_ = format; }
+
+void LoadGenerator::setDeadline(uint32_t milliseconds) {
+  _deadlineMs_ = milliseconds;
+}
+
+bool LoadGenerator::addOperation(const std::string& spec) {
+  // Parse "<operation>:<param>[+<operation>:<param>...][@<weight>]"
+  LoadOperation operation;
+  size_t at = spec.find('@');
+  operation.name = spec.substr(0, at);
+  operation.weight = at == std::string::npos ? 1.0 : std::atof(&spec[at + 1]);
+
+  std::istringstream steps(operation.name);
+  std::string text;
+  while (std::getline(steps, text, '+')) {
+    size_t colon = text.find(':');
+    FilterStep step;
+    if (colon == std::string::npos ||
+        !parseStep(text.substr(0, colon), text.substr(colon + 1), step)) {
+      return false;
+    }
+    operation.steps.push_back(step);
+  }
+  if (operation.steps.empty() || operation.weight <= 0) {
+    return false;
+  }
+
+  _operations_.push_back(std::move(operation));
+  return true;
+}
+
+bool LoadGenerator::addImage(const std::string& spec) {
+  // Parse "<cols>x<rows>[@<weight>]"
+  LoadImage image;
+  size_t at = spec.find('@');
+  image.name = spec.substr(0, at);
+  image.weight = at == std::string::npos ? 1.0 : std::atof(&spec[at + 1]);
+
+  int cols = 0, rows = 0;
+  char separator = 0;
+  std::istringstream size(image.name);
+  size >> cols >> separator >> rows;
+  if (separator != 'x' || cols <= 0 || rows <= 0 || image.weight <= 0) {
+    return false;
+  }
+
+  // Draw a gradient with noise, so the JPEG size is realistic
+  image.pixels.create(rows, cols, CV_8UC3);
+  for (int y = 0; y < rows; ++y) {
+    uchar* row = image.pixels.ptr<uchar>(y);
+    for (int x = 0; x < cols; ++x) {
+      row[3 * x] = static_cast<uchar>(x * 255 / cols);
+      row[3 * x + 1] = static_cast<uchar>(y * 255 / rows);
+      row[3 * x + 2] = static_cast<uchar>((x ^ y) & 255);
+    }
+  }
+  cv::Mat noise(rows, cols, CV_8UC3);
+  cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(32));
+  image.pixels += noise;
+  cv::imencode(".jpg", image.pixels, image.jpeg);
+
+  _images_.push_back(std::move(image));
+  return true;
+}
+
+int LoadGenerator::_connect_(const std::string& serverAddress) {
+  // Extract server IP and port from the address
+  size_t pos = serverAddress.find(':');
+  if (pos == std::string::npos) {
+    std::cerr << "Error: Invalid server address format!" << std::endl;
+    return -1;
+  }
+
+  std::string serverIP = serverAddress.substr(0, pos);
+  int serverPort = std::stoi(serverAddress.substr(pos + 1));
+
+  // Create a TCP socket
+  int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (clientSocket == -1) {
+    std::cerr << "Error: Socket could not be created!" << std::endl;
+    return -1;
+  }
+  configureSocket(clientSocket);
+
+  // Connect to the server
+  sockaddr_in serverAddr{};
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_port = htons(serverPort);
+  serverAddr.sin_addr.s_addr = inet_addr(serverIP.c_str());
+  if (connect(clientSocket, (struct sockaddr*)&serverAddr,
+              sizeof(serverAddr)) == -1) {
+#ifdef _WIN32
+    closesocket(clientSocket);
+#else
+    close(clientSocket);
+#endif  // _WIN32
+    return -1;
+  }
+
+  return clientSocket;
+}
+
+bool LoadGenerator::_sendRequest_(const int socket, uint32_t requestId,
+                                  const LoadOperation& operation,
+                                  const LoadImage& image,
+                                  uint64_t& bytesSent) {
+  // Send the image in the chosen format after the instruction
+  std::vector<uchar> header;
+  std::vector<BufferView> payload;
+  if (_format_ == ImageFormat::Raw) {
+    header = frameHeader(image.pixels);
+    payload.push_back({header.data(), header.size()});
+    payload.push_back(
+        {image.pixels.data, image.pixels.total() * image.pixels.elemSize()});
+  } else {
+    payload.push_back({image.jpeg.data(), image.jpeg.size()});
+  }
+
+  bytesSent = REQUEST_HEADER_SIZE + operation.steps.size() * REQUEST_STEP_SIZE;
+  for (const BufferView& buffer : payload) {
+    bytesSent += buffer.length;
+  }
+  return sendRequest(socket, operation.steps, _format_, requestId, payload,
+                     _deadlineMs_);
+}
+
+bool LoadGenerator::_receiveReply_(const int socket, uint32_t requestId,
+                                   std::vector<uchar>& buffer,
+                                   uint64_t& bytesReceived,
+                                   ReplyStatus& status) {
+  ReplyHeader reply;
+  if (!receiveImage(socket, reply, buffer) || reply.requestId != requestId) {
+    return false;
+  }
+  bytesReceived = REPLY_HEADER_SIZE + buffer.size();
+  status = reply.status;
+  return true;
+}
+
+void LoadGenerator::_runConnection_(
+    const std::string& serverAddress,
+    std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point deadline,
+    std::chrono::nanoseconds interval, unsigned seed) {
+  int clientSocket = _connect_(serverAddress);
+  if (clientSocket == -1) {
+    _failedConnections_++;
+    return;
+  }
+
+  // Pick requests from the mix by weight
+  std::mt19937 random(seed);
+  std::vector<double> operationWeights, imageWeights;
+  for (const LoadOperation& operation : _operations_) {
+    operationWeights.push_back(operation.weight);
+  }
+  for (const LoadImage& image : _images_) {
+    imageWeights.push_back(image.weight);
+  }
+  std::discrete_distribution<size_t> pickOperation(operationWeights.begin(),
+                                                   operationWeights.end());
+  std::discrete_distribution<size_t> pickImage(imageWeights.begin(),
+                                               imageWeights.end());
+
+  // Spread the first requests over one interval so connections do not fire
+  // in lockstep
+  bool isPaced = interval.count() > 0;
+  auto next = start;
+  if (isPaced) {
+    next += std::chrono::nanoseconds(random() % interval.count());
+  }
+
+  std::vector<uchar> buffer;
+  while (true) {
+    if (isPaced) {
+      if (next >= deadline) break;
+      std::this_thread::sleep_until(next);
+    } else if (std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+
+    // Measure paced requests from their scheduled time, so a slow server
+    // cannot hide the time requests spent waiting to be sent
+    auto sent = std::chrono::steady_clock::now();
+    auto measuredFrom = isPaced ? next : sent;
+    next += interval;
+
+    size_t operationIndex = pickOperation(random);
+    const LoadImage& image = _images_[pickImage(random)];
+    OperationStats& stats = *_stats_[operationIndex];
+
+    uint64_t bytesSent = 0, bytesReceived = 0;
+    ReplyStatus status = ReplyStatus::Ok;
+    uint32_t requestId = _nextRequestId_++;
+    if (!_sendRequest_(clientSocket, requestId, _operations_[operationIndex],
+                       image, bytesSent) ||
+        !_receiveReply_(clientSocket, requestId, buffer, bytesReceived,
+                        status)) {
+      // Count the lost request and carry on over a new connection
+      stats.errors++;
+#ifdef _WIN32
+      closesocket(clientSocket);
+#else
+      close(clientSocket);
+#endif  // _WIN32
+      clientSocket = _connect_(serverAddress);
+      if (clientSocket == -1) {
+        _failedConnections_++;
+        return;
+      }
+      continue;
+    }
+
+    stats.bytesSent += bytesSent;
+    stats.bytesReceived += bytesReceived;
+    // Keep shed requests out of the latencies, since they did no work
+    if (status != ReplyStatus::Ok) {
+      stats.shed++;
+    } else if (buffer.empty()) {
+      stats.errors++;
+    } else {
+      auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - measuredFrom);
+      stats.latency.record(static_cast<uint64_t>(latency.count()));
+    }
+  }
+
+#ifdef _WIN32
+  closesocket(clientSocket);
+#else
+  close(clientSocket);
+#endif  // _WIN32
+}
+
+void LoadGenerator::run(const std::string& serverAddress, size_t connections,
+                        double rate, double seconds) {
+  // Fall back to a small default mix
+  if (_operations_.empty()) {
+    addOperation("resize:0.5");
+    addOperation("colour:grey");
+    addOperation("smooth:gauss");
+  }
+  if (_images_.empty()) {
+    addImage("640x480");
+    addImage("1920x1080");
+  }
+  _stats_.clear();
+  for (size_t i = 0; i < _operations_.size(); ++i) {
+    _stats_.push_back(std::make_unique<OperationStats>());
+  }
+
+  // Give every connection an equal share of the request rate
+  std::chrono::nanoseconds interval(0);
+  if (rate > 0) {
+    interval = std::chrono::nanoseconds(
+        static_cast<int64_t>(connections / rate * 1e9));
+  }
+
+  std::cout << "Running " << connections << " connections for " << seconds
+            << " s "
+            << (rate > 0 ? "at " + std::to_string(rate) + " requests/s"
+                         : std::string("in a closed loop"))
+            << "..." << std::endl;
+
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::duration<double>(seconds));
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < connections; ++i) {
+    workers.emplace_back(
+        [this, &serverAddress, start, deadline, interval, i]() {
+          _runConnection_(serverAddress, start, deadline, interval,
+                          static_cast<unsigned>(i + 1));
+        });
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  // Report the latency percentiles of each operation in milliseconds
+  auto millis = [](uint64_t micros) { return micros / 1000.0; };
+  std::cout << std::left << std::setw(32) << "operation" << std::right
+            << std::setw(10) << "requests" << std::setw(8) << "errors"
+            << std::setw(8) << "shed"
+            << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms"
+            << std::setw(10) << "p99 ms" << std::setw(10) << "p99.9 ms"
+            << std::setw(10) << "max ms" << std::endl;
+
+  LatencyHistogram total;
+  uint64_t errors = 0, shed = 0, bytesSent = 0, bytesReceived = 0;
+  std::cout << std::fixed << std::setprecision(2);
+  for (size_t i = 0; i < _operations_.size(); ++i) {
+    const OperationStats& stats = *_stats_[i];
+    const LatencyHistogram& latency = stats.latency;
+    std::cout << std::left << std::setw(32) << _operations_[i].name
+              << std::right << std::setw(10) << latency.count()
+              << std::setw(8) << stats.errors << std::setw(8) << stats.shed
+              << std::setw(10) << millis(latency.percentile(50))
+              << std::setw(10) << millis(latency.percentile(90))
+              << std::setw(10) << millis(latency.percentile(99))
+              << std::setw(10) << millis(latency.percentile(99.9))
+              << std::setw(10) << millis(latency.max()) << std::endl;
+    total.merge(latency);
+    errors += stats.errors;
+    shed += stats.shed;
+    bytesSent += stats.bytesSent;
+    bytesReceived += stats.bytesReceived;
+  }
+
+  double megabyte = 1024.0 * 1024.0;
+  std::cout << std::left << std::setw(32) << "total" << std::right
+            << std::setw(10) << total.count() << std::setw(8) << errors
+            << std::setw(8) << shed
+            << std::setw(10) << millis(total.percentile(50)) << std::setw(10)
+            << millis(total.percentile(90)) << std::setw(10)
+            << millis(total.percentile(99)) << std::setw(10)
+            << millis(total.percentile(99.9)) << std::setw(10)
+            << millis(total.max()) << std::endl;
+  std::cout << "Throughput: " << total.count() / elapsed.count()
+            << " requests/s, " << bytesSent / megabyte / elapsed.count()
+            << " MB/s sent, " << bytesReceived / megabyte / elapsed.count()
+            << " MB/s received" << std::endl;
+  if (_failedConnections_ > 0) {
+    std::cout << _failedConnections_ << " connections could not be established"
+              << std::endl;
+  }
+}
+
+int main(int argc, char** argv) {
+// Initialise Winsock for Windows
+#ifdef _WIN32
+  WSADATA wsaData;
+  int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+  if (result != 0) {
+    std::cerr << "Error: WSAStartup failed with error: " << result << std::endl;
+    return -1;
+  }
+#endif  // _WIN32
+
+  LoadGenerator generator;
+  std::vector<std::string> args;
+  size_t connections = 16;
+  double rate = 0;
+  double seconds = 10;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--connections" && i + 1 < argc) {
+      connections = std::stoul(argv[++i]);
+    } else if (arg == "--rate" && i + 1 < argc) {
+      rate = std::stod(argv[++i]);
+    } else if (arg == "--duration" && i + 1 < argc) {
+      seconds = std::stod(argv[++i]);
+    } else if (arg == "--op" && i + 1 < argc) {
+      if (!generator.addOperation(argv[++i])) {
+        std::cerr << "Error: Invalid operation " << argv[i] << std::endl;
+        return -1;
+      }
+    } else if (arg == "--size" && i + 1 < argc) {
+      if (!generator.addImage(argv[++i])) {
+        std::cerr << "Error: Invalid image size " << argv[i] << std::endl;
+        return -1;
+      }
+    } else if (arg == "--deadline" && i + 1 < argc) {
+      generator.setDeadline(static_cast<uint32_t>(std::stoul(argv[++i])));
+    } else if (arg == "--raw") {
+      generator.setFormat(ImageFormat::Raw);
+    } else if (arg == "--buffer" && i + 1 < argc) {
+      int bufferBytes = std::stoi(argv[++i]);
+      generator.setSocketBuffers(bufferBytes, bufferBytes);
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  if (args.size() != 1 || connections == 0) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--connections <n>] [--rate <requests/s>]"
+              << " [--duration <seconds>]"
+              << " [--op <operation>:<param>[+...][@<weight>]]..."
+              << " [--size <cols>x<rows>[@<weight>]]... [--raw]"
+              << " [--deadline <ms>] [--buffer <bytes>] <server_ip:port>"
+              << std::endl;
+    return -1;
+  }
+
+  generator.run(args[0], connections, rate, seconds);
+
+#ifdef _WIN32
+  WSACleanup();
+#endif  // _WIN32
+  return 0;
+}
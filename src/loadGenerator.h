@@ -0,0 +1,114 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Import libraries
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+#include "peer.h"
+
+#ifndef SRC_LOADGENERATOR_H_
+#define SRC_LOADGENERATOR_H_
+
+// Define a struct for one filter chain in the request mix
+struct LoadOperation {
+  std::string name;
+  std::vector<FilterStep> steps;
+  double weight;
+};
+
+// Define a struct for one synthetic image in the request mix, prepared in
+// both wire formats ahead of time
+struct LoadImage {
+  std::string name;
+  double weight;
+  cv::Mat pixels;
+  std::vector<uchar> jpeg;
+};
+
+// Define the results recorded for one operation across every connection
+struct OperationStats {
+  LatencyHistogram latency;
+  std::atomic<uint64_t> errors{0};
+
+  // Count the requests the server shed or dropped past their deadline
+  std::atomic<uint64_t> shed{0};
+  std::atomic<uint64_t> bytesSent{0};
+  std::atomic<uint64_t> bytesReceived{0};
+};
+
+// Define a load generator that replays a mix of requests against a running
+// server over many connections and records the latency of each operation
+class LoadGenerator : public Peer {
+ private:
+  // Define the image format used on the wire
+  ImageFormat _format_ = ImageFormat::Jpeg;
+
+  // Define how long each request may wait for a worker, where 0 leaves it
+  // to the server
+  uint32_t _deadlineMs_ = 0;
+
+  // Define the request mix
+  std::vector<LoadOperation> _operations_;
+  std::vector<LoadImage> _images_;
+
+  // Define the results, one entry per operation
+  std::vector<std::unique_ptr<OperationStats>> _stats_;
+
+  // Define the ID of the next request sent by any connection
+  std::atomic<uint32_t> _nextRequestId_{1};
+
+  // Define the connections that could not be established
+  std::atomic<size_t> _failedConnections_{0};
+
+  // Define a function to connect to the server, returning -1 on failure
+  int _connect_(const std::string& serverAddress);
+
+  // Define a function to send one request in a single gathered write
+  bool _sendRequest_(const int socket, uint32_t requestId,
+                     const LoadOperation& operation, const LoadImage& image,
+                     uint64_t& bytesSent);
+
+  // Define a function to receive the reply to a request, failing if it
+  // answers another request
+  bool _receiveReply_(const int socket, uint32_t requestId,
+                      std::vector<uchar>& buffer, uint64_t& bytesReceived,
+                      ReplyStatus& status);
+
+  // Define a function to drive one connection until the deadline, pacing
+  // requests at the interval or back to back when it is zero
+  void _runConnection_(const std::string& serverAddress,
+                       std::chrono::steady_clock::time_point start,
+                       std::chrono::steady_clock::time_point deadline,
+                       std::chrono::nanoseconds interval, unsigned seed);
+
+ public:
+  // Define a function to choose the image format used on the wire
+  void setFormat(ImageFormat format);
+
+  // Define a function to set the deadline sent with each request
+  void setDeadline(uint32_t milliseconds);
+
+  // Define functions to add to the request mix, returning false for specs
+  // that cannot be parsed
+  bool addOperation(const std::string& spec);
+  bool addImage(const std::string& spec);
+
+  // Define a function to run the load, at the total request rate or in a
+  // closed loop when the rate is zero
+  void run(const std::string& serverAddress, size_t connections, double rate,
+           double seconds);
+};
+
+#endif  // SRC_LOADGENERATOR_H_
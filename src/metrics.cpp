@@ -0,0 +1,162 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "metrics.h"
+
+const char* const ServerMetrics::STAGE_NAMES[STAGES] = {
+    "receive", "queue", "decode", "filter", "encode", "send", "service"};
+
+uint32_t ServerMetrics::operationMask(const std::vector<FilterStep>& steps) {
+  uint32_t mask = 0;
+  for (const FilterStep& step : steps) {
+    size_t index = operationIndex(step.opcode);
+    if (index < OPERATION_COUNT) {
+      mask |= 1u << index;
+    }
+  }
+  return mask;
+}
+
+// Convert the time since a point to whole microseconds
+static uint64_t microsSince(std::chrono::steady_clock::time_point started) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - started)
+          .count());
+}
+
+void ServerMetrics::recordStage(Stage stage,
+                                std::chrono::steady_clock::time_point started) {
+  _stages_[static_cast<size_t>(stage)].record(microsSince(started));
+}
+
+void ServerMetrics::recordFilter(
+    uint32_t operations, std::chrono::steady_clock::time_point started) {
+  uint64_t micros = microsSince(started);
+  _stages_[static_cast<size_t>(Stage::Filter)].record(micros);
+  for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+    if (operations & (1u << i)) {
+      _operations_[i].filter.record(micros);
+    }
+  }
+}
+
+void ServerMetrics::recordRequest(uint32_t operations, bool succeeded) {
+  for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+    if (operations & (1u << i)) {
+      _operations_[i].requests.fetch_add(1, std::memory_order_relaxed);
+      if (!succeeded) {
+        _operations_[i].errors.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+void ServerMetrics::connectionOpened() {
+  _connections_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ServerMetrics::connectionClosed() {
+  _connections_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addBytesReceived(size_t bytes) {
+  _bytesReceived_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addBytesSent(size_t bytes) {
+  _bytesSent_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void ServerMetrics::addSystemCalls(uint64_t calls) {
+  _systemCalls_.fetch_add(calls, std::memory_order_relaxed);
+}
+
+std::string ServerMetrics::snapshot(const Gauges& gauges, bool asJson) const {
+  std::chrono::duration<double> uptime =
+      std::chrono::steady_clock::now() - _started_;
+  Gauges counters = {
+      {"connections", static_cast<uint64_t>(
+                          _connections_.load(std::memory_order_relaxed))},
+      {"bytes_received", _bytesReceived_.load(std::memory_order_relaxed)},
+      {"bytes_sent", _bytesSent_.load(std::memory_order_relaxed)},
+      {"io_syscalls", _systemCalls_.load(std::memory_order_relaxed)},
+  };
+  counters.insert(counters.end(), gauges.begin(), gauges.end());
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+
+  // Describe one histogram as its count and latencies in microseconds
+  auto describe = [&out, asJson](const LatencyHistogram& latency) {
+    if (asJson) {
+      out << "\"count\":" << latency.count()
+          << ",\"mean_us\":" << latency.mean()
+          << ",\"p50_us\":" << latency.percentile(50)
+          << ",\"p90_us\":" << latency.percentile(90)
+          << ",\"p99_us\":" << latency.percentile(99)
+          << ",\"max_us\":" << latency.max();
+    } else {
+      out << std::setw(10) << latency.count() << std::setw(10)
+          << latency.mean() << std::setw(10) << latency.percentile(50)
+          << std::setw(10) << latency.percentile(90) << std::setw(10)
+          << latency.percentile(99) << std::setw(10) << latency.max();
+    }
+  };
+
+  if (asJson) {
+    out << "{\"uptime_s\":" << uptime.count();
+    for (const auto& counter : counters) {
+      out << ",\"" << counter.first << "\":" << counter.second;
+    }
+    out << ",\"stages\":{";
+    for (size_t i = 0; i < STAGES; ++i) {
+      out << (i > 0 ? "," : "") << '"' << STAGE_NAMES[i] << "\":{";
+      describe(_stages_[i]);
+      out << '}';
+    }
+    out << "},\"operations\":{";
+    for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+      const OperationMetrics& operation = _operations_[i];
+      out << (i > 0 ? "," : "") << '"' << OPERATION_REGISTRY[i].name
+          << "\":{\"requests\":" << operation.requests
+          << ",\"errors\":" << operation.errors << ",\"filter\":{";
+      describe(operation.filter);
+      out << "}}";
+    }
+    out << "}}\n";
+    return out.str();
+  }
+
+  out << std::left << std::setw(16) << "uptime_s" << uptime.count() << '\n';
+  for (const auto& counter : counters) {
+    out << std::setw(16) << counter.first << counter.second << '\n';
+  }
+
+  out << '\n'
+      << std::setw(16) << "stage" << std::right << std::setw(10) << "count"
+      << std::setw(10) << "mean_us" << std::setw(10) << "p50_us"
+      << std::setw(10) << "p90_us" << std::setw(10) << "p99_us"
+      << std::setw(10) << "max_us" << '\n';
+  for (size_t i = 0; i < STAGES; ++i) {
+    out << std::left << std::setw(16) << STAGE_NAMES[i] << std::right;
+    describe(_stages_[i]);
+    out << '\n';
+  }
+
+  // Report the filter stage of each operation alongside its counters
+  out << '\n'
+      << std::left << std::setw(16) << "operation" << std::right
+      << std::setw(10) << "requests" << std::setw(10) << "errors"
+      << std::setw(10) << "filtered" << std::setw(10) << "mean_us"
+      << std::setw(10) << "p50_us" << std::setw(10) << "p90_us"
+      << std::setw(10) << "p99_us" << std::setw(10) << "max_us" << '\n';
+  for (size_t i = 0; i < OPERATION_COUNT; ++i) {
+    const OperationMetrics& operation = _operations_[i];
+    out << std::left << std::setw(16) << OPERATION_REGISTRY[i].name
+        << std::right << std::setw(10) << operation.requests
+        << std::setw(10) << operation.errors;
+    describe(operation.filter);
+    out << '\n';
+  }
+  return out.str();
+}
@@ -0,0 +1,101 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+#include "peer.h"
+
+#ifndef SRC_METRICS_H_
+#define SRC_METRICS_H_
+
+// Define the stages a request passes through on the server
+enum class Stage {
+  // Receiving the request from its first byte to its last
+  Receive,
+  // Waiting for a worker after it was received
+  Queue,
+  // Decoding the JPEG or wrapping the raw frame
+  Decode,
+  // Applying the filter chain
+  Filter,
+  // Encoding the JPEG or framing the raw reply
+  Encode,
+  // Writing the reply once it was handed back
+  Send,
+  // Serving the request on a worker, including cache lookups
+  Service,
+};
+
+// Define the gauges sampled when a snapshot is taken
+using Gauges = std::vector<std::pair<std::string, uint64_t>>;
+
+// Define the server metrics, recorded with relaxed atomics only so the hot
+// path never takes a lock
+class ServerMetrics {
+ private:
+  // Define the names reported for each stage
+  static const size_t STAGES = 7;
+  static const char* const STAGE_NAMES[STAGES];
+
+  // Define the counters of one operation, where a chain counts towards
+  // every operation in it
+  struct OperationMetrics {
+    LatencyHistogram filter;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> errors{0};
+  };
+
+  std::array<LatencyHistogram, STAGES> _stages_;
+  std::array<OperationMetrics, OPERATION_COUNT> _operations_;
+  static_assert(OPERATION_COUNT <= 32, "Operation masks hold 32 operations");
+
+  // Define the connection and traffic counters
+  std::atomic<int64_t> _connections_{0};
+  std::atomic<uint64_t> _bytesReceived_{0};
+  std::atomic<uint64_t> _bytesSent_{0};
+
+  // Define the system calls made by the event loop and to wake it
+  std::atomic<uint64_t> _systemCalls_{0};
+
+  std::chrono::steady_clock::time_point _started_ =
+      std::chrono::steady_clock::now();
+
+ public:
+  // Define the operations of a chain as a set of bits, one for each
+  // position in the operation registry
+  static uint32_t operationMask(const std::vector<FilterStep>& steps);
+
+  // Record the time since a stage started
+  void recordStage(Stage stage, std::chrono::steady_clock::time_point started);
+
+  // Record the filter time of every operation in a chain
+  void recordFilter(uint32_t operations,
+                    std::chrono::steady_clock::time_point started);
+
+  // Count a finished request against every operation in its chain
+  void recordRequest(uint32_t operations, bool succeeded);
+
+  // Track open connections and the bytes moved over them
+  void connectionOpened();
+  void connectionClosed();
+  void addBytesReceived(size_t bytes);
+  void addBytesSent(size_t bytes);
+
+  // Count system calls made to move requests and replies
+  void addSystemCalls(uint64_t calls);
+
+  // Describe every metric along with the given gauges, as JSON or as text
+  std::string snapshot(const Gauges& gauges, bool asJson) const;
+};
+
+#endif  // SRC_METRICS_H_
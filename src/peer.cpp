@@ -2,39 +2,455 @@
 
 #include "peer.h"
 
-void Peer::sendImage(const int socket, const std::vector<uchar>& buffer) {
-  for (size_t i = 0; i < buffer.size(); i += FRAGMENT_SIZE) {
-    size_t fragmentLength =
-        std::min(buffer.size() - i, static_cast<size_t>(FRAGMENT_SIZE));
-    std::vector<uchar> fragment(buffer.begin() + i,
-                                buffer.begin() + i + fragmentLength);
+// Mix one 8-byte word into the hash
+static uint64_t mixWord(uint64_t hash, uint64_t word) {
+  const uint64_t multiplier = 0xc6a4a7935bd1e995ULL;
+  const int shift = 47;
+  word *= multiplier;
+  word ^= word >> shift;
+  word *= multiplier;
+  hash ^= word;
+  return hash * multiplier;
+}
+
+// Fold in the trailing bytes and scramble the result
+static uint64_t finishHash(uint64_t hash, const uchar* tail,
+                           size_t remaining) {
+  const uint64_t multiplier = 0xc6a4a7935bd1e995ULL;
+  const int shift = 47;
+  if (remaining > 0) {
+    uint64_t word = 0;
+    std::memcpy(&word, tail, remaining);
+    hash ^= word;
+    hash *= multiplier;
+  }
+  hash ^= hash >> shift;
+  hash *= multiplier;
+  hash ^= hash >> shift;
+  return hash;
+}
+
+uint64_t hashBytes(const void* bytes, size_t length, uint64_t seed) {
+  const uchar* data = static_cast<const uchar*>(bytes);
+  uint64_t hash = seed ^ (length * 0xc6a4a7935bd1e995ULL);
+
+  const uchar* end = data + (length & ~static_cast<size_t>(7));
+  for (; data != end; data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    hash = mixWord(hash, word);
+  }
+  return finishHash(hash, data, length & 7);
+}
+
+uint64_t hashBuffers(const std::vector<BufferView>& buffers, uint64_t seed) {
+  size_t length = 0;
+  for (const BufferView& buffer : buffers) length += buffer.length;
+  uint64_t hash = seed ^ (length * 0xc6a4a7935bd1e995ULL);
+
+  // Carry the bytes of a word that spans two buffers
+  uchar carry[8];
+  size_t carried = 0;
+  for (const BufferView& buffer : buffers) {
+    const uchar* data = static_cast<const uchar*>(buffer.data);
+    size_t remaining = buffer.length;
+    if (carried > 0) {
+      size_t taken = std::min(remaining, sizeof(carry) - carried);
+      std::memcpy(carry + carried, data, taken);
+      carried += taken;
+      data += taken;
+      remaining -= taken;
+      if (carried < sizeof(carry)) continue;
+      uint64_t word;
+      std::memcpy(&word, carry, sizeof(word));
+      hash = mixWord(hash, word);
+      carried = 0;
+    }
+
+    const uchar* end = data + (remaining & ~static_cast<size_t>(7));
+    for (; data != end; data += 8) {
+      uint64_t word;
+      std::memcpy(&word, data, sizeof(word));
+      hash = mixWord(hash, word);
+    }
+    carried = remaining & 7;
+    std::memcpy(carry, data, carried);
+  }
+  return finishHash(hash, carry, carried);
+}
+
+std::vector<uchar> encodeRequest(const RequestHeader& header,
+                                 const std::vector<FilterStep>& steps) {
+  std::vector<uchar> bytes(REQUEST_HEADER_SIZE +
+                           steps.size() * REQUEST_STEP_SIZE);
+  uint32_t magic = htonl(PROTOCOL_MAGIC);
+  uint16_t version = htons(header.version);
+  uint16_t stepCount = htons(static_cast<uint16_t>(steps.size()));
+  uint32_t format = htonl(static_cast<uint32_t>(header.format));
+  uint32_t requestId = htonl(header.requestId);
+  uint64_t payloadLength = swapNetwork64(header.payloadLength);
+  std::memcpy(&bytes[0], &magic, sizeof(magic));
+  std::memcpy(&bytes[4], &version, sizeof(version));
+  std::memcpy(&bytes[6], &stepCount, sizeof(stepCount));
+  std::memcpy(&bytes[8], &format, sizeof(format));
+  std::memcpy(&bytes[12], &requestId, sizeof(requestId));
+  std::memcpy(&bytes[16], &payloadLength, sizeof(payloadLength));
+  uint32_t deadlineMs = htonl(header.deadlineMs);
+  std::memcpy(&bytes[24], &deadlineMs, sizeof(deadlineMs));
+
+  // Leave the reserved bytes of each step zeroed
+  uchar* step = bytes.data() + REQUEST_HEADER_SIZE;
+  for (const FilterStep& filterStep : steps) {
+    uint16_t opcode = htons(static_cast<uint16_t>(filterStep.opcode));
+    uint64_t param = swapNetwork64(filterStep.param);
+    std::memcpy(step, &opcode, sizeof(opcode));
+    std::memcpy(step + 8, &param, sizeof(param));
+    step += REQUEST_STEP_SIZE;
+  }
+  return bytes;
+}
+
+bool decodeRequestHeader(const uchar* data, RequestHeader& header) {
+  uint32_t magic, format;
+  std::memcpy(&magic, &data[0], sizeof(magic));
+  std::memcpy(&header.version, &data[4], sizeof(header.version));
+  std::memcpy(&header.stepCount, &data[6], sizeof(header.stepCount));
+  std::memcpy(&format, &data[8], sizeof(format));
+  std::memcpy(&header.requestId, &data[12], sizeof(header.requestId));
+  std::memcpy(&header.payloadLength, &data[16], sizeof(header.payloadLength));
+  std::memcpy(&header.deadlineMs, &data[24], sizeof(header.deadlineMs));
+  header.version = ntohs(header.version);
+  header.stepCount = ntohs(header.stepCount);
+  header.format = static_cast<ImageFormat>(ntohl(format));
+  header.requestId = ntohl(header.requestId);
+  header.payloadLength = swapNetwork64(header.payloadLength);
+  header.deadlineMs = ntohl(header.deadlineMs);
+
+  return ntohl(magic) == PROTOCOL_MAGIC &&
+         header.version == PROTOCOL_VERSION &&
+         header.stepCount <= MAX_CHAIN_LENGTH &&
+         header.payloadLength <= MAX_PAYLOAD_SIZE;
+}
+
+void decodeRequestSteps(const uchar* data, std::vector<FilterStep>& steps) {
+  for (FilterStep& step : steps) {
+    uint16_t opcode;
+    std::memcpy(&opcode, data, sizeof(opcode));
+    std::memcpy(&step.param, data + 8, sizeof(step.param));
+    step.opcode = static_cast<Opcode>(ntohs(opcode));
+    step.param = swapNetwork64(step.param);
+    data += REQUEST_STEP_SIZE;
+  }
+}
 
-    // Send fragment
-    send(socket, reinterpret_cast<const char*>(fragment.data()),
-         fragment.size(), 0);
+std::vector<uchar> encodeReplyHeader(uint32_t requestId, uint64_t length,
+                                     ReplyStatus status) {
+  std::vector<uchar> bytes(REPLY_HEADER_SIZE);
+  uint32_t id = htonl(requestId);
+  uint16_t replyStatus = htons(static_cast<uint16_t>(status));
+  uint64_t payloadLength = swapNetwork64(length);
+  std::memcpy(&bytes[0], &id, sizeof(id));
+  std::memcpy(&bytes[4], &replyStatus, sizeof(replyStatus));
+  std::memcpy(&bytes[8], &payloadLength, sizeof(payloadLength));
+  return bytes;
+}
+
+void Peer::setSocketBuffers(int sendBytes, int receiveBytes) {
+  _sendBufferSize_ = sendBytes;
+  _receiveBufferSize_ = receiveBytes;
+}
+
+void Peer::configureSocket(const int socket) {
+  if (_sendBufferSize_ > 0) {
+    setsockopt(socket, SOL_SOCKET, SO_SNDBUF,
+               reinterpret_cast<const char*>(&_sendBufferSize_),
+               sizeof(_sendBufferSize_));
+  }
+  if (_receiveBufferSize_ > 0) {
+    setsockopt(socket, SOL_SOCKET, SO_RCVBUF,
+               reinterpret_cast<const char*>(&_receiveBufferSize_),
+               sizeof(_receiveBufferSize_));
+  }
+}
+
+bool Peer::receiveExact(const int socket, void* data, size_t length) {
+  char* destination = static_cast<char*>(data);
+  size_t received = 0;
+
+  while (received < length) {
+    size_t request = std::min(length - received, static_cast<size_t>(INT_MAX));
+    int bytesReceived =
+        recv(socket, destination + received, static_cast<int>(request), 0);
+
+    // Check for closed connection, timeout or error
+    if (bytesReceived <= 0) {
+      return false;
+    }
+
+    received += bytesReceived;
   }
 
-// Shutdown socket
+  return true;
+}
+
+bool Peer::sendBuffers(const int socket,
+                       const std::vector<BufferView>& buffers) {
 #ifdef _WIN32
-  shutdown(socket, SD_SEND);
+  for (const BufferView& buffer : buffers) {
+    const char* data = static_cast<const char*>(buffer.data);
+    size_t remaining = buffer.length;
+    while (remaining > 0) {
+      int request = static_cast<int>(
+          std::min(remaining, static_cast<size_t>(INT_MAX)));
+      int bytesSent = send(socket, data, request, 0);
+      if (bytesSent <= 0) {
+        return false;
+      }
+      data += bytesSent;
+      remaining -= bytesSent;
+    }
+  }
+  return true;
+#else
+  // Gather the buffers so the kernel reads them in place
+  std::vector<iovec> parts;
+  parts.reserve(buffers.size());
+  for (const BufferView& buffer : buffers) {
+    if (buffer.length > 0) {
+      parts.push_back({const_cast<void*>(buffer.data), buffer.length});
+    }
+  }
+
+  size_t first = 0;
+  while (first < parts.size()) {
+    msghdr message{};
+    message.msg_iov = &parts[first];
+    message.msg_iovlen = std::min<size_t>(parts.size() - first, IOV_MAX);
+
+#ifdef MSG_NOSIGNAL
+    ssize_t bytesSent = sendmsg(socket, &message, MSG_NOSIGNAL);
 #else
-  shutdown(socket, SHUT_WR);
+    ssize_t bytesSent = sendmsg(socket, &message, 0);
+#endif  // MSG_NOSIGNAL
+    if (bytesSent < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+
+    // Skip the parts that were sent and resume inside a partial one
+    size_t sent = static_cast<size_t>(bytesSent);
+    while (first < parts.size() && sent >= parts[first].iov_len) {
+      sent -= parts[first].iov_len;
+      ++first;
+    }
+    if (first < parts.size()) {
+      parts[first].iov_base = static_cast<char*>(parts[first].iov_base) + sent;
+      parts[first].iov_len -= sent;
+    }
+  }
+  return true;
 #endif  // _WIN32
 }
 
-void Peer::receiveImage(const int socket, std::vector<uchar>& buffer) {
-  std::vector<uchar> fragment(FRAGMENT_SIZE);
+bool Peer::sendRequest(const int socket, const std::vector<FilterStep>& steps,
+                       ImageFormat format, uint32_t requestId,
+                       const std::vector<BufferView>& payload,
+                       uint32_t deadlineMs) {
+  RequestHeader header;
+  header.format = format;
+  header.requestId = requestId;
+  header.deadlineMs = deadlineMs;
+  for (const BufferView& buffer : payload) {
+    header.payloadLength += buffer.length;
+  }
 
-  while (true) {
-    int bytesReceived = recv(socket, fragment.data(), fragment.size(), 0);
+  // Put the header and steps in front of the payload
+  std::vector<uchar> instruction = encodeRequest(header, steps);
+  std::vector<BufferView> buffers = {{instruction.data(), instruction.size()}};
+  buffers.insert(buffers.end(), payload.begin(), payload.end());
+  return sendBuffers(socket, buffers);
+}
 
-    // Check for end-of-transmission
-    if (bytesReceived <= 0) {
-      break;
+bool Peer::receiveRequest(const int socket, RequestHeader& header,
+                          std::vector<FilterStep>& steps) {
+  // Receive the fixed header in one call, failing when the session has ended
+  uchar headerBytes[REQUEST_HEADER_SIZE];
+  if (!receiveExact(socket, headerBytes, sizeof(headerBytes)) ||
+      !decodeRequestHeader(headerBytes, header)) {
+    return false;
+  }
+
+  // Receive every step in one more call
+  std::vector<uchar> stepBytes(header.stepCount * REQUEST_STEP_SIZE);
+  if (!receiveExact(socket, stepBytes.data(), stepBytes.size())) {
+    return false;
+  }
+  steps.resize(header.stepCount);
+  decodeRequestSteps(stepBytes.data(), steps);
+  return true;
+}
+
+bool Peer::sendImage(const int socket, uint32_t requestId,
+                     const std::vector<uchar>& buffer, ReplyStatus status) {
+  // Prefix the image length so the connection can stay open afterwards
+  std::vector<uchar> header =
+      encodeReplyHeader(requestId, buffer.size(), status);
+  return sendBuffers(socket, {{header.data(), header.size()},
+                              {buffer.data(), buffer.size()}});
+}
+
+bool Peer::receiveReplyHeader(const int socket, ReplyHeader& header) {
+  uchar bytes[REPLY_HEADER_SIZE];
+  if (!receiveExact(socket, bytes, sizeof(bytes))) {
+    return false;
+  }
+  uint16_t status;
+  std::memcpy(&header.requestId, &bytes[0], sizeof(header.requestId));
+  std::memcpy(&status, &bytes[4], sizeof(status));
+  std::memcpy(&header.length, &bytes[8], sizeof(header.length));
+  header.requestId = ntohl(header.requestId);
+  header.status = static_cast<ReplyStatus>(ntohs(status));
+  header.length = swapNetwork64(header.length);
+  return header.length <= MAX_PAYLOAD_SIZE;
+}
+
+bool Peer::receiveImage(const int socket, ReplyHeader& header,
+                        std::vector<uchar>& buffer) {
+  // Receive the reply header
+  if (!receiveReplyHeader(socket, header)) {
+    return false;
+  }
+  uint64_t imageLength = header.length;
+
+  // Size the buffer once and receive straight into it
+  buffer.resize(imageLength);
+  return receiveExact(socket, buffer.data(), imageLength);
+}
+
+bool Peer::_unpackFrameHeader_(const FrameHeader& header, size_t pixelLength,
+                               int& rows, int& cols, int& type) {
+  rows = static_cast<int>(ntohl(header.rows));
+  cols = static_cast<int>(ntohl(header.cols));
+  type = static_cast<int>(ntohl(header.type));
+  size_t step = ntohl(header.step);
+
+  // Only accept packed 8-bit frames whose size matches the header
+  return rows > 0 && cols > 0 && CV_MAT_DEPTH(type) == CV_8U &&
+         step == static_cast<size_t>(cols) * CV_ELEM_SIZE(type) &&
+         pixelLength % step == 0 &&
+         pixelLength / step == static_cast<size_t>(rows);
+}
+
+std::vector<uchar> Peer::frameHeader(const cv::Mat& image) {
+  FrameHeader header;
+  header.rows = htonl(static_cast<uint32_t>(image.rows));
+  header.cols = htonl(static_cast<uint32_t>(image.cols));
+  header.type = htonl(static_cast<uint32_t>(image.type()));
+  header.step = htonl(static_cast<uint32_t>(image.cols * image.elemSize()));
+
+  std::vector<uchar> bytes(sizeof(header));
+  std::memcpy(bytes.data(), &header, sizeof(header));
+  return bytes;
+}
+
+bool Peer::parseFrame(const uchar* data, size_t length, cv::Mat& image) {
+  if (length < sizeof(FrameHeader)) {
+    return false;
+  }
+
+  // Read the header
+  FrameHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  int rows, cols, type;
+  if (!_unpackFrameHeader_(header, length - sizeof(header), rows, cols,
+                           type)) {
+    return false;
+  }
+
+  // Point the image at the pixels that follow the header
+  image = cv::Mat(rows, cols, type, const_cast<uchar*>(data) + sizeof(header));
+  return true;
+}
+
+bool Peer::sendFrame(const int socket, uint32_t requestId,
+                     const cv::Mat& image, ReplyStatus status) {
+  std::vector<uchar> header = frameHeader(image);
+  size_t rowBytes = image.cols * image.elemSize();
+  std::vector<uchar> replyHeader = encodeReplyHeader(
+      requestId, header.size() + rowBytes * image.rows, status);
+
+  // Gather the reply header, frame header and pixels, row by row when not
+  // continuous
+  std::vector<BufferView> buffers = {{replyHeader.data(), replyHeader.size()},
+                                     {header.data(), header.size()}};
+  if (image.isContinuous()) {
+    buffers.push_back({image.data, rowBytes * image.rows});
+  } else {
+    for (int row = 0; row < image.rows; ++row) {
+      buffers.push_back({image.ptr(row), rowBytes});
     }
+  }
+
+  return sendBuffers(socket, buffers);
+}
+
+bool Peer::receiveFrame(const int socket, ReplyHeader& replyHeader,
+                        cv::Mat& image) {
+  // Receive the reply header
+  if (!receiveReplyHeader(socket, replyHeader)) {
+    return false;
+  }
+  uint64_t frameLength = replyHeader.length;
+
+  // Treat an empty reply as an empty image
+  if (frameLength == 0) {
+    image.release();
+    return true;
+  }
+
+  // Receive and check the header
+  FrameHeader header;
+  if (frameLength < sizeof(header) ||
+      !receiveExact(socket, &header, sizeof(header))) {
+    return false;
+  }
+  size_t pixelLength = frameLength - sizeof(header);
+  int rows, cols, type;
+  if (!_unpackFrameHeader_(header, pixelLength, rows, cols, type)) {
+    return false;
+  }
+
+  // Receive the pixels straight into the image
+  image.create(rows, cols, type);
+  return receiveExact(socket, image.data, pixelLength);
+}
+
+std::array<BufferView, 3> ImageReply::pieces() const {
+  static const std::vector<uchar> noBytes;
+  const std::vector<uchar>& shared = sharedBytes ? *sharedBytes : noBytes;
+  return {{{bytes.data(), bytes.size()},
+           {shared.data(), shared.size()},
+           {pixels.data, pixels.total() * pixels.elemSize()}}};
+}
+
+size_t ImageReply::length() const {
+  size_t length = 0;
+  for (const BufferView& piece : pieces()) length += piece.length;
+  return length;
+}
+
+bool Peer::sendReply(const int socket, uint32_t requestId,
+                     const ImageReply& reply) {
+  if (!reply.pixels.empty()) {
+    return sendFrame(socket, requestId, reply.pixels, reply.status);
+  }
 
-    // Append fragment to buffer
-    buffer.insert(buffer.end(), fragment.begin(),
-                  fragment.begin() + bytesReceived);
+  // Send the encoded bytes from wherever the reply holds them
+  std::vector<uchar> header =
+      encodeReplyHeader(requestId, reply.length(), reply.status);
+  std::vector<BufferView> buffers = {{header.data(), header.size()}};
+  for (const BufferView& piece : reply.pieces()) {
+    if (piece.length > 0) buffers.push_back(piece);
   }
+  return sendBuffers(socket, buffers);
 }
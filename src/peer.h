@@ -9,30 +9,217 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif  // _WIN32
 
+#include <opencv2/core.hpp>
 #include <opencv2/core/hal/interface.h>
 
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <climits>
 #include <cstddef>
+#include <cstdio>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "filterRegistry.h"
+
 #ifndef SRC_PEER_H_
 #define SRC_PEER_H_
 
+// Define the longest filter chain accepted in one request
+const uint32_t MAX_CHAIN_LENGTH = 32;
+
+// Define the largest image payload accepted in one request or reply
+const uint64_t MAX_PAYLOAD_SIZE = 256 * 1024 * 1024;
+
+// Convert a 64-bit length between host and network byte order
+inline uint64_t swapNetwork64(uint64_t value) {
+  if (htonl(1) == 1) {
+    return value;
+  }
+  return (static_cast<uint64_t>(htonl(static_cast<uint32_t>(value))) << 32) |
+         htonl(static_cast<uint32_t>(value >> 32));
+}
+
+// Hash bytes eight at a time with the MurmurHash64A mixing steps
+uint64_t hashBytes(const void* data, size_t length, uint64_t seed);
+
+// Define a view of bytes to send without copying them
+struct BufferView {
+  const void* data;
+  size_t length;
+};
+
+// Hash buffers as hashBytes would hash them joined, without joining them
+uint64_t hashBuffers(const std::vector<BufferView>& buffers, uint64_t seed);
+
+// Define an enumeration for the image formats used on the wire
+enum class ImageFormat : uint32_t {
+  // JPEG-encoded images
+  Jpeg = 0,
+  // Raw frames of a header followed by the packed cv::Mat pixel rows
+  Raw = 1,
+};
+
+// Define the magic number and version that open every request, where the
+// earlier length-prefixed text instructions were version 1, replies
+// without a request ID were version 2 and requests without a deadline were
+// version 3
+const uint32_t PROTOCOL_MAGIC = 0x494D4750;
+const uint16_t PROTOCOL_VERSION = 4;
+
+// Define the fixed layout of a request, which is a header, then a step for
+// each filter, then the payload, and of a reply, which is a header and then
+// the payload, all in network byte order:
+//   header: u32 magic, u16 version, u16 step count, u32 format,
+//           u32 request ID, u64 payload length, u32 deadline in
+//           milliseconds, 4 reserved bytes
+//   step:   u16 opcode, 6 reserved bytes, u64 parameter
+//   reply:  u32 request ID, u16 status, 2 reserved bytes,
+//           u64 payload length
+const size_t REQUEST_HEADER_SIZE = 32;
+const size_t REQUEST_STEP_SIZE = 16;
+const size_t REPLY_HEADER_SIZE = 16;
+
+// Define the fields of a request header
+struct RequestHeader {
+  uint16_t version = PROTOCOL_VERSION;
+  uint16_t stepCount = 0;
+  ImageFormat format = ImageFormat::Jpeg;
+  uint32_t requestId = 0;
+  uint64_t payloadLength = 0;
+
+  // How long the request may wait for a worker, where 0 leaves it to the
+  // server
+  uint32_t deadlineMs = 0;
+};
+
+// Define the outcome of a request, where a request that could not be
+// processed gets an empty reply with the Ok status
+enum class ReplyStatus : uint16_t {
+  Ok = 0,
+  // The server shed the request because its queue was full
+  Busy = 1,
+  // The request waited past its deadline and was dropped
+  Expired = 2,
+};
+
+// Define the fields of a reply header
+struct ReplyHeader {
+  uint32_t requestId = 0;
+  ReplyStatus status = ReplyStatus::Ok;
+  uint64_t length = 0;
+};
+
+// Encode a request header and its steps into one buffer
+std::vector<uchar> encodeRequest(const RequestHeader& header,
+                                 const std::vector<FilterStep>& steps);
+
+// Decode a request header, rejecting foreign or unsupported requests and
+// oversized chains or payloads
+bool decodeRequestHeader(const uchar* data, RequestHeader& header);
+
+// Decode the steps that follow a header into a vector of the right size
+void decodeRequestSteps(const uchar* data, std::vector<FilterStep>& steps);
+
+// Encode the header of a reply, which names the request it answers so
+// replies can arrive in any order
+std::vector<uchar> encodeReplyHeader(uint32_t requestId, uint64_t length,
+                                     ReplyStatus status = ReplyStatus::Ok);
+
+// Define the header of a raw frame, sent in network byte order
+struct FrameHeader {
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t type;
+  uint32_t step;
+};
+
+// Define a struct for an image reply, where raw pixels are sent straight
+// from the cv::Mat after the header bytes, and bytes shared with other
+// replies, such as those of a cached reply, are sent between the two
+struct ImageReply {
+  std::vector<uchar> bytes;
+  std::shared_ptr<const std::vector<uchar>> sharedBytes;
+  cv::Mat pixels;
+  ReplyStatus status = ReplyStatus::Ok;
+
+  // Return the pieces of the reply in the order they are sent, and their
+  // total length
+  std::array<BufferView, 3> pieces() const;
+  size_t length() const;
+};
+
 class Peer {
+ private:
+  // Define the kernel socket buffer sizes, where 0 keeps the default
+  int _sendBufferSize_ = 0;
+  int _receiveBufferSize_ = 0;
+
+  // Unpack a raw frame header and check it against the pixel byte count
+  bool _unpackFrameHeader_(const FrameHeader& header, size_t pixelLength,
+                           int& rows, int& cols, int& type);
+
  protected:
-  // Define fragment size
-  const int FRAGMENT_SIZE = 4096;
+  // Apply the configured socket buffer sizes to a socket
+  void configureSocket(const int socket);
+
+  // Receive exactly the requested number of bytes
+  bool receiveExact(const int socket, void* data, size_t length);
+
+  // Send every byte of the buffers in order, resuming after partial sends
+  bool sendBuffers(const int socket, const std::vector<BufferView>& buffers);
+
+  // Send a request header, its steps and the payload in one gathered write
+  bool sendRequest(const int socket, const std::vector<FilterStep>& steps,
+                   ImageFormat format, uint32_t requestId,
+                   const std::vector<BufferView>& payload,
+                   uint32_t deadlineMs = 0);
+
+  // Receive a request header and its steps, leaving the payload unread
+  bool receiveRequest(const int socket, RequestHeader& header,
+                      std::vector<FilterStep>& steps);
+
+  // Send the image as a reply straight from the caller's buffer
+  bool sendImage(const int socket, uint32_t requestId,
+                 const std::vector<uchar>& buffer,
+                 ReplyStatus status = ReplyStatus::Ok);
+
+  // Receive a reply header, rejecting oversized payloads
+  bool receiveReplyHeader(const int socket, ReplyHeader& header);
+
+  // Receive an image reply straight into an exactly sized buffer
+  bool receiveImage(const int socket, ReplyHeader& header,
+                    std::vector<uchar>& buffer);
+
+  // Build the header of a raw frame for a continuous image
+  std::vector<uchar> frameHeader(const cv::Mat& image);
+
+  // Wrap the pixels of a received raw frame without copying them
+  bool parseFrame(const uchar* data, size_t length, cv::Mat& image);
+
+  // Send a raw frame as a reply straight from the image buffer
+  bool sendFrame(const int socket, uint32_t requestId, const cv::Mat& image,
+                 ReplyStatus status = ReplyStatus::Ok);
+
+  // Receive a raw frame reply straight into a new image, leaving the image
+  // empty for an empty reply
+  bool receiveFrame(const int socket, ReplyHeader& header, cv::Mat& image);
 
-  // Send the image in fragments
-  void sendImage(const int socket, const std::vector<uchar>& buffer);
+  // Send a reply as an encoded image or a raw frame
+  bool sendReply(const int socket, uint32_t requestId,
+                 const ImageReply& reply);
 
-  // Receive the image in fragments
-  void receiveImage(const int socket, std::vector<uchar>& buffer);
+ public:
+  // Define a function to set the kernel socket buffer sizes in bytes
+  void setSocketBuffers(int sendBytes, int receiveBytes);
 };
 #endif  // SRC_PEER_H_
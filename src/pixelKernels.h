@@ -0,0 +1,83 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <opencv2/core.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define PIXEL_KERNELS_X86
+#endif  // __GNUC__ && __x86_64__
+
+#ifndef SRC_PIXELKERNELS_H_
+#define SRC_PIXELKERNELS_H_
+
+// Define the instruction sets the 8-bit kernels are built for, from the
+// slowest to the fastest
+enum class SimdLevel {
+  Scalar,
+  Sse42,
+  Avx2,
+  // AVX-512 with the byte permutes of VBMI
+  Avx512,
+};
+
+// Return the fastest level this CPU supports, detected once
+SimdLevel detectedSimdLevel();
+
+// Define functions to read and limit the level the kernels use, which never
+// exceeds the detected level
+SimdLevel simdLevel();
+void setSimdLevel(SimdLevel level);
+
+// Define functions to name and parse levels, such as "avx2"
+const char* simdLevelName(SimdLevel level);
+bool parseSimdLevel(const std::string& name, SimdLevel& level);
+
+// Define a table mapping every 8-bit value to its adjusted value
+using LookUpTable = std::array<uchar, 256>;
+
+// Define the adjustments whose tables are cached by parameter
+enum class LookUpKind {
+  Brightness,
+  Contrast,
+  Gamma,
+};
+
+// Return the table of an adjustment for a parameter, building it with the
+// given function the first time and sharing it between requests after that
+std::shared_ptr<const LookUpTable> cachedLookUpTable(
+    LookUpKind kind, double param, uchar (*build)(int value, double param));
+
+// Map every channel of an 8-bit image through a 256-entry table, as
+// cv::LUT does
+void applyLookUp(const cv::Mat& image, cv::Mat& newImage, const uchar* table);
+
+// Swap the blue and red channels of a 3 or 4-channel 8-bit image into a
+// 3-channel image, as cv::COLOR_BGR2RGB does, returning false for other
+// layouts
+bool swapRedBlue(const cv::Mat& image, cv::Mat& newImage);
+
+// Convert a 3 or 4-channel 8-bit image to grey with the fixed-point weights
+// of cv::COLOR_BGR2GRAY, returning false for other layouts
+bool convertToGrey(const cv::Mat& image, cv::Mat& newImage);
+
+// Rotate an image counter-clockwise by a number of quarter turns into the
+// given rows of an output already allocated at the rotated size, copying
+// pixels exactly in cache-sized blocks, and return false for pixel sizes
+// other than 1, 2, 3, 4, 6, 8, 12 or 16 bytes
+bool rotateQuarterTurns(const cv::Mat& image, cv::Mat& newImage,
+                        int quarterTurns, const cv::Range& rows);
+
+#endif  // SRC_PIXELKERNELS_H_
@@ -2,40 +2,157 @@
 
 #include "processing.h"
 
+#include "tileExecutor.h"
+
+// Geometric filter class
+
+TileMode GeometricFilter::tileMode() const { return TileMode::Geometric; }
+
+void GeometricFilter::allocateOutput(const cv::Mat& image, cv::Mat& newImage) {
+  cv::Size outputSize;
+  affineMatrix(image.size(), outputSize);
+  newImage.create(outputSize, image.type());
+}
+
 // Resize filter class
 
 ResizeFilter::ResizeFilter(double multiplier) : _multiplier_(multiplier) {}
 
-void ResizeFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+ResizeFilter::ResizeFilter(const cv::Size& outputSize)
+    : _multiplier_(0), _outputSize_(outputSize) {}
+
+cv::Size ResizeFilter::_resizedSize_(const cv::Size& size) const {
+  if (!_outputSize_.empty()) {
+    return _outputSize_;
+  }
+
   // Determine the new width and height
-  int newWidth = static_cast<int>(image.cols * _multiplier_);
-  int newHeight = static_cast<int>(image.rows * _multiplier_);
+  int newWidth = static_cast<int>(size.width * _multiplier_);
+  int newHeight = static_cast<int>(size.height * _multiplier_);
+  return cv::Size(newWidth, newHeight);
+}
 
+void ResizeFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
   // Resize the image
-  cv::resize(image, newImage, cv::Size(newWidth, newHeight));
+  cv::resize(image, newImage, _resizedSize_(image.size()));
+}
+
+cv::Mat ResizeFilter::affineMatrix(const cv::Size& size,
+                                   cv::Size& outputSize) const {
+  outputSize = _resizedSize_(size);
+
+  // Map pixel centres the same way as cv::resize
+  double scaleX = static_cast<double>(outputSize.width) / size.width;
+  double scaleY = static_cast<double>(outputSize.height) / size.height;
+  return (cv::Mat_<double>(2, 3) << scaleX, 0, 0.5 * scaleX - 0.5, 0, scaleY,
+          0.5 * scaleY - 0.5);
+}
+
+void ResizeFilter::applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                                   const cv::Range& rows) {
+  cv::Size outputSize;
+  cv::Mat resizeMatrix = affineMatrix(image.size(), outputSize);
+  resizeMatrix.at<double>(1, 2) -= rows.start;
+
+  // Resize straight into the stripe of the output
+  cv::Mat stripe = newImage.rowRange(rows);
+  cv::warpAffine(image, stripe, resizeMatrix, stripe.size(), cv::INTER_LINEAR,
+                 borderMode());
 }
 
 // Rotate filter class
 
-RotateFilter::RotateFilter(double angle) : _angle_(angle) {}
+RotateFilter::RotateFilter(double angle) : _angle_(angle), _quarterTurns_(-1) {
+  // Recognise multiples of 90 degrees, which turn counter-clockwise like
+  // cv::getRotationMatrix2D
+  double turns = angle / 90.0;
+  if (std::isfinite(turns) && turns == std::round(turns)) {
+    _quarterTurns_ = (static_cast<int>(std::fmod(turns, 4.0)) + 4) % 4;
+  }
+}
+
+cv::Mat RotateFilter::affineMatrix(const cv::Size& size,
+                                   cv::Size& outputSize) const {
+  // Map right angles exactly, so the last row and column stay in the output
+  if (_quarterTurns_ >= 0) {
+    double lastCol = size.width - 1;
+    double lastRow = size.height - 1;
+    outputSize =
+        _quarterTurns_ % 2 ? cv::Size(size.height, size.width) : size;
+    switch (_quarterTurns_) {
+      case 1:
+        return (cv::Mat_<double>(2, 3) << 0, 1, 0, -1, 0, lastCol);
+      case 2:
+        return (cv::Mat_<double>(2, 3) << -1, 0, lastCol, 0, -1, lastRow);
+      case 3:
+        return (cv::Mat_<double>(2, 3) << 0, -1, lastRow, 1, 0, 0);
+      default:
+        return (cv::Mat_<double>(2, 3) << 1, 0, 0, 0, 1, 0);
+    }
+  }
 
-void RotateFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
   // Determine the centre of rotation
-  cv::Point2f centre(image.cols / 2.0F, image.rows / 2.0F);
+  cv::Point2f centre(size.width / 2.0F, size.height / 2.0F);
 
   // Get the rotation matrix
   cv::Mat rotateMatrix = cv::getRotationMatrix2D(centre, _angle_, 1.0);
 
   // Determine the bounding rectangle
   cv::Rect2f boundRect =
-      cv::RotatedRect(cv::Point2f(), image.size(), _angle_).boundingRect2f();
+      cv::RotatedRect(cv::Point2f(), size, _angle_).boundingRect2f();
 
   // Adjust the rotation matrix to account for translation
   rotateMatrix.at<double>(0, 2) += boundRect.width / 2.0 - centre.x;
   rotateMatrix.at<double>(1, 2) += boundRect.height / 2.0 - centre.y;
 
+  outputSize = boundRect.size();
+  return rotateMatrix;
+}
+
+bool RotateFilter::isExact() const { return _quarterTurns_ >= 0; }
+
+int RotateFilter::borderMode() const {
+  return isExact() ? cv::BORDER_REPLICATE : cv::BORDER_CONSTANT;
+}
+
+void RotateFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  cv::Size outputSize;
+  cv::Mat rotateMatrix = affineMatrix(image.size(), outputSize);
+
+  // Copy right angles exactly, keeping the input apart from the output
+  cv::Mat source = image;
+  if (isExact()) {
+    if (newImage.data == source.data) {
+      newImage = cv::Mat();
+    }
+    newImage.create(outputSize, source.type());
+    if (rotateQuarterTurns(source, newImage, _quarterTurns_,
+                           cv::Range(0, outputSize.height))) {
+      return;
+    }
+  }
+
   // Rotate the image
-  cv::warpAffine(image, newImage, rotateMatrix, boundRect.size());
+  cv::warpAffine(source, newImage, rotateMatrix, outputSize, cv::INTER_LINEAR,
+                 borderMode());
+}
+
+void RotateFilter::applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                                   const cv::Range& rows) {
+  if (isExact() && rotateQuarterTurns(image, newImage, _quarterTurns_, rows)) {
+    return;
+  }
+
+  cv::Size outputSize;
+  cv::Mat rotateMatrix = affineMatrix(image.size(), outputSize);
+
+  // Shift the output so the stripe starts at the top
+  rotateMatrix.at<double>(1, 2) -= rows.start;
+
+  // Rotate straight into the stripe of the output
+  cv::Mat stripe = newImage.rowRange(rows);
+  cv::warpAffine(image, stripe, rotateMatrix, stripe.size(), cv::INTER_LINEAR,
+                 borderMode());
 }
 
 // Flip filter class
@@ -47,36 +164,149 @@ void FlipFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
   cv::flip(image, newImage, _flipCode_);
 }
 
+cv::Mat FlipFilter::affineMatrix(const cv::Size& size,
+                                 cv::Size& outputSize) const {
+  outputSize = size;
+
+  // Mirror the columns for positive codes and the rows for the others
+  bool mirrorCols = _flipCode_ != 0;
+  bool mirrorRows = _flipCode_ <= 0;
+  return (cv::Mat_<double>(2, 3) << (mirrorCols ? -1 : 1), 0,
+          (mirrorCols ? size.width - 1 : 0), 0, (mirrorRows ? -1 : 1),
+          (mirrorRows ? size.height - 1 : 0));
+}
+
+bool FlipFilter::isExact() const { return true; }
+
+void FlipFilter::applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                                 const cv::Range& rows) {
+  // Vertical flips read the mirrored stripe of the input
+  cv::Range sourceRows = rows;
+  if (_flipCode_ <= 0) {
+    sourceRows = cv::Range(image.rows - rows.end, image.rows - rows.start);
+  }
+
+  // Flip the stripe straight into the output
+  cv::Mat stripe = newImage.rowRange(rows);
+  cv::flip(image.rowRange(sourceRows), stripe, _flipCode_);
+}
+
+// Affine filter class
+
+AffineFilter::AffineFilter(const cv::Mat& matrix, const cv::Size& outputSize,
+                           int borderMode)
+    : _matrix_(matrix), _outputSize_(outputSize), _borderMode_(borderMode) {}
+
+void AffineFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  cv::warpAffine(image, newImage, _matrix_, _outputSize_, cv::INTER_LINEAR,
+                 _borderMode_);
+}
+
+TileMode AffineFilter::tileMode() const { return TileMode::Geometric; }
+
+void AffineFilter::allocateOutput(const cv::Mat& image, cv::Mat& newImage) {
+  newImage.create(_outputSize_, image.type());
+}
+
+void AffineFilter::applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                                   const cv::Range& rows) {
+  // Shift the output so the stripe starts at the top
+  cv::Mat matrix = _matrix_.clone();
+  matrix.at<double>(1, 2) -= rows.start;
+
+  cv::Mat stripe = newImage.rowRange(rows);
+  cv::warpAffine(image, stripe, matrix, stripe.size(), cv::INTER_LINEAR,
+                 _borderMode_);
+}
+
+// Colour adjust filter class
+
+TileMode ColourAdjustFilter::tileMode() const { return TileMode::Local; }
+
 // Brightness filter class
 
-BrightnessFilter::BrightnessFilter(double alpha) : _alpha_(alpha) {}
+BrightnessFilter::BrightnessFilter(double alpha)
+    : _alpha_(alpha),
+      _table_(cachedLookUpTable(
+          LookUpKind::Brightness, alpha, [](int value, double alpha) {
+            // Scale in single precision like convertTo on 8-bit images
+            return cv::saturate_cast<uchar>(static_cast<float>(value) *
+                                            static_cast<float>(alpha));
+          })) {}
 
 void BrightnessFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
-  // Adjust the brightness
-  image.convertTo(newImage, -1, _alpha_, 0);
+  // Adjust the brightness through the table, or in OpenCV for deeper images
+  if (image.depth() == CV_8U) {
+    applyLookUp(image, newImage, _table_->data());
+  } else {
+    image.convertTo(newImage, -1, _alpha_, 0);
+  }
+}
+
+uchar BrightnessFilter::adjustValue(uchar value) const {
+  return (*_table_)[value];
 }
 
 // Contrast filter class
 
-ContrastFilter::ContrastFilter(double beta) : _beta_(beta) {}
+ContrastFilter::ContrastFilter(double beta)
+    : _beta_(beta),
+      _table_(cachedLookUpTable(
+          LookUpKind::Contrast, beta, [](int value, double beta) {
+            return cv::saturate_cast<uchar>(static_cast<float>(value) +
+                                            static_cast<float>(beta));
+          })) {}
 
 void ContrastFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
-  // Adjust the contrast
-  image.convertTo(newImage, -1, 1, _beta_);
+  // Adjust the contrast through the table, or in OpenCV for deeper images
+  if (image.depth() == CV_8U) {
+    applyLookUp(image, newImage, _table_->data());
+  } else {
+    image.convertTo(newImage, -1, 1, _beta_);
+  }
+}
+
+uchar ContrastFilter::adjustValue(uchar value) const {
+  return (*_table_)[value];
 }
 
 // Gamma filter class
 
-GammaFilter::GammaFilter(double gamma) : _gamma_(gamma) {}
+GammaFilter::GammaFilter(double gamma)
+    : _gamma_(gamma),
+      _table_(cachedLookUpTable(
+          LookUpKind::Gamma, gamma, [](int value, double gamma) {
+            return cv::saturate_cast<uchar>(pow(value / 255.0, gamma) *
+                                            255.0);
+          })) {}
 
 void GammaFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
-  cv::Mat lookUp(1, 256, CV_8U);
-  uchar* p = lookUp.ptr();
-  for (int i = 0; i < 256; i++) {
-    p[i] = cv::saturate_cast<uchar>(pow(i / 255.0, _gamma_) * 255.0);
+  if (image.depth() == CV_8U) {
+    applyLookUp(image, newImage, _table_->data());
+  } else {
+    cv::Mat lookUp(1, 256, CV_8U, const_cast<uchar*>(_table_->data()));
+    cv::LUT(image, lookUp, newImage);
   }
+}
 
-  cv::LUT(image, lookUp, newImage);
+uchar GammaFilter::adjustValue(uchar value) const {
+  return (*_table_)[value];
+}
+
+// Lookup table filter class
+
+LookUpFilter::LookUpFilter(const cv::Mat& lookUp) : _lookUp_(lookUp) {}
+
+void LookUpFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  if (image.depth() == CV_8U) {
+    applyLookUp(image, newImage, _lookUp_.ptr());
+  } else {
+    cv::LUT(image, _lookUp_, newImage);
+  }
+}
+
+uchar LookUpFilter::adjustValue(uchar value) const {
+  return _lookUp_.ptr()[value];
 }
 
 // Colour convert filter class
@@ -85,10 +315,18 @@ void ColourConvertFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
   cv::cvtColor(image, newImage, getConversionCode());
 }
 
+TileMode ColourConvertFilter::tileMode() const { return TileMode::Local; }
+
 // RGB filter class
 
 int RGBFilter::getConversionCode() const { return cv::COLOR_BGR2RGB; }
 
+void RGBFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  if (!swapRedBlue(image, newImage)) {
+    ColourConvertFilter::applyFilter(image, newImage);
+  }
+}
+
 // HSV filter class
 
 int HSVFilter::getConversionCode() const { return cv::COLOR_BGR2HSV; }
@@ -97,6 +335,12 @@ int HSVFilter::getConversionCode() const { return cv::COLOR_BGR2HSV; }
 
 int GreyFilter::getConversionCode() const { return cv::COLOR_BGR2GRAY; }
 
+void GreyFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  if (!convertToGrey(image, newImage)) {
+    ColourConvertFilter::applyFilter(image, newImage);
+  }
+}
+
 // YCrCb filter class
 
 int YCCFilter::getConversionCode() const { return cv::COLOR_BGR2YCrCb; }
@@ -105,20 +349,227 @@ int YCCFilter::getConversionCode() const { return cv::COLOR_BGR2YCrCb; }
 
 int HSLFilter::getConversionCode() const { return cv::COLOR_BGR2HLS; }
 
+// Smooth filter class
+
+TileMode SmoothFilter::tileMode() const { return TileMode::Local; }
+
 // Gaussian blur class
 
+// Define the largest radius blurred with the exact kernel, beyond which the
+// box blurs are cheaper
+static constexpr int MAX_EXACT_GAUSSIAN_RADIUS = 8;
+
+// Find the odd widths of three box blurs whose variances, (w * w - 1) / 12
+// each, add up to the variance of the Gaussian
+static std::vector<int> gaussianBoxWidths(double sigma) {
+  const int passes = 3;
+  double variance = 12 * sigma * sigma;
+  int narrow = static_cast<int>(std::sqrt(variance / passes + 1));
+  if (narrow % 2 == 0) {
+    narrow--;
+  }
+
+  // Use the narrow width for as many passes as keeps the variance closest
+  double narrowPasses =
+      (variance - passes * (narrow * narrow + 4 * narrow + 3)) /
+      (-4.0 * narrow - 4);
+  int count = std::clamp(cvRound(narrowPasses), 0, passes);
+
+  std::vector<int> widths;
+  for (int i = 0; i < passes; i++) {
+    widths.push_back(i < count ? narrow : narrow + 2);
+  }
+  return widths;
+}
+
+GaussianFilter::GaussianFilter(int radius, double sigma) : _sigma_(sigma) {
+  // Cover three sigmas when only the sigma is given, like OpenCV
+  if (radius <= 0) {
+    radius = sigma > 0 ? std::max(1, cvRound(sigma * 3))
+                       : DEFAULT_SMOOTH_RADIUS;
+  }
+  _kernelSize_ = cv::Size(2 * radius + 1, 2 * radius + 1);
+
+  // Derive the sigma of large kernels the same way as OpenCV
+  if (radius > MAX_EXACT_GAUSSIAN_RADIUS) {
+    _boxWidths_ = gaussianBoxWidths(sigma > 0 ? sigma
+                                              : 0.3 * (radius - 1) + 0.8);
+  }
+}
+
 void GaussianFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
-  cv::GaussianBlur(image, newImage, _kernelSize_, 0);
+  if (_boxWidths_.empty()) {
+    cv::GaussianBlur(image, newImage, _kernelSize_, _sigma_);
+    return;
+  }
+
+  // Blur 8-bit images in 16-bit fixed point so the passes keep their
+  // fractions, where OpenCV slides each box with running sums
+  bool fixedPoint = image.depth() == CV_8U;
+  double scale = fixedPoint ? 256.0 : 1.0;
+  cv::Mat work, blurred;
+  image.convertTo(work, fixedPoint ? CV_16U : CV_32F, scale);
+  for (int width : _boxWidths_) {
+    cv::blur(work, blurred, cv::Size(width, width));
+    std::swap(work, blurred);
+  }
+  work.convertTo(newImage, image.depth(), 1.0 / scale);
+}
+
+int GaussianFilter::haloRows() const {
+  if (_boxWidths_.empty()) {
+    return _kernelSize_.height / 2;
+  }
+
+  // Each box blur reaches half its width further
+  int halo = 0;
+  for (int width : _boxWidths_) {
+    halo += width / 2;
+  }
+  return halo;
 }
 
 // Box blur class
 
+BoxFilter::BoxFilter(int radius) {
+  if (radius <= 0) {
+    radius = DEFAULT_SMOOTH_RADIUS;
+  }
+  _kernelSize_ = cv::Size(2 * radius + 1, 2 * radius + 1);
+}
+
 void BoxFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  // OpenCV slides the box with running sums, so any radius costs the same
   cv::blur(image, newImage, _kernelSize_);
 }
 
+int BoxFilter::haloRows() const { return _kernelSize_.height / 2; }
+
 // Sharpening class
 
 void SharpFilter::applyFilter(cv::Mat& image, cv::Mat& newImage) {
   cv::filter2D(image, newImage, image.depth(), _sharpKernel_);
 }
+
+int SharpFilter::haloRows() const { return _sharpKernel_.rows / 2; }
+
+// Filter chain class
+
+void FilterChain::addFilter(std::unique_ptr<ImageFilter> filter) {
+  _filters_.push_back(std::move(filter));
+}
+
+bool FilterChain::empty() const { return _filters_.empty(); }
+
+void FilterChain::setExecutor(TileExecutor* executor) { _executor_ = executor; }
+
+TileMode FilterChain::tileMode() const {
+  for (const auto& filter : _filters_) {
+    if (filter->tileMode() != TileMode::Local) {
+      return TileMode::Whole;
+    }
+  }
+  return _filters_.empty() ? TileMode::Whole : TileMode::Local;
+}
+
+int FilterChain::haloRows() const {
+  int halo = 0;
+  for (const auto& filter : _filters_) {
+    halo += filter->haloRows();
+  }
+  return halo;
+}
+
+void FilterChain::_applyStep_(ImageFilter& filter, cv::Mat& image,
+                              cv::Mat& newImage) {
+  if (_executor_) {
+    _executor_->applyFilter(filter, image, newImage);
+  } else {
+    filter.applyFilter(image, newImage);
+  }
+}
+
+AffineFilter FilterChain::_fuseGeometric_(size_t first, size_t last,
+                                          const cv::Size& size) const {
+  // Compose the transforms as 3x3 matrices, each step seeing the size the
+  // step before it produced
+  cv::Mat transform = cv::Mat::eye(3, 3, CV_64F);
+  cv::Size outputSize = size;
+  int borderMode = cv::BORDER_REPLICATE;
+  for (size_t j = first; j < last; j++) {
+    auto* filter = static_cast<GeometricFilter*>(_filters_[j].get());
+    cv::Size stepSize;
+    cv::Mat step = cv::Mat::eye(3, 3, CV_64F);
+    filter->affineMatrix(outputSize, stepSize).copyTo(step.rowRange(0, 2));
+    transform = step * transform;
+    outputSize = stepSize;
+
+    // Keep the black corners of any rotation
+    if (filter->borderMode() == cv::BORDER_CONSTANT) {
+      borderMode = cv::BORDER_CONSTANT;
+    }
+  }
+
+  return AffineFilter(transform.rowRange(0, 2).clone(), outputSize,
+                      borderMode);
+}
+
+void FilterChain::applyFilter(cv::Mat& image, cv::Mat& newImage) {
+  cv::Mat current = image;
+  size_t i = 0;
+
+  while (i < _filters_.size()) {
+    // Find the run of colour adjustments starting at this filter
+    size_t runEnd = i;
+    while (runEnd < _filters_.size() &&
+           dynamic_cast<ColourAdjustFilter*>(_filters_[runEnd].get())) {
+      ++runEnd;
+    }
+
+    // Find the run of geometric filters starting at this filter, and
+    // whether any of them resamples rather than moving whole pixels
+    size_t geometricEnd = i;
+    bool resamples = false;
+    while (geometricEnd < _filters_.size()) {
+      auto* geometric =
+          dynamic_cast<GeometricFilter*>(_filters_[geometricEnd].get());
+      if (!geometric) {
+        break;
+      }
+      resamples = resamples || !geometric->isExact();
+      ++geometricEnd;
+    }
+
+    cv::Mat next;
+    if (runEnd - i >= 2) {
+      // Compose the adjustments into one table and apply it in one pass
+      cv::Mat lookUp(1, 256, CV_8U);
+      uchar* p = lookUp.ptr();
+      for (int value = 0; value < 256; value++) {
+        uchar adjusted = static_cast<uchar>(value);
+        for (size_t j = i; j < runEnd; j++) {
+          adjusted = static_cast<ColourAdjustFilter*>(_filters_[j].get())
+                         ->adjustValue(adjusted);
+        }
+        p[value] = adjusted;
+      }
+
+      LookUpFilter fused(lookUp);
+      _applyStep_(fused, current, next);
+      i = runEnd;
+    } else if (geometricEnd - i >= 2 && resamples) {
+      // Resample the whole run once, where exact runs are cheaper as they
+      // are
+      AffineFilter fused = _fuseGeometric_(i, geometricEnd, current.size());
+      _applyStep_(fused, current, next);
+      i = geometricEnd;
+    } else {
+      _applyStep_(*_filters_[i], current, next);
+      ++i;
+    }
+
+    current = next;
+  }
+
+  newImage = current;
+}
@@ -8,42 +8,130 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "pixelKernels.h"
+
 #ifndef SRC_PROCESSING_H_
 #define SRC_PROCESSING_H_
 
+// Declare the executor that splits filters across worker threads
+class TileExecutor;
+
+// Define an enumeration for how a filter can be split into stripes
+enum class TileMode {
+  // The filter must run on the whole image at once
+  Whole,
+  // Each output row only depends on nearby input rows
+  Local,
+  // The output geometry differs, so stripes are cut from the output
+  Geometric,
+};
+
 // Define a base class for all filters
 class ImageFilter {
  public:
+  virtual ~ImageFilter() = default;
+
   // Pure virtual filter application function
   virtual void applyFilter(cv::Mat& image, cv::Mat& newImage) = 0;
+
+  // Virtual function to describe how the filter can be tiled
+  virtual TileMode tileMode() const { return TileMode::Whole; }
+
+  // Virtual function to return the input rows needed around each output row
+  virtual int haloRows() const { return 0; }
+
+  // Virtual function to allocate the whole output of a geometric filter
+  virtual void allocateOutput(const cv::Mat& /*image*/,
+                              cv::Mat& /*newImage*/) {}
+
+  // Virtual function to compute a stripe of a geometric filter's output
+  virtual void applyFilterRows(cv::Mat& /*image*/, cv::Mat& /*newImage*/,
+                               const cv::Range& /*rows*/) {}
+};
+
+// Define an abstract derived class for filters that move pixels through an
+// affine transform, so consecutive ones can be resampled once
+class GeometricFilter : public ImageFilter {
+ public:
+  // Pure virtual function to build the 2x3 matrix mapping input pixel
+  // centres to output pixel centres, and the size of the output
+  virtual cv::Mat affineMatrix(const cv::Size& size,
+                               cv::Size& outputSize) const = 0;
+
+  // Virtual function to tell whether the filter only moves whole pixels
+  virtual bool isExact() const { return false; }
+
+  // Virtual function to return how pixels outside the input are filled
+  virtual int borderMode() const { return cv::BORDER_REPLICATE; }
+
+  TileMode tileMode() const override;
+
+  void allocateOutput(const cv::Mat& image, cv::Mat& newImage) override;
 };
 
 // Define a derived class for resizing
-class ResizeFilter : public ImageFilter {
+class ResizeFilter : public GeometricFilter {
  private:
   // Define the multiplier
   double _multiplier_;
 
+  // Define the exact output size, used instead of the multiplier when set
+  cv::Size _outputSize_;
+
+  // Define a function to find the output size for an input size
+  cv::Size _resizedSize_(const cv::Size& size) const;
+
  public:
   ResizeFilter(double multiplier);
 
+  // Resize to an exact size, such as when an image decoded at reduced
+  // resolution must end up the size the multiplier gives the full image
+  explicit ResizeFilter(const cv::Size& outputSize);
+
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  cv::Mat affineMatrix(const cv::Size& size,
+                       cv::Size& outputSize) const override;
+
+  void applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                       const cv::Range& rows) override;
 };
 
-// Define a derived class for rotating
-class RotateFilter : public ImageFilter {
+// Define a derived class for rotating, where multiples of 90 degrees copy
+// pixels exactly instead of resampling them
+class RotateFilter : public GeometricFilter {
  private:
   // Define the rotation angle
   double _angle_;
 
+  // Define the counter-clockwise quarter turns, or -1 for other angles
+  int _quarterTurns_;
+
  public:
   RotateFilter(double angle);
 
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  cv::Mat affineMatrix(const cv::Size& size,
+                       cv::Size& outputSize) const override;
+
+  bool isExact() const override;
+
+  // Other angles fill the corners outside the input with black
+  int borderMode() const override;
+
+  void applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                       const cv::Range& rows) override;
 };
 
 // Define derived class for flipping
-class FlipFilter : public ImageFilter {
+class FlipFilter : public GeometricFilter {
  private:
   // Define the flip code
   int _flipCode_;
@@ -52,12 +140,45 @@ class FlipFilter : public ImageFilter {
   FlipFilter(int flipCode);
 
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  cv::Mat affineMatrix(const cv::Size& size,
+                       cv::Size& outputSize) const override;
+
+  bool isExact() const override;
+
+  void applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                       const cv::Range& rows) override;
+};
+
+// Define a derived class that resamples an image once through an affine
+// transform, used to fuse consecutive geometric filters
+class AffineFilter : public ImageFilter {
+ private:
+  cv::Mat _matrix_;
+  cv::Size _outputSize_;
+  int _borderMode_;
+
+ public:
+  AffineFilter(const cv::Mat& matrix, const cv::Size& outputSize,
+               int borderMode);
+
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  TileMode tileMode() const override;
+
+  void allocateOutput(const cv::Mat& image, cv::Mat& newImage) override;
+
+  void applyFilterRows(cv::Mat& image, cv::Mat& newImage,
+                       const cv::Range& rows) override;
 };
 
 // Define an abstract derived class for colour adjustment filters
 class ColourAdjustFilter : public ImageFilter {
  public:
-  // Abstract class
+  // Pure virtual per-pixel mapping, used to fuse adjustments into one table
+  virtual uchar adjustValue(uchar value) const = 0;
+
+  TileMode tileMode() const override;
 };
 
 // Define derived class for brightness adjustment
@@ -66,10 +187,15 @@ class BrightnessFilter : public ColourAdjustFilter {
   // Define the alpha value
   double _alpha_;
 
+  // Define the cached table for 8-bit images, rounded like convertTo
+  std::shared_ptr<const LookUpTable> _table_;
+
  public:
   BrightnessFilter(double alpha);
 
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  uchar adjustValue(uchar value) const override;
 };
 
 // Define derived class for contrast adjustment
@@ -78,10 +204,15 @@ class ContrastFilter : public ColourAdjustFilter {
   // Define the beta value
   double _beta_;
 
+  // Define the cached table for 8-bit images, rounded like convertTo
+  std::shared_ptr<const LookUpTable> _table_;
+
  public:
   ContrastFilter(double beta);
 
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  uchar adjustValue(uchar value) const override;
 };
 
 // Define derived class for gamma correction
@@ -90,10 +221,29 @@ class GammaFilter : public ColourAdjustFilter {
   // Define the gamma value
   double _gamma_;
 
+  // Define the cached table, shared by every request with this gamma
+  std::shared_ptr<const LookUpTable> _table_;
+
  public:
   GammaFilter(double gamma);
 
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  uchar adjustValue(uchar value) const override;
+};
+
+// Define derived class for a precomputed lookup table
+class LookUpFilter : public ColourAdjustFilter {
+ private:
+  // Define the lookup table
+  cv::Mat _lookUp_;
+
+ public:
+  LookUpFilter(const cv::Mat& lookUp);
+
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  uchar adjustValue(uchar value) const override;
 };
 
 // Define an abstract derived class for colour conversion filters
@@ -104,12 +254,18 @@ class ColourConvertFilter : public ImageFilter {
 
  public:
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  TileMode tileMode() const override;
 };
 
 // Define derived class for RGB conversion
 class RGBFilter : public ColourConvertFilter {
  protected:
   int getConversionCode() const override;
+
+ public:
+  // Swap 8-bit channels with the SIMD kernel
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
 };
 
 // Define derived class for HSV conversion
@@ -122,6 +278,10 @@ class HSVFilter : public ColourConvertFilter {
 class GreyFilter : public ColourConvertFilter {
  protected:
   int getConversionCode() const override;
+
+ public:
+  // Weigh 8-bit channels with the SIMD kernel
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
 };
 
 // Define derived class for YCrCb conversion
@@ -139,25 +299,44 @@ class HSLFilter : public ColourConvertFilter {
 // Define an abstract derived class for smoothing filters
 class SmoothFilter : public ImageFilter {
  public:
-  // Abstract class
+  TileMode tileMode() const override;
 };
 
-// Define derived class for Gaussian blur
+// Define the radius of blurs that do not ask for one
+constexpr int DEFAULT_SMOOTH_RADIUS = 2;
+
+// Define derived class for Gaussian blur, which applies the exact kernel to
+// small radii and three box blurs of the same variance to larger ones, so
+// its cost per pixel does not grow with the radius
 class GaussianFilter : public SmoothFilter {
  private:
-  cv::Size _kernelSize_ = cv::Size(5, 5);
+  cv::Size _kernelSize_;
+
+  // Zero lets OpenCV derive the sigma from the kernel size
+  double _sigma_;
+
+  // The widths of the box blurs, or empty for the exact kernel
+  std::vector<int> _boxWidths_;
 
  public:
+  explicit GaussianFilter(int radius = 0, double sigma = 0);
+
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  int haloRows() const override;
 };
 
 // Define derived class for box blur
 class BoxFilter : public SmoothFilter {
  private:
-  cv::Size _kernelSize_ = cv::Size(5, 5);
+  cv::Size _kernelSize_;
 
  public:
+  explicit BoxFilter(int radius = 0);
+
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  int haloRows() const override;
 };
 
 // Define derived class for sharpening
@@ -168,6 +347,43 @@ class SharpFilter : public SmoothFilter {
 
  public:
   void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  int haloRows() const override;
+};
+
+// Define a composite filter that applies an ordered chain of filters
+class FilterChain : public ImageFilter {
+ private:
+  // Define the filters in application order
+  std::vector<std::unique_ptr<ImageFilter>> _filters_;
+
+  // Define the executor used to split each step across threads
+  TileExecutor* _executor_ = nullptr;
+
+  // Define a function to apply one step, tiled when an executor is set
+  void _applyStep_(ImageFilter& filter, cv::Mat& image, cv::Mat& newImage);
+
+  // Define a function to build the transform of a run of geometric filters
+  AffineFilter _fuseGeometric_(size_t first, size_t last,
+                               const cv::Size& size) const;
+
+ public:
+  // Append a filter to the end of the chain
+  void addFilter(std::unique_ptr<ImageFilter> filter);
+
+  bool empty() const;
+
+  // Split each step across threads with the given executor
+  void setExecutor(TileExecutor* executor);
+
+  // Consecutive colour adjustments are fused into a single lookup table,
+  // and consecutive geometric filters into a single affine transform
+  void applyFilter(cv::Mat& image, cv::Mat& newImage) override;
+
+  // A chain of local filters is local, reading the sum of their halos
+  TileMode tileMode() const override;
+
+  int haloRows() const override;
 };
 
 #endif  // SRC_PROCESSING_H_
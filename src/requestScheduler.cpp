@@ -0,0 +1,143 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "requestScheduler.h"
+
+RequestScheduler::RequestScheduler(ThreadPool& pool, size_t maxQueued)
+    : _pool_(pool), _maxRunning_(pool.size()), _maxQueued_(maxQueued) {}
+
+void RequestScheduler::setMaxQueued(size_t jobs) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  _maxQueued_ = std::max<size_t>(1, jobs);
+}
+
+void RequestScheduler::setWeight(uint64_t client, double weight) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  _weights_[client] = weight;
+}
+
+bool RequestScheduler::submit(uint64_t client, double cost,
+                              std::chrono::steady_clock::time_point deadline,
+                              Task run, Reject reject) {
+  Reject shed;
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+
+    if (_queued_ >= _maxQueued_) {
+      // Find the client with the most jobs waiting
+      auto longest = _clients_.end();
+      for (auto it = _clients_.begin(); it != _clients_.end(); ++it) {
+        if (longest == _clients_.end() ||
+            it->second.jobs.size() > longest->second.jobs.size()) {
+          longest = it;
+        }
+      }
+
+      // Shed the new job if its own client holds the most, so a flood from
+      // one client never pushes out the jobs of the others
+      size_t ownJobs = 0;
+      auto own = _clients_.find(client);
+      if (own != _clients_.end()) ownJobs = own->second.jobs.size();
+      if (longest == _clients_.end() ||
+          ownJobs + 1 >= longest->second.jobs.size()) {
+        _shed_++;
+        return false;
+      }
+
+      shed = std::move(longest->second.jobs.back().reject);
+      longest->second.jobs.pop_back();
+      _queued_--;
+      _shed_++;
+    }
+
+    // Tag the job with the virtual time at which it would finish if each
+    // client were served at the rate of its weight
+    double weight = 1;
+    auto found = _weights_.find(client);
+    if (found != _weights_.end()) weight = found->second;
+    ClientQueue& queue = _clients_[client];
+    double start = std::max(_virtualTime_, queue.lastFinish);
+    queue.lastFinish = start + cost / weight;
+    queue.jobs.push_back(
+        {queue.lastFinish, deadline, std::move(run), std::move(reject)});
+    _queued_++;
+  }
+
+  if (shed) shed(ReplyStatus::Busy);
+  _dispatch_();
+  return true;
+}
+
+RequestScheduler::Job RequestScheduler::_takeNext_() {
+  // Serve the client whose next job has the earliest finish tag, forgetting
+  // idle clients once their last job no longer affects their tags
+  auto next = _clients_.end();
+  for (auto it = _clients_.begin(); it != _clients_.end();) {
+    const ClientQueue& queue = it->second;
+    if (queue.jobs.empty()) {
+      it = queue.lastFinish <= _virtualTime_ ? _clients_.erase(it)
+                                             : std::next(it);
+      continue;
+    }
+    if (next == _clients_.end() ||
+        queue.jobs.front().finish < next->second.jobs.front().finish) {
+      next = it;
+    }
+    ++it;
+  }
+
+  Job job = std::move(next->second.jobs.front());
+  next->second.jobs.pop_front();
+  _queued_--;
+  _virtualTime_ = job.finish;
+  return job;
+}
+
+void RequestScheduler::_dispatch_() {
+  std::vector<Reject> expired;
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    while (_running_ < _maxRunning_ && _queued_ > 0) {
+      Job job = _takeNext_();
+
+      // Drop jobs that waited past their deadline without running them
+      if (job.deadline < now) {
+        expired.push_back(std::move(job.reject));
+        _expired_++;
+        continue;
+      }
+
+      // Start the next job once this one finishes
+      _running_++;
+      _pool_.execute([this, run = std::move(job.run)]() {
+        try {
+          run();
+        } catch (...) {
+        }
+        {
+          std::lock_guard<std::mutex> guard(_mutex_);
+          _running_--;
+        }
+        _dispatch_();
+      });
+    }
+  }
+
+  for (Reject& reject : expired) {
+    reject(ReplyStatus::Expired);
+  }
+}
+
+size_t RequestScheduler::queued() {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  return _queued_;
+}
+
+size_t RequestScheduler::running() {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  return _running_;
+}
+
+uint64_t RequestScheduler::shed() const { return _shed_; }
+
+uint64_t RequestScheduler::expired() const { return _expired_; }
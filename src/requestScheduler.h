@@ -0,0 +1,101 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "peer.h"
+#include "threadPool.h"
+
+#ifndef SRC_REQUESTSCHEDULER_H_
+#define SRC_REQUESTSCHEDULER_H_
+
+// Define a scheduler in front of the thread pool that bounds the requests
+// waiting for a worker, sheds requests it cannot hold, drops requests that
+// waited past their deadline and shares the workers fairly between clients
+// with self-clocked weighted fair queueing
+class RequestScheduler {
+ public:
+  // Define the callbacks of a job, where a rejected job is told why
+  using Task = std::function<void()>;
+  using Reject = std::function<void(ReplyStatus status)>;
+
+ private:
+  // Define a struct for one job waiting for a worker
+  struct Job {
+    double finish;
+    std::chrono::steady_clock::time_point deadline;
+    Task run;
+    Reject reject;
+  };
+
+  // Define a struct for the jobs of one client, with the finish tag of its
+  // last job so a busy client keeps falling further behind
+  struct ClientQueue {
+    std::deque<Job> jobs;
+    double lastFinish = 0;
+  };
+
+  // Define the pool the jobs run on and how many of them may run at once
+  ThreadPool& _pool_;
+  size_t _maxRunning_;
+
+  // Define the most jobs that may wait across every client
+  size_t _maxQueued_;
+
+  // Define the waiting jobs by client, and the weights of clients that do
+  // not have the default weight of 1
+  std::unordered_map<uint64_t, ClientQueue> _clients_;
+  std::unordered_map<uint64_t, double> _weights_;
+
+  // Define the virtual time, which is the finish tag of the last job
+  // started
+  double _virtualTime_ = 0;
+
+  size_t _queued_ = 0;
+  size_t _running_ = 0;
+  std::mutex _mutex_;
+
+  // Define counters for the stats snapshot
+  std::atomic<uint64_t> _shed_{0};
+  std::atomic<uint64_t> _expired_{0};
+
+  // Define a function to take the job with the earliest finish tag
+  Job _takeNext_();
+
+  // Define a function to start jobs while workers are free, rejecting the
+  // ones past their deadline
+  void _dispatch_();
+
+ public:
+  RequestScheduler(ThreadPool& pool, size_t maxQueued);
+
+  // Define functions to change the queue bound and the weight of a client
+  void setMaxQueued(size_t jobs);
+  void setWeight(uint64_t client, double weight);
+
+  // Queue a job of a client, where the cost is the relative work the job
+  // takes, returning false if the job was shed. A full queue sheds the
+  // newest job of the client with the most jobs waiting, which may be the
+  // new job
+  bool submit(uint64_t client, double cost,
+              std::chrono::steady_clock::time_point deadline, Task run,
+              Reject reject);
+
+  size_t queued();
+  size_t running();
+  uint64_t shed() const;
+  uint64_t expired() const;
+};
+
+#endif  // SRC_REQUESTSCHEDULER_H_
@@ -0,0 +1,147 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "resultCache.h"
+
+size_t ResultCache::KeyHash::operator()(const ResultKey& key) const {
+  return static_cast<size_t>(
+      key.imageHash ^ std::hash<std::string>()(key.instruction));
+}
+
+ResultCache::ResultCache(size_t byteBudget) : _byteBudget_(byteBudget) {}
+
+ResultKey ResultCache::makeKey(const std::vector<FilterStep>& steps,
+                               ImageFormat format,
+                               const std::vector<uchar>& image) {
+  ResultKey key;
+  key.imageHash = hashBytes(image.data(), image.size(), 0);
+  key.imageLength = image.size();
+
+  // Append the fixed-size opcode and parameter of every step
+  auto appendField = [&key](const void* field, size_t size) {
+    key.instruction.append(static_cast<const char*>(field), size);
+  };
+  for (const FilterStep& step : steps) {
+    appendField(&step.opcode, sizeof(step.opcode));
+    appendField(&step.param, sizeof(step.param));
+  }
+  appendField(&format, sizeof(format));
+
+  return key;
+}
+
+void ResultCache::process(const ResultKey& key,
+                          const std::function<ImageReply()>& compute,
+                          Callback deliver) {
+  {
+    std::unique_lock<std::mutex> lock(_mutex_);
+
+    // Serve a cached reply and mark it as most recently used
+    auto cached = _index_.find(key);
+    if (cached != _index_.end()) {
+      _entries_.splice(_entries_.begin(), _entries_, cached->second);
+      ImageReply reply = cached->second->reply;
+      lock.unlock();
+      _hits_++;
+      deliver(std::move(reply));
+      return;
+    }
+
+    // Wait for an identical request that is already being processed
+    auto pending = _inFlight_.find(key);
+    if (pending != _inFlight_.end()) {
+      pending->second.push_back(std::move(deliver));
+      _coalesced_++;
+      return;
+    }
+
+    // Become the request that every identical one waits on
+    _inFlight_[key].push_back(std::move(deliver));
+    _misses_++;
+  }
+
+  // Make sure waiters are released even if processing fails
+  ImageReply reply;
+  try {
+    reply = compute();
+  } catch (...) {
+    _complete_(key, ImageReply());
+    throw;
+  }
+  _complete_(key, std::move(reply));
+}
+
+void ResultCache::_complete_(const ResultKey& key, ImageReply reply) {
+  std::vector<Callback> waiters;
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+    auto pending = _inFlight_.find(key);
+    waiters.swap(pending->second);
+    _inFlight_.erase(pending);
+
+    // Only keep usable replies, whose bytes every waiter shares
+    _share_(reply);
+    if (reply.length() > 0) {
+      _insert_(key, reply);
+    }
+  }
+
+  for (Callback& waiter : waiters) {
+    waiter(reply);
+  }
+}
+
+void ResultCache::_insert_(const ResultKey& key, const ImageReply& reply) {
+  size_t size = key.instruction.size() + reply.length();
+  if (size > _byteBudget_) {
+    return;
+  }
+
+  _entries_.push_front({key, reply, size});
+  _index_[key] = _entries_.begin();
+  _bytesUsed_ += size;
+  _evict_();
+}
+
+void ResultCache::_evict_() {
+  // Drop the least recently used replies until the budget is met
+  while (_bytesUsed_ > _byteBudget_ && !_entries_.empty()) {
+    Entry& oldest = _entries_.back();
+    _bytesUsed_ -= oldest.size;
+    _index_.erase(oldest.key);
+    _entries_.pop_back();
+  }
+}
+
+void ResultCache::setByteBudget(size_t byteBudget) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  _byteBudget_ = byteBudget;
+  _evict_();
+}
+
+void ResultCache::setBufferPool(BufferPool* pool) {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  _buffers_ = pool;
+}
+
+void ResultCache::_share_(ImageReply& reply) {
+  if (reply.bytes.empty()) {
+    return;
+  }
+
+  // The pixels are shared already, as they are never written once filtered
+  BufferPool* buffers = _buffers_;
+  reply.sharedBytes = std::shared_ptr<const std::vector<uchar>>(
+      new std::vector<uchar>(std::move(reply.bytes)),
+      [buffers](std::vector<uchar>* bytes) {
+        if (buffers) {
+          buffers->releaseBytes(std::move(*bytes));
+        }
+        delete bytes;
+      });
+  reply.bytes.clear();
+}
+
+size_t ResultCache::bytesUsed() {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  return _bytesUsed_;
+}
@@ -0,0 +1,115 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "bufferPool.h"
+#include "peer.h"
+
+#ifndef SRC_RESULTCACHE_H_
+#define SRC_RESULTCACHE_H_
+
+// Define the key of one cached result, addressed by the received bytes and
+// the instruction that was applied to them
+struct ResultKey {
+  uint64_t imageHash;
+  size_t imageLength;
+  std::string instruction;
+
+  bool operator==(const ResultKey& other) const {
+    return imageHash == other.imageHash && imageLength == other.imageLength &&
+           instruction == other.instruction;
+  }
+};
+
+// Define an in-memory LRU cache of finished replies that also coalesces
+// identical requests while the first one is still being processed
+class ResultCache {
+ public:
+  // Define the callback that receives a finished reply, where the bytes of
+  // a reply from the cache are shared rather than copied
+  using Callback = std::function<void(ImageReply reply)>;
+
+ private:
+  // Define a function to hash a key for the lookup tables
+  struct KeyHash {
+    size_t operator()(const ResultKey& key) const;
+  };
+
+  // Define a struct for one cached reply
+  struct Entry {
+    ResultKey key;
+    ImageReply reply;
+    size_t size;
+  };
+
+  // Define the most bytes of replies kept at once
+  size_t _byteBudget_;
+  size_t _bytesUsed_ = 0;
+
+  // Define the replies, most recently used first, and their index
+  std::list<Entry> _entries_;
+  std::unordered_map<ResultKey, std::list<Entry>::iterator, KeyHash> _index_;
+
+  // Define the callbacks waiting on requests that are being processed
+  std::unordered_map<ResultKey, std::vector<Callback>, KeyHash> _inFlight_;
+
+  // Define a mutex to synchronise access to the tables
+  std::mutex _mutex_;
+
+  // Define the pool that the bytes of replies are returned to
+  BufferPool* _buffers_ = nullptr;
+
+  // Define the lookup counters
+  std::atomic<uint64_t> _hits_{0};
+  std::atomic<uint64_t> _misses_{0};
+  std::atomic<uint64_t> _coalesced_{0};
+
+  // Define functions to store a reply and keep within the budget
+  void _insert_(const ResultKey& key, const ImageReply& reply);
+  void _evict_();
+
+  // Define a function to finish a request and wake its waiters
+  void _complete_(const ResultKey& key, ImageReply reply);
+
+  // Define a function to move the bytes of a reply behind a reference
+  // count, returning them to the pool once the last reply is done
+  void _share_(ImageReply& reply);
+
+ public:
+  ResultCache(size_t byteBudget);
+
+  // Build the key for an image and the filter chain applied to it
+  static ResultKey makeKey(const std::vector<FilterStep>& steps,
+                           ImageFormat format, const std::vector<uchar>& image);
+
+  // Deliver the cached reply, wait on an identical request in flight, or
+  // compute the reply and deliver it to every waiter
+  void process(const ResultKey& key, const std::function<ImageReply()>& compute,
+               Callback deliver);
+
+  // Set the byte budget, evicting replies that no longer fit
+  void setByteBudget(size_t byteBudget);
+
+  // Return the bytes of replies to the pool once they are no longer used
+  void setBufferPool(BufferPool* pool);
+
+  // Report the cache counters
+  uint64_t hits() const { return _hits_; }
+  uint64_t misses() const { return _misses_; }
+  uint64_t coalesced() const { return _coalesced_; }
+  size_t bytesUsed();
+};
+
+#endif  // SRC_RESULTCACHE_H_
@@ -4,28 +4,78 @@
 
 // Define a function to handle communication with a specific client
 void Server::_handleClient_(int clientSocket) {
-  // Receive the instruction
-  std::string operation, param;
-  _receiveInstruction_(clientSocket, operation, param);
+  // Close the session if the client stays idle for too long
+#ifdef _WIN32
+  DWORD idleTimeout = IDLE_TIMEOUT_SECONDS * 1000;
+#else
+  timeval idleTimeout{};
+  idleTimeout.tv_sec = IDLE_TIMEOUT_SECONDS;
+#endif  // _WIN32
+  setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO,
+             reinterpret_cast<const char*>(&idleTimeout), sizeof(idleTimeout));
 
-  // Receive original image
-  std::vector<uchar> receiveBuffer;
-  receiveImage(clientSocket, receiveBuffer);
+  // Serve requests until the client disconnects or times out
+  _metrics_.connectionOpened();
+  RequestHeader header;
+  std::vector<FilterStep> steps;
+  while (receiveRequest(clientSocket, header, steps)) {
+    auto received = std::chrono::steady_clock::now();
+    ImageFormat format = header.format;
+    uint64_t imageLength = header.payloadLength;
 
-  // Decode the image
-  cv::Mat originalImage = cv::imdecode(receiveBuffer, cv::IMREAD_COLOR);
+    // Filter large raw frames while they are still arriving
+    if (_isStreamable_(steps, format, imageLength) && _acquireStream_()) {
+      bool streamed =
+          _streamClient_(clientSocket, header.requestId, steps, imageLength);
+      _releaseStream_();
+      if (!streamed) {
+        break;
+      }
+      continue;
+    }
 
-  // Apply a chosen filter
-  cv::Mat modifiedImage;
-  auto filter = _createFilter_(operation, param);
-  filter->applyFilter(originalImage, modifiedImage);
+    // Receive original image, or the raw frame to wrap without copying
+    std::vector<uchar> receiveBuffer = _buffers_.acquireBytes(imageLength);
+    if (!receiveExact(clientSocket, receiveBuffer.data(), imageLength)) {
+      break;
+    }
+    _metrics_.recordStage(Stage::Receive, received);
+
+    _metrics_.addBytesReceived(REQUEST_HEADER_SIZE +
+                               steps.size() * REQUEST_STEP_SIZE + imageLength);
+
+    // Wait for the reply, which may come from an identical request
+    std::promise<ImageReply> replyPromise;
+    std::future<ImageReply> replyFuture = replyPromise.get_future();
+    _serveRequest_(steps, format, receiveBuffer,
+                   [&replyPromise](ImageReply reply) {
+                     replyPromise.set_value(std::move(reply));
+                   });
+    ImageReply reply = replyFuture.get();
+
+    // Send modified image, or an empty reply if the request was unusable
+    auto replied = std::chrono::steady_clock::now();
+    if (!sendReply(clientSocket, header.requestId, reply)) {
+      break;
+    }
+    _metrics_.recordStage(Stage::Send, replied);
+    _metrics_.addBytesSent(REPLY_HEADER_SIZE + reply.length());
+
+    // Keep both buffers for the next request
+    _buffers_.releaseBytes(std::move(receiveBuffer));
+    _buffers_.releaseBytes(std::move(reply.bytes));
+  }
+  _metrics_.connectionClosed();
 
-  // Send modified image
-  std::vector<uchar> sendBuffer;
-  cv::imencode(".jpg", modifiedImage, sendBuffer);
-  sendImage(clientSocket, sendBuffer);
+  // Stop tracking the client socket
+  {
+    std::lock_guard<std::mutex> guard(_clientSocketMutex_);
+    _clientSockets_.erase(std::remove(_clientSockets_.begin(),
+                                      _clientSockets_.end(), clientSocket),
+                          _clientSockets_.end());
+  }
 
-  // Close the client socket after handling the communication
+  // Close the client socket after the session ends
 #ifdef _WIN32
   closesocket(clientSocket);
 #else
@@ -33,6 +83,541 @@ void Server::_handleClient_(int clientSocket) {
 #endif  // _WIN32
 }
 
+bool Server::_streamClient_(int clientSocket, uint32_t requestId,
+                            const std::vector<FilterStep>& steps,
+                            size_t imageLength) {
+  auto stream = std::make_shared<ImageStream>(imageLength);
+
+  // Filter on a worker and send each finished part from there
+  std::promise<bool> streamed;
+  std::future<bool> streamedFuture = streamed.get_future();
+  _pool_.execute([this, clientSocket, requestId, &steps, stream,
+                  &streamed]() {
+    streamed.set_value(this->_streamRequest_(
+        requestId, steps, *stream,
+        [this, clientSocket](const ImageReply& part) {
+          return sendBuffers(
+              clientSocket,
+              {{part.bytes.data(), part.bytes.size()},
+               {part.pixels.data,
+                part.pixels.total() * part.pixels.elemSize()}});
+        }));
+  });
+
+  // Receive the payload in chunks, waking the worker after each one
+  size_t filled = 0;
+  while (filled < imageLength) {
+    size_t chunk = std::min(imageLength - filled, STREAM_CHUNK_BYTES);
+    if (!receiveExact(clientSocket, stream->data() + filled, chunk)) {
+      stream->fail();
+      break;
+    }
+    filled += chunk;
+    stream->publish(filled);
+  }
+
+  return streamedFuture.get() && filled == imageLength;
+}
+
+bool Server::_isStreamable_(const std::vector<FilterStep>& steps,
+                            ImageFormat format, size_t imageLength) {
+  // Only raw frames arrive row by row, and only local chains can finish
+  // rows before the rows below them have arrived, while a coordinator
+  // needs the whole image to scatter it
+  if (format != ImageFormat::Raw || imageLength < STREAM_MIN_BYTES ||
+      _coordinator_.workerCount() > 0) {
+    return false;
+  }
+  auto chain = _createChain_(steps);
+  return chain && chain->tileMode() == TileMode::Local;
+}
+
+bool Server::_acquireStream_() {
+  // Leave most workers to requests that have fully arrived, as a streamed
+  // request holds its worker for as long as the upload takes
+  size_t maxStreams = std::max<size_t>(1, _pool_.size() / STREAM_WORKER_SHARE);
+  size_t active = _activeStreams_.load();
+  while (active < maxStreams) {
+    if (_activeStreams_.compare_exchange_weak(active, active + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Server::_releaseStream_() { _activeStreams_.fetch_sub(1); }
+
+bool Server::_streamRequest_(
+    uint32_t requestId, const std::vector<FilterStep>& steps,
+    ImageStream& stream,
+    const std::function<bool(const ImageReply& part)>& emit) {
+  // An empty reply keeps the session usable when nothing was sent yet
+  ImageReply emptyReply;
+  emptyReply.bytes = encodeReplyHeader(requestId, 0);
+
+  // Wait for the frame header and wrap the pixels that are still arriving
+  cv::Mat originalImage;
+  auto chain = _createChain_(steps);
+  if (!chain || stream.waitFor(sizeof(FrameHeader)) == 0 ||
+      !parseFrame(stream.data(), stream.size(), originalImage)) {
+    return emit(emptyReply);
+  }
+
+  size_t rowBytes = originalImage.step;
+  auto waitForRows = [&](int rows) {
+    size_t arrived = stream.waitFor(sizeof(FrameHeader) + rows * rowBytes);
+    if (arrived == 0) {
+      return -1;
+    }
+    return static_cast<int>((arrived - sizeof(FrameHeader)) / rowBytes);
+  };
+
+  // Frame the reply once the first rows reveal the output type
+  bool framed = false;
+  auto emitRows = [&](const cv::Mat& output, int first, int last) {
+    ImageReply part;
+    if (!framed) {
+      std::vector<uchar> header = frameHeader(output);
+      part.bytes = encodeReplyHeader(
+          requestId, header.size() + output.total() * output.elemSize());
+      part.bytes.insert(part.bytes.end(), header.begin(), header.end());
+      framed = true;
+    }
+    part.pixels = output.rowRange(first, last);
+    return emit(part);
+  };
+
+  // The filter stage of a streamed request includes waiting for its rows
+  bool succeeded;
+  uint32_t operations = ServerMetrics::operationMask(steps);
+  auto filtering = std::chrono::steady_clock::now();
+  try {
+    succeeded = _tileExecutor_.applyStreaming(*chain, originalImage,
+                                              waitForRows, emitRows);
+  } catch (const cv::Exception& e) {
+    std::cerr << "Error: Filter could not be applied: " << e.what()
+              << std::endl;
+    succeeded = false;
+  }
+  _metrics_.recordFilter(operations, filtering);
+  _metrics_.recordRequest(operations, succeeded);
+
+  if (!succeeded && !framed) {
+    return emit(emptyReply);
+  }
+  return succeeded;
+}
+
+void Server::_serveRequest_(const std::vector<FilterStep>& steps,
+                            ImageFormat format,
+                            const std::vector<uchar>& image,
+                            ResultCache::Callback deliver) {
+  // Answer metrics queries without recording them
+  if (steps.size() == 1 && steps[0].opcode == Opcode::Stats) {
+    deliver(_statsReply_(static_cast<StatsFormat>(steps[0].param)));
+    return;
+  }
+
+  // Record the outcome of the request as it is delivered
+  uint32_t operations = ServerMetrics::operationMask(steps);
+  auto started = std::chrono::steady_clock::now();
+  ResultCache::Callback record = [this, operations, started,
+                                  deliver = std::move(deliver)](
+                                     ImageReply reply) {
+    _metrics_.recordStage(Stage::Service, started);
+    _metrics_.recordRequest(operations, reply.length() > 0);
+    deliver(std::move(reply));
+  };
+
+  // Answer uploads and lookups straight from the image store
+  if (steps.size() == 1 && steps[0].opcode == Opcode::Store) {
+    record(_storeImage_(steps[0].param, format, image));
+    return;
+  }
+
+  // Filter video frames without the cache, as no two frames are the same
+  if (!steps.empty() && steps[0].opcode == Opcode::Stream) {
+    record(_processRequest_(steps, format, image));
+    return;
+  }
+
+  // Hash the received bytes before they are decoded
+  ResultKey key = ResultCache::makeKey(steps, format, image);
+  _cache_.process(
+      key, [&]() { return _processRequest_(steps, format, image); },
+      std::move(record));
+}
+
+ImageReply Server::_statsReply_(StatsFormat format) {
+  Gauges gauges = {
+      {"workers", _pool_.size()},
+      {"busy_workers", _pool_.busyWorkers()},
+      {"queued_tasks", _pool_.queuedTasks()},
+      {"cache_hits", _cache_.hits()},
+      {"cache_misses", _cache_.misses()},
+      {"cache_coalesced", _cache_.coalesced()},
+      {"cache_bytes", _cache_.bytesUsed()},
+      {"coordinator_workers", _coordinator_.workerCount()},
+      {"coordinator_tiles_sent", _coordinator_.tilesSent()},
+      {"coordinator_tiles_retried", _coordinator_.tilesRetried()},
+      {"coordinator_tiles_local", _coordinator_.tilesLocal()},
+      {"scheduler_queued", _scheduler_.queued()},
+      {"scheduler_running", _scheduler_.running()},
+      {"requests_shed", _scheduler_.shed()},
+      {"requests_expired", _scheduler_.expired()},
+      {"pool_hits", _buffers_.hits()},
+      {"pool_misses", _buffers_.misses()},
+      {"pool_idle_bytes", _buffers_.idleBytes()},
+      {"pool_resident_bytes", _buffers_.residentBytes()},
+      {"video_streams", _streams_.streamCount()},
+      {"video_frames", _streams_.frames()},
+      {"video_chains_built", _streams_.chainsBuilt()},
+  };
+
+  std::string snapshot =
+      _metrics_.snapshot(gauges, format == StatsFormat::Json);
+  ImageReply reply;
+  reply.bytes.assign(snapshot.begin(), snapshot.end());
+  return reply;
+}
+
+void Server::setCacheBudget(size_t bytes) { _cache_.setByteBudget(bytes); }
+
+void Server::setStoreBudget(size_t bytes) { _store_.setByteBudget(bytes); }
+
+void Server::setPoolBudget(size_t bytes) { _buffers_.setMaxIdleBytes(bytes); }
+
+void Server::setMaxInFlight(size_t requests) { _maxInFlight_ = requests; }
+
+void Server::setMaxQueued(size_t requests) {
+  _scheduler_.setMaxQueued(requests);
+}
+
+void Server::setDeadline(uint32_t milliseconds) {
+  _deadlineMs_ = milliseconds;
+}
+
+void Server::setMaxConnections(size_t connections) {
+  _maxConnections_ = connections;
+}
+
+void Server::setIoUring(bool enabled) { _useIoUring_ = enabled; }
+
+bool Server::setClientWeight(const std::string& address, double weight) {
+  in_addr clientAddr{};
+  if (weight <= 0 || inet_pton(AF_INET, address.c_str(), &clientAddr) != 1) {
+    return false;
+  }
+  _scheduler_.setWeight(clientAddr.s_addr, weight);
+  return true;
+}
+
+void Server::setPort(int port) { _port_ = port; }
+
+void Server::setWorkers(const std::vector<std::string>& addresses) {
+  _coordinator_.setWorkers(addresses);
+}
+
+ImageReply Server::_storeImage_(uint64_t handle, ImageFormat format,
+                                const std::vector<uchar>& image) {
+  // Reply with the handle in network byte order once the image is held
+  ImageReply reply;
+  uint64_t handleBytes = swapNetwork64(handle);
+  auto replyWithHandle = [&reply, &handleBytes]() {
+    const uchar* bytes = reinterpret_cast<const uchar*>(&handleBytes);
+    reply.bytes.assign(bytes, bytes + sizeof(handleBytes));
+  };
+
+  // Without an upload, only report whether the image is already held
+  if (image.empty()) {
+    if (_store_.contains(handle)) {
+      replyWithHandle();
+    }
+    return reply;
+  }
+
+  // Refuse an upload whose bytes do not match its handle, as another
+  // client asking for the handle would be given the wrong image
+  if (hashBytes(image.data(), image.size(), 0) != handle) {
+    return reply;
+  }
+
+  // Keep the image already held, as the same bytes decode the same way
+  if (_store_.contains(handle)) {
+    replyWithHandle();
+    return reply;
+  }
+
+  // Decode the upload once, copying raw pixels out of the receive buffer
+  cv::Mat decodedImage;
+  if (format == ImageFormat::Raw) {
+    if (parseFrame(image.data(), image.size(), decodedImage)) {
+      decodedImage = decodedImage.clone();
+    }
+  } else if (format == ImageFormat::Jpeg) {
+    decodedImage = cv::imdecode(image, cv::IMREAD_COLOR);
+  }
+
+  if (!decodedImage.empty() && _store_.insert(handle, decodedImage)) {
+    replyWithHandle();
+  }
+  return reply;
+}
+
+// Define the file extension, quality flag and quality range of each codec
+// of the encode operation, in registry order
+struct CodecInfo {
+  const char* extension;
+  int qualityFlag;
+  int minQuality;
+  int maxQuality;
+};
+
+static const CodecInfo CODECS[] = {
+    {".jpg", cv::IMWRITE_JPEG_QUALITY, 0, 100},
+    {".png", cv::IMWRITE_PNG_COMPRESSION, 0, 9},
+    {".webp", cv::IMWRITE_WEBP_QUALITY, 1, 100},
+};
+
+// Check that an encode step names a codec and a quality it accepts
+static bool isValidCodec(const FilterStep& step) {
+  if (step.choice() >= std::size(CODECS)) {
+    return false;
+  }
+  const CodecInfo& codec = CODECS[step.choice()];
+  int quality = step.quality();
+  return quality == -1 ||
+         (quality >= codec.minQuality && quality <= codec.maxQuality);
+}
+
+// Read the size of a JPEG from its frame header without decoding it,
+// returning false if the bytes are not a JPEG
+static bool readJpegSize(const std::vector<uchar>& bytes, cv::Size& size) {
+  if (bytes.size() < 4 || bytes[0] != 0xFF || bytes[1] != 0xD8) {
+    return false;
+  }
+
+  // Walk the marker segments up to the start of the frame
+  size_t position = 2;
+  while (position + 4 <= bytes.size()) {
+    if (bytes[position] != 0xFF) {
+      return false;
+    }
+    uchar marker = bytes[position + 1];
+    if (marker == 0xFF) {
+      position++;
+      continue;
+    }
+    if (marker == 0xD9 || marker == 0xDA) {
+      return false;
+    }
+
+    // Frame markers are C0 to CF, except DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      if (position + 9 > bytes.size()) {
+        return false;
+      }
+      size.height = bytes[position + 5] << 8 | bytes[position + 6];
+      size.width = bytes[position + 7] << 8 | bytes[position + 8];
+      return size.width > 0 && size.height > 0;
+    }
+    position += 2 + (bytes[position + 2] << 8 | bytes[position + 3]);
+  }
+  return false;
+}
+
+ImageReply Server::_processRequest_(const std::vector<FilterStep>& steps,
+                                    ImageFormat format,
+                                    const std::vector<uchar>& image) {
+  // Take the codec of the reply from a final encode step, which only
+  // applies to encoded replies
+  const FilterStep* encodeStep = nullptr;
+  if (!steps.empty() && steps.back().opcode == Opcode::Encode) {
+    encodeStep = &steps.back();
+    if (format != ImageFormat::Jpeg || !isValidCodec(*encodeStep)) {
+      return ImageReply();
+    }
+  }
+
+  // Split off the stored image or the video stream a chain starts from
+  bool isStored = !steps.empty() && steps[0].opcode == Opcode::Handle;
+  bool isFrame = !steps.empty() && steps[0].opcode == Opcode::Stream;
+  bool isNamed = isStored || isFrame;
+  std::vector<FilterStep> trimmedSteps;
+  if (isNamed || encodeStep) {
+    trimmedSteps.assign(steps.begin() + (isNamed ? 1 : 0),
+                        steps.end() - (encodeStep ? 1 : 0));
+  }
+  const std::vector<FilterStep>& filterSteps =
+      isNamed || encodeStep ? trimmedSteps : steps;
+
+  // Filter a stored image named by its handle without decoding it again,
+  // or decode the image, or wrap the raw pixels without copying them
+  cv::Mat originalImage;
+  cv::Size resizedSize;
+  if (isStored) {
+    originalImage = _store_.find(steps[0].param);
+  } else {
+    auto decoding = std::chrono::steady_clock::now();
+    if (format == ImageFormat::Raw) {
+      parseFrame(image.data(), image.size(), originalImage);
+    } else if (isFrame && format == ImageFormat::Jpeg) {
+      // Decode frames at full size, so one chain suits every frame
+      originalImage = cv::imdecode(image, cv::IMREAD_COLOR);
+    } else if (format == ImageFormat::Jpeg) {
+      originalImage = _decodeImage_(image, filterSteps, resizedSize);
+    }
+    _metrics_.recordStage(Stage::Decode, decoding);
+  }
+
+  // A chain of only an encode step converts the image without filtering
+  if (filterSteps.empty() && encodeStep) {
+    return _filterImage_(filterSteps, format, originalImage, nullptr,
+                         encodeStep);
+  }
+
+  // Borrow the chain built for an earlier frame of the stream, or build
+  // one for this request alone
+  if (isFrame) {
+    uint64_t streamId = steps[0].param;
+    auto chain = _streams_.acquire(streamId, filterSteps, [&]() {
+      return _createChain_(filterSteps);
+    });
+    if (!chain) {
+      return ImageReply();
+    }
+    ImageReply reply = _filterImage_(filterSteps, format, originalImage,
+                                     chain.get(), encodeStep);
+    _streams_.release(streamId, filterSteps, std::move(chain));
+    return reply;
+  }
+  auto chain = _createChain_(filterSteps, resizedSize);
+  if (!chain) {
+    return ImageReply();
+  }
+  return _filterImage_(filterSteps, format, originalImage, chain.get(),
+                       encodeStep);
+}
+
+cv::Mat Server::_decodeImage_(const std::vector<uchar>& image,
+                              const std::vector<FilterStep>& steps,
+                              cv::Size& resizedSize) {
+  // Find how many times a leading resize shrinks the image
+  cv::Size fullSize;
+  double multiplier = !steps.empty() && steps[0].opcode == Opcode::Resize
+                          ? steps[0].number()
+                          : 0;
+  if (!(multiplier > 0 && multiplier <= 0.5) ||
+      !readJpegSize(image, fullSize)) {
+    return cv::imdecode(image, cv::IMREAD_COLOR);
+  }
+
+  // Let the JPEG decoder scale by the largest power of two that still
+  // leaves at least as many pixels as the resize asks for
+  int reduction = 2;
+  int flags = cv::IMREAD_REDUCED_COLOR_2;
+  if (multiplier <= 0.125) {
+    reduction = 8;
+    flags = cv::IMREAD_REDUCED_COLOR_8;
+  } else if (multiplier <= 0.25) {
+    reduction = 4;
+    flags = cv::IMREAD_REDUCED_COLOR_4;
+  }
+  cv::Mat reducedImage = cv::imdecode(image, flags);
+  if (reducedImage.empty()) {
+    return cv::imdecode(image, cv::IMREAD_COLOR);
+  }
+
+  // Follow an EXIF rotation, which swaps the sides of the decoded image
+  cv::Size reducedSize((fullSize.width + reduction - 1) / reduction,
+                       (fullSize.height + reduction - 1) / reduction);
+  if (reducedImage.size() != reducedSize &&
+      reducedImage.size() == cv::Size(reducedSize.height, reducedSize.width)) {
+    std::swap(fullSize.width, fullSize.height);
+  }
+
+  // Resize to exactly the size the full image would have been resized to
+  resizedSize = cv::Size(static_cast<int>(fullSize.width * multiplier),
+                         static_cast<int>(fullSize.height * multiplier));
+  if (resizedSize.empty()) {
+    resizedSize = cv::Size();
+    return cv::imdecode(image, cv::IMREAD_COLOR);
+  }
+  return reducedImage;
+}
+
+ImageReply Server::_filterImage_(const std::vector<FilterStep>& steps,
+                                 ImageFormat format, cv::Mat& originalImage,
+                                 FilterChain* chain,
+                                 const FilterStep* encodeStep) {
+  // Return an empty reply for unusable requests
+  ImageReply reply;
+  if (originalImage.empty()) {
+    return reply;
+  }
+
+  // Apply the chosen filter chain to the one decoded image, scattering
+  // large images across the worker servers when coordinating
+  cv::Mat modifiedImage;
+  if (!chain) {
+    modifiedImage = originalImage;
+  } else {
+    chain->setExecutor(&_tileExecutor_);
+    auto filtering = std::chrono::steady_clock::now();
+    try {
+      if (_coordinator_.shouldScatter(originalImage, *chain)) {
+        if (!_coordinator_.apply(steps, *chain, originalImage,
+                                 modifiedImage)) {
+          return reply;
+        }
+      } else {
+        chain->applyFilter(originalImage, modifiedImage);
+      }
+    } catch (const cv::Exception& e) {
+      std::cerr << "Error: Filter could not be applied: " << e.what()
+                << std::endl;
+      return reply;
+    }
+    _metrics_.recordFilter(ServerMetrics::operationMask(steps), filtering);
+  }
+
+  // Send raw pixels back in the same layout, including single channels
+  auto encoding = std::chrono::steady_clock::now();
+  if (format == ImageFormat::Raw) {
+    reply.pixels =
+        modifiedImage.isContinuous() ? modifiedImage : modifiedImage.clone();
+    reply.bytes = frameHeader(reply.pixels);
+  } else if (!_encodeImage_(modifiedImage, encodeStep, reply.bytes)) {
+    return ImageReply();
+  }
+  _metrics_.recordStage(Stage::Encode, encoding);
+
+  return reply;
+}
+
+bool Server::_encodeImage_(const cv::Mat& image, const FilterStep* encodeStep,
+                           std::vector<uchar>& bytes) {
+  // Pass the quality on only when the request sets it, leaving the
+  // defaults of OpenCV otherwise
+  const CodecInfo& codec = CODECS[encodeStep ? encodeStep->choice() : 0];
+  std::vector<int> params;
+  if (encodeStep && encodeStep->quality() >= 0) {
+    params = {codec.qualityFlag, encodeStep->quality()};
+  }
+
+  // Encode into a pooled buffer, which imencode only grows if too small
+  bytes = _buffers_.acquireBytes(image.total() * image.elemSize() / 2);
+  bytes.clear();
+  try {
+    return cv::imencode(codec.extension, image, bytes, params);
+  } catch (const cv::Exception& e) {
+    std::cerr << "Error: Image could not be encoded: " << e.what()
+              << std::endl;
+    return false;
+  }
+}
+
 void Server::operateServer() {
   // Create a TCP socket
   int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
@@ -41,13 +626,16 @@ void Server::operateServer() {
     exit(EXIT_FAILURE);
   }
 
+  // Size the kernel buffers before listening so accepted sockets inherit them
+  configureSocket(serverSocket);
+
   // Confirm server launch to user
   std::cout << "Server started. Waiting for connections..." << std::endl;
 
   // Bind the server socket to a specific port
   sockaddr_in serverAddr{};
   serverAddr.sin_family = AF_INET;
-  serverAddr.sin_port = htons(12345);
+  serverAddr.sin_port = htons(_port_);
   serverAddr.sin_addr.s_addr = INADDR_ANY;
 
   if (bind(serverSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) ==
@@ -62,7 +650,7 @@ void Server::operateServer() {
   }
 
   // Listen for incoming connections
-  if (listen(serverSocket, 5) == -1) {
+  if (listen(serverSocket, LISTEN_BACKLOG) == -1) {
     std::cerr << "Error: Connections could not be listened for!" << std::endl;
 #ifdef _WIN32
     closesocket(serverSocket);
@@ -72,9 +660,37 @@ void Server::operateServer() {
     exit(EXIT_FAILURE);
   }
 
-  // Initialise thread pool with 4 threads
-  ThreadPool pool(4);
+  // Let the thread pool own all parallelism instead of OpenCV's own threads
+  cv::setNumThreads(0);
+
+  // Take matrices and cached replies from the buffer pool
+  cv::Mat::setDefaultAllocator(&pooledMatAllocator());
+  _cache_.setBufferPool(&_buffers_);
 
+#ifdef __linux__
+  // Let the event loop own every socket and only pass complete requests to
+  // the pool, so worker threads never wait on the network, except for the
+  // few large raw frames that are filtered while they arrive
+  EventLoop eventLoop(
+      serverSocket, IDLE_TIMEOUT_SECONDS,
+      [this, &eventLoop](uint64_t connectionId, Request request) {
+        this->_scheduleRequest_(eventLoop, connectionId, std::move(request));
+      },
+      [this](const Request& request, size_t imageLength) {
+        return this->_isStreamable_(request.steps, request.format,
+                                    imageLength) &&
+               this->_acquireStream_();
+      });
+  eventLoop.setMetrics(&_metrics_);
+  eventLoop.setBufferPool(&_buffers_);
+  eventLoop.setMaxInFlight(_maxInFlight_);
+  eventLoop.setMaxConnections(_maxConnections_);
+  if (_useIoUring_ && !eventLoop.useIoUring()) {
+    std::cerr << "Error: io_uring is not available, using epoll instead!"
+              << std::endl;
+  }
+  eventLoop.run();
+#else
   while (true) {
     // Accept incoming client connections
     sockaddr_in clientAddr{};
@@ -92,7 +708,7 @@ void Server::operateServer() {
       std::cout << "Client connected: " << clientIP << std::endl;
 
       // Create a thread for the new client using lambda function
-      pool.enqueue(
+      _pool_.enqueue(
           [this, clientSocket]() { this->_handleClient_(clientSocket); });
     } else {
       std::cerr << "Error: Client connection could not be established!"
@@ -107,6 +723,7 @@ void Server::operateServer() {
       exit(EXIT_FAILURE);
     }
   }
+#endif  // __linux__
 
 #ifdef _WIN32
   closesocket(serverSocket);
@@ -115,87 +732,206 @@ void Server::operateServer() {
 #endif  // _WIN32
 }
 
-std::unique_ptr<ImageFilter> Server::_createFilter_(
-    const std::string& operation, const std::string& param) {
-  std::istringstream iss(param);
-  double numericParam;
-  int intParam;
-
-  // Return the appropriate filter
-  if (operation == "resize") {
-    iss >> numericParam;
-    return std::make_unique<ResizeFilter>(numericParam);
-  } else if (operation == "rotate") {
-    iss >> numericParam;
-    return std::make_unique<RotateFilter>(numericParam);
-  } else if (operation == "flip") {
-    iss >> intParam;
-    return std::make_unique<FlipFilter>(intParam);
-  } else if (operation == "brightness") {
-    iss >> numericParam;
-    return std::make_unique<BrightnessFilter>(numericParam);
-  } else if (operation == "contrast") {
-    iss >> numericParam;
-    return std::make_unique<ContrastFilter>(numericParam);
-  } else if (operation == "gamma") {
-    iss >> numericParam;
-    return std::make_unique<GammaFilter>(numericParam);
-  } else if (operation == "colour") {
-    if (param == "rgb") {
+#ifdef __linux__
+void Server::_scheduleRequest_(EventLoop& eventLoop, uint64_t connectionId,
+                               Request request) {
+  auto dispatched = std::chrono::steady_clock::now();
+  uint32_t requestId = request.requestId;
+  uint32_t clientAddress = request.clientAddress;
+
+  // Answer metrics queries straight away, so they still work under load
+  if (request.steps.size() == 1 && request.steps[0].opcode == Opcode::Stats) {
+    _pool_.execute([this, &eventLoop, connectionId, requestId,
+                    steps = std::move(request.steps)]() {
+      this->_serveRequest_(
+          steps, ImageFormat::Jpeg, {},
+          [&eventLoop, connectionId, requestId](ImageReply reply) {
+            eventLoop.respond(connectionId, requestId, std::move(reply));
+          });
+    });
+    return;
+  }
+
+  // Estimate the work from the payload size and the number of steps
+  size_t payloadBytes =
+      request.stream ? request.stream->size() : request.image.size();
+  double cost = (1.0 + payloadBytes / 65536.0) * request.steps.size();
+
+  // Let the request wait for as long as it or the server allows
+  uint32_t deadlineMs = request.deadlineMs ? request.deadlineMs : _deadlineMs_;
+  auto deadline = deadlineMs > 0
+                      ? dispatched + std::chrono::milliseconds(deadlineMs)
+                      : std::chrono::steady_clock::time_point::max();
+
+  // Tell the client why a request was shed or dropped, ending a streamed
+  // reply so the rest of its payload is still drained
+  bool isStreamed = request.stream != nullptr;
+  auto reject = [this, &eventLoop, connectionId, requestId,
+                 isStreamed](ReplyStatus status) {
+    ImageReply reply;
+    reply.status = status;
+    if (isStreamed) {
+      reply.bytes = encodeReplyHeader(requestId, 0, status);
+      eventLoop.respondPart(connectionId, requestId, reply);
+      eventLoop.endResponse(connectionId, requestId, true);
+      this->_releaseStream_();
+    } else {
+      eventLoop.respond(connectionId, requestId, reply);
+    }
+  };
+
+  auto run = [this, &eventLoop, connectionId, dispatched,
+              request = std::move(request)]() mutable {
+    this->_metrics_.recordStage(Stage::Queue, dispatched);
+
+    // Send each finished part of a streamed request straight away
+    uint32_t requestId = request.requestId;
+    if (request.stream) {
+      bool streamed = this->_streamRequest_(
+          requestId, request.steps, *request.stream,
+          [&eventLoop, connectionId, requestId](const ImageReply& part) {
+            eventLoop.respondPart(connectionId, requestId, part);
+            return true;
+          });
+      eventLoop.endResponse(connectionId, requestId, streamed);
+      this->_releaseStream_();
+      return;
+    }
+
+    // Answer in the order requests finish, matched by their ID
+    this->_serveRequest_(
+        request.steps, request.format, request.image,
+        [&eventLoop, connectionId, requestId](ImageReply reply) {
+          eventLoop.respond(connectionId, requestId, std::move(reply));
+        });
+
+    // Keep the payload buffer for the next request
+    this->_buffers_.releaseBytes(std::move(request.image));
+  };
+
+  // The request has been moved into the task, so only read the fields
+  // taken out of it beforehand
+  if (!_scheduler_.submit(clientAddress, cost, deadline, std::move(run),
+                          reject)) {
+    reject(ReplyStatus::Busy);
+  }
+}
+#endif  // __linux__
+
+// Define a factory for each filter, indexed by its opcode minus one, so a
+// request is dispatched without comparing names or parsing text
+using FilterFactory = std::unique_ptr<ImageFilter> (*)(const FilterStep& step);
+
+// Define the filters of the colour and smooth choices, in registry order
+static const FilterFactory COLOUR_FACTORIES[] = {
+    [](const FilterStep&) -> std::unique_ptr<ImageFilter> {
       return std::make_unique<RGBFilter>();
-    } else if (param == "hsv") {
+    },
+    [](const FilterStep&) -> std::unique_ptr<ImageFilter> {
       return std::make_unique<HSVFilter>();
-    } else if (param == "grey") {
+    },
+    [](const FilterStep&) -> std::unique_ptr<ImageFilter> {
       return std::make_unique<GreyFilter>();
-    } else if (param == "ycc") {
+    },
+    [](const FilterStep&) -> std::unique_ptr<ImageFilter> {
       return std::make_unique<YCCFilter>();
-    } else if (param == "hsl") {
+    },
+    [](const FilterStep&) -> std::unique_ptr<ImageFilter> {
       return std::make_unique<HSLFilter>();
-    }
-  } else if (operation == "smooth") {
-    if (param == "gauss") {
-      return std::make_unique<GaussianFilter>();
-    } else if (param == "box") {
-      return std::make_unique<BoxFilter>();
-    } else if (param == "sharp") {
+    },
+};
+
+// Only blurs take a radius, and only the Gaussian blur takes a sigma
+static const FilterFactory SMOOTH_FACTORIES[] = {
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<GaussianFilter>(step.radius(), step.sigma());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      if (step.sigma() != 0) return nullptr;
+      return std::make_unique<BoxFilter>(step.radius());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      if (step.radius() != 0 || step.sigma() != 0) return nullptr;
       return std::make_unique<SharpFilter>();
-    }
-  }
+    },
+};
 
-  // Handle unusable cases
-  return nullptr;
-}
+static const FilterFactory FILTER_FACTORIES[] = {
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<ResizeFilter>(step.number());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<RotateFilter>(step.number());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<FlipFilter>(static_cast<int>(step.integer()));
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<BrightnessFilter>(step.number());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<ContrastFilter>(step.number());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      return std::make_unique<GammaFilter>(step.number());
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      if (step.param >= std::size(COLOUR_FACTORIES)) return nullptr;
+      return COLOUR_FACTORIES[step.param](step);
+    },
+    [](const FilterStep& step) -> std::unique_ptr<ImageFilter> {
+      // Reject kernels the client could not have parsed
+      double sigma = step.sigma();
+      if (step.choice() >= std::size(SMOOTH_FACTORIES) ||
+          step.radius() > MAX_KERNEL_RADIUS || !(sigma >= 0) ||
+          sigma > MAX_KERNEL_RADIUS) {
+        return nullptr;
+      }
+      return SMOOTH_FACTORIES[step.choice()](step);
+    },
+};
 
-void Server::_receiveInstruction_(const int socket, std::string& operation,
-                                  std::string& param) {
-  uint32_t opLength, paramLength;
+static_assert(std::size(FILTER_FACTORIES) ==
+                  static_cast<size_t>(Opcode::Smooth),
+              "Every filter opcode needs a factory");
 
-  // Receive operation length
-  recv(socket, &opLength, sizeof(opLength), 0);
-  opLength = ntohl(opLength);
+std::unique_ptr<ImageFilter> Server::_createFilter_(const FilterStep& step) {
+  // Handle unusable cases, including reserved operations
+  size_t index = static_cast<size_t>(step.opcode) - 1;
+  if (index >= std::size(FILTER_FACTORIES)) {
+    return nullptr;
+  }
+  return FILTER_FACTORIES[index](step);
+}
 
-  // Receive operation
-  char* opBuffer = new char[opLength + 1];
-  recv(socket, opBuffer, opLength, 0);
-  opBuffer[opLength] = '\0';  // Null-terminate
-  operation = std::string(opBuffer, opLength);
-  delete[] opBuffer;
+std::unique_ptr<FilterChain> Server::_createChain_(
+    const std::vector<FilterStep>& steps, const cv::Size& resizedSize) {
+  // Reject empty chains
+  if (steps.empty()) {
+    return nullptr;
+  }
 
-  // Receive parameter length
-  recv(socket, &paramLength, sizeof(paramLength), 0);
-  paramLength = ntohl(paramLength);
+  auto chain = std::make_unique<FilterChain>();
+  for (const FilterStep& step : steps) {
+    // Resize an image decoded at reduced resolution to the exact size
+    std::unique_ptr<ImageFilter> filter;
+    if (&step == &steps[0] && !resizedSize.empty()) {
+      filter = std::make_unique<ResizeFilter>(resizedSize);
+    } else {
+      filter = _createFilter_(step);
+    }
 
-  // Receive parameter
-  char* paramBuffer = new char[paramLength + 1];
-  recv(socket, paramBuffer, paramLength, 0);
+    // Reject the whole chain if any step is unusable
+    if (!filter) {
+      return nullptr;
+    }
+    chain->addFilter(std::move(filter));
+  }
 
-  // Null terminate
-  paramBuffer[paramLength] = '\0';
-  param = std::string(paramBuffer, paramLength);
-  delete[] paramBuffer;
+  return chain;
 }
 
-int main() {
+int main(int argc, char** argv) {
 // Initialise Winsock for Windows
 #ifdef _WIN32
   WSADATA wasData;
@@ -207,6 +943,65 @@ int main() {
 #endif  // _WIN32
 
   Server server;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--buffer" && i + 1 < argc) {
+      int bufferBytes = std::stoi(argv[++i]);
+      server.setSocketBuffers(bufferBytes, bufferBytes);
+    } else if (arg == "--cache" && i + 1 < argc) {
+      server.setCacheBudget(std::stoull(argv[++i]));
+    } else if (arg == "--store" && i + 1 < argc) {
+      server.setStoreBudget(std::stoull(argv[++i]));
+    } else if (arg == "--pool" && i + 1 < argc) {
+      server.setPoolBudget(std::stoull(argv[++i]));
+    } else if (arg == "--inflight" && i + 1 < argc) {
+      server.setMaxInFlight(std::stoul(argv[++i]));
+    } else if (arg == "--queue" && i + 1 < argc) {
+      server.setMaxQueued(std::stoul(argv[++i]));
+    } else if (arg == "--deadline" && i + 1 < argc) {
+      server.setDeadline(static_cast<uint32_t>(std::stoul(argv[++i])));
+    } else if (arg == "--connections" && i + 1 < argc) {
+      server.setMaxConnections(std::stoul(argv[++i]));
+    } else if (arg == "--io" && i + 1 < argc) {
+      std::string backend = argv[++i];
+      if (backend != "epoll" && backend != "uring") {
+        std::cerr << "Error: Invalid I/O backend " << backend << std::endl;
+        return -1;
+      }
+      server.setIoUring(backend == "uring");
+    } else if (arg == "--weight" && i + 1 < argc) {
+      // Split "<ip>=<weight>"
+      std::string spec = argv[++i];
+      size_t equals = spec.find('=');
+      if (equals == std::string::npos ||
+          !server.setClientWeight(spec.substr(0, equals),
+                                  std::atof(spec.c_str() + equals + 1))) {
+        std::cerr << "Error: Invalid client weight " << spec << std::endl;
+        return -1;
+      }
+    } else if (arg == "--port" && i + 1 < argc) {
+      server.setPort(std::stoi(argv[++i]));
+    } else if (arg == "--workers" && i + 1 < argc) {
+      // Split the comma-separated worker addresses
+      std::vector<std::string> workers;
+      std::istringstream addresses(argv[++i]);
+      std::string address;
+      while (std::getline(addresses, address, ',')) {
+        if (!address.empty()) workers.push_back(address);
+      }
+      server.setWorkers(workers);
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--port <port>] [--buffer <bytes>] [--cache <bytes>]"
+                << " [--store <bytes>] [--pool <bytes>]"
+                << " [--inflight <requests>]"
+                << " [--queue <requests>] [--deadline <ms>]"
+                << " [--weight <ip>=<weight>]... [--connections <n>]"
+                << " [--io <epoll|uring>]"
+                << " [--workers <ip:port>[,<ip:port>...]]" << std::endl;
+      return -1;
+    }
+  }
   server.operateServer();
 #ifdef _WIN32
   WSACleanup();
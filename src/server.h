@@ -1,38 +1,236 @@
 // Copyright 2023 Stewart Charles Fisher II
 
 // Import libraries
+#include <atomic>
+#include <future>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <opencv2/highgui.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "bufferPool.h"
+#include "coordinator.h"
+#include "eventLoop.h"
+#include "imageStore.h"
+#include "imageStream.h"
+#include "metrics.h"
 #include "peer.h"
 #include "processing.h"
+#include "requestScheduler.h"
+#include "resultCache.h"
 #include "threadPool.h"
+#include "tileExecutor.h"
+#include "videoStreams.h"
 
 #ifndef SRC_SERVER_H_
 #define SRC_SERVER_H_
 
 class Server : public Peer {
  private:
+  // Define how long an idle session is kept open
+  const int IDLE_TIMEOUT_SECONDS = 30;
+
+  // Define the port the server listens on
+  const int DEFAULT_PORT = 12345;
+  int _port_ = DEFAULT_PORT;
+
+  // Define how many connections the kernel holds before they are accepted
+  const int LISTEN_BACKLOG = 128;
+
   // Define a vector to keep track of connected clients
   std::vector<int> _clientSockets_;
 
   // Define a mutex to synchronise access to shared resources
   std::mutex _clientSocketMutex_;
 
+  // Define the number of worker threads
+  const size_t WORKER_THREADS = 4;
+
+  // Initialise thread pool with the worker threads
+  ThreadPool _pool_{WORKER_THREADS};
+
+  // Define an executor to split large images across the worker threads
+  TileExecutor _tileExecutor_{_pool_};
+
+  // Define how many requests may wait for a worker before new ones are shed
+  const size_t DEFAULT_MAX_QUEUED = 256;
+
+  // Define a scheduler that admits requests to the thread pool, sharing
+  // the workers fairly between clients
+  RequestScheduler _scheduler_{_pool_, DEFAULT_MAX_QUEUED};
+
+  // Define how long a request may wait for a worker when it sets no
+  // deadline itself, where 0 lets it wait for as long as it takes
+  uint32_t _deadlineMs_ = 0;
+
+  // Define how many connections may be open at once
+  size_t _maxConnections_ = SIZE_MAX;
+
+  // Define whether the event loop is driven through io_uring
+  bool _useIoUring_ = false;
+
+  // Define the default memory budget for cached replies
+  const size_t DEFAULT_CACHE_BYTES = 64 * 1024 * 1024;
+
+  // Define the smallest raw payload that is filtered while it arrives
+  const size_t STREAM_MIN_BYTES = 1024 * 1024;
+
+  // Define how many bytes are received before waking the streaming worker
+  const size_t STREAM_CHUNK_BYTES = 256 * 1024;
+
+  // Define the share of workers that may wait on streamed payloads, where
+  // one in four workers is kept for them, and the streams running now
+  const size_t STREAM_WORKER_SHARE = 4;
+  std::atomic<size_t> _activeStreams_{0};
+
+  // Define a cache of finished replies shared by every connection
+  ResultCache _cache_{DEFAULT_CACHE_BYTES};
+
+  // Define the default memory budget for uploaded images
+  const size_t DEFAULT_STORE_BYTES = 256 * 1024 * 1024;
+
+  // Define a store of decoded images that requests can name by handle
+  ImageStore _store_{DEFAULT_STORE_BYTES};
+
+  // Define how many video streams keep their filter chains at once
+  const size_t MAX_VIDEO_STREAMS = 256;
+
+  // Define the video streams being filtered, whose chains are built once
+  // and reused by every frame, dropped once a stream goes idle
+  VideoStreams _streams_{MAX_VIDEO_STREAMS,
+                         std::chrono::seconds(IDLE_TIMEOUT_SECONDS)};
+
+  // Define how many requests of one connection are processed at once
+  const size_t DEFAULT_MAX_IN_FLIGHT = 16;
+  size_t _maxInFlight_ = DEFAULT_MAX_IN_FLIGHT;
+
+  // Define the per-stage and per-operation metrics of the server
+  ServerMetrics _metrics_;
+
+  // Define the pool that payloads, replies and matrices take their
+  // buffers from, so a steady load stops allocating per request
+  BufferPool& _buffers_ = sharedBufferPool();
+
+  // Define a coordinator that scatters large images across worker servers
+  TileCoordinator _coordinator_;
+
   // Define a function to handle communication with a specific client
   void _handleClient_(int clientSocket);
 
-  // Define a function to receive instructions
-  void _receiveInstruction_(const int socket, std::string& operation,
-                            std::string& param);
+#ifdef __linux__
+  // Define a function to queue a request from the event loop, replying
+  // with its status if the scheduler sheds or drops it
+  void _scheduleRequest_(EventLoop& eventLoop, uint64_t connectionId,
+                         Request request);
+#endif  // __linux__
+
+  // Define a function to serve one request from the cache or by processing
+  // it, delivering the reply through the callback
+  void _serveRequest_(const std::vector<FilterStep>& steps, ImageFormat format,
+                      const std::vector<uchar>& image,
+                      ResultCache::Callback deliver);
+
+  // Define a function to decide whether a request is filtered while its
+  // payload is still arriving
+  bool _isStreamable_(const std::vector<FilterStep>& steps, ImageFormat format,
+                      size_t imageLength);
+
+  // Define functions to claim one of the few workers that may wait on a
+  // streamed payload, returning false when all of them are taken, and to
+  // give it back once the streamed reply has ended
+  bool _acquireStream_();
+  void _releaseStream_();
+
+  // Define a function to filter a raw frame as it arrives, emitting each
+  // part of the framed reply as soon as its rows are finished, and
+  // returning false if the reply was cut short
+  bool _streamRequest_(uint32_t requestId,
+                       const std::vector<FilterStep>& steps,
+                       ImageStream& stream,
+                       const std::function<bool(const ImageReply& part)>& emit);
+
+  // Define a function to receive a streamed payload on a blocking session
+  bool _streamClient_(int clientSocket, uint32_t requestId,
+                      const std::vector<FilterStep>& steps,
+                      size_t imageLength);
+
+  // Define a function to look up or upload an image to the store, replying
+  // with its handle, or an empty reply if the image is not held
+  ImageReply _storeImage_(uint64_t handle, ImageFormat format,
+                          const std::vector<uchar>& image);
+
+  // Define a function to reply with a snapshot of the server metrics
+  ImageReply _statsReply_(StatsFormat format);
+
+  // Define a function to decode, filter and encode one request
+  ImageReply _processRequest_(const std::vector<FilterStep>& steps,
+                              ImageFormat format,
+                              const std::vector<uchar>& image);
+
+  // Define a function to decode an encoded image, at reduced resolution
+  // when the chain starts by shrinking it, setting the exact size the
+  // leading resize must then produce
+  cv::Mat _decodeImage_(const std::vector<uchar>& image,
+                        const std::vector<FilterStep>& steps,
+                        cv::Size& resizedSize);
+
+  // Define a function to filter a decoded image with a chain built from
+  // the steps and prepare the reply, encoded with the codec of the encode
+  // step if one is given, where a null chain leaves the image as it is
+  ImageReply _filterImage_(const std::vector<FilterStep>& steps,
+                           ImageFormat format, cv::Mat& originalImage,
+                           FilterChain* chain, const FilterStep* encodeStep);
+
+  // Define a function to encode a reply with the codec and quality of an
+  // encode step, or as a JPEG without one, returning false if the codec
+  // cannot write the image
+  bool _encodeImage_(const cv::Mat& image, const FilterStep* encodeStep,
+                     std::vector<uchar>& bytes);
 
   // Define a factory function to create filter objects
-  std::unique_ptr<ImageFilter> _createFilter_(const std::string& operation,
-                                              const std::string& param);
+  std::unique_ptr<ImageFilter> _createFilter_(const FilterStep& step);
+
+  // Define a function to build a filter chain from its steps, where a
+  // resized size makes a leading resize produce exactly that size
+  std::unique_ptr<FilterChain> _createChain_(
+      const std::vector<FilterStep>& steps,
+      const cv::Size& resizedSize = cv::Size());
 
  public:
+  // Define a function to set the memory budget for cached replies
+  void setCacheBudget(size_t bytes);
+
+  // Define a function to set the memory budget for uploaded images
+  void setStoreBudget(size_t bytes);
+
+  // Define a function to set how many bytes of idle buffers are kept
+  void setPoolBudget(size_t bytes);
+
+  // Define a function to set how many requests of one connection are
+  // processed at once, their replies returned as they finish
+  void setMaxInFlight(size_t requests);
+
+  // Define functions to bound the requests waiting for a worker, the time
+  // they may wait and the open connections
+  void setMaxQueued(size_t requests);
+  void setDeadline(uint32_t milliseconds);
+  void setMaxConnections(size_t connections);
+
+  // Drive the sockets through io_uring instead of epoll where supported
+  void setIoUring(bool enabled);
+
+  // Define a function to give a client a larger or smaller share of the
+  // workers, returning false for an invalid IPv4 address
+  bool setClientWeight(const std::string& address, double weight);
+
+  // Define a function to set the port the server listens on
+  void setPort(int port);
+
+  // Define a function to act as a coordinator, scattering the tiles of
+  // large images across the given worker servers
+  void setWorkers(const std::vector<std::string>& addresses);
+
   // Define a function to manage server operation
   void operateServer();
 };
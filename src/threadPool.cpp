@@ -2,32 +2,101 @@
 
 #include "threadPool.h"
 
-ThreadPool::ThreadPool(size_t threads) : _stop_(false) {
+thread_local ThreadPool* ThreadPool::_currentPool_ = nullptr;
+thread_local size_t ThreadPool::_currentIndex_ = 0;
+
+// Define a per-thread cache of spare task nodes, backed by a list shared
+// by every thread. Workers release the nodes that other threads allocated,
+// so a full cache spills into the shared list, where a thread whose cache
+// runs dry takes them all at once. Only whole-list removal is used, which
+// keeps the lock-free list safe from nodes being reused mid-pop
+namespace {
+struct SpareNode {
+  SpareNode* next;
+};
+
+struct NodeCache {
+  static const size_t MAX_NODES = 64;
+  std::vector<void*> nodes;
+
+  ~NodeCache() {
+    for (void* node : nodes) ::operator delete(node);
+  }
+};
+
+// Cap the shared list so a burst of tasks does not hold memory for good
+const int64_t MAX_SHARED_NODES = 4096;
+std::atomic<SpareNode*> sharedNodes{nullptr};
+std::atomic<int64_t> sharedCount{0};
+
+thread_local NodeCache nodeCache;
+}  // namespace
+
+ThreadPool::WorkDeque::WorkDeque()
+    : _buffer_(new std::atomic<TaskNode*>[CAPACITY]) {}
+
+bool ThreadPool::WorkDeque::push(TaskNode* task) {
+  int64_t bottom = _bottom_.load(std::memory_order_relaxed);
+  int64_t top = _top_.load(std::memory_order_acquire);
+  if (bottom - top >= CAPACITY) return false;
+
+  // Publish the task before making it visible to thieves
+  _buffer_[bottom & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  _bottom_.store(bottom + 1, std::memory_order_relaxed);
+  return true;
+}
+
+ThreadPool::TaskNode* ThreadPool::WorkDeque::pop() {
+  int64_t bottom = _bottom_.load(std::memory_order_relaxed) - 1;
+  _bottom_.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = _top_.load(std::memory_order_relaxed);
+
+  // Restore an empty deque
+  if (top > bottom) {
+    _bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  TaskNode* task =
+      _buffer_[bottom & (CAPACITY - 1)].load(std::memory_order_relaxed);
+  if (top == bottom) {
+    // Race thieves for the last task
+    if (!_top_.compare_exchange_strong(top, top + 1,
+                                       std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+      task = nullptr;
+    }
+    _bottom_.store(bottom + 1, std::memory_order_relaxed);
+  }
+  return task;
+}
+
+ThreadPool::TaskNode* ThreadPool::WorkDeque::steal() {
+  int64_t top = _top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t bottom = _bottom_.load(std::memory_order_acquire);
+  if (top >= bottom) return nullptr;
+
+  // Claim the task, giving up if another thread got there first
+  TaskNode* task =
+      _buffer_[top & (CAPACITY - 1)].load(std::memory_order_relaxed);
+  if (!_top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  return task;
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+  // Create a deque for each worker before any worker can steal
+  for (size_t i = 0; i < threads; ++i)
+    _deques_.push_back(std::make_unique<WorkDeque>());
+
   // Create the maximum number of worker threads
   for (size_t i = 0; i < threads; ++i)
-    // Each worker thread executes this lambda function
-    _workers_.emplace_back([this] {
-      while (true) {
-        // Declare a variable for the task
-        std::function<void()> task;
-
-        {
-          // Lock the mutex
-          std::unique_lock<std::mutex> lock(this->_queueMutex_);
-          // Wait until the next task or the pool is stopped
-          this->_condition_.wait(
-              lock, [this] { return this->_stop_ || !this->_tasks_.empty(); });
-          // Exit the thread if not needed
-          if (this->_stop_ && this->_tasks_.empty()) return;
-          // Take the next task from the queue
-          task = std::move(this->_tasks_.front());
-          this->_tasks_.pop();
-        }
-
-        // Execute the task
-        task();
-      }
-    });
+    _workers_.emplace_back([this, i] { this->_workerLoop_(i); });
 }
 
 ThreadPool::~ThreadPool() {
@@ -42,3 +111,140 @@ ThreadPool::~ThreadPool() {
   // Join all worker threads to ensure they are completed before destruction
   for (std::thread& worker : _workers_) worker.join();
 }
+
+size_t ThreadPool::size() const { return _workers_.size(); }
+
+size_t ThreadPool::queuedTasks() const {
+  int64_t pending = _pending_.load(std::memory_order_relaxed);
+  return pending > 0 ? static_cast<size_t>(pending) : 0;
+}
+
+size_t ThreadPool::busyWorkers() const {
+  int sleeping = _sleeping_.load(std::memory_order_relaxed);
+  return _workers_.size() - std::min(static_cast<size_t>(sleeping),
+                                     _workers_.size());
+}
+
+ThreadPool::TaskNode* ThreadPool::_allocateNode_() {
+  // Refill an empty cache from the shared list
+  if (nodeCache.nodes.empty()) {
+    SpareNode* spare =
+        sharedNodes.exchange(nullptr, std::memory_order_acquire);
+    while (spare) {
+      SpareNode* next = spare->next;
+      nodeCache.nodes.push_back(spare);
+      sharedCount.fetch_sub(1, std::memory_order_relaxed);
+      spare = next;
+    }
+  }
+
+  // Reuse a spare node when there is one
+  if (!nodeCache.nodes.empty()) {
+    void* node = nodeCache.nodes.back();
+    nodeCache.nodes.pop_back();
+    return static_cast<TaskNode*>(node);
+  }
+  return static_cast<TaskNode*>(::operator new(sizeof(TaskNode)));
+}
+
+void ThreadPool::_releaseNode_(TaskNode* node) {
+  // Keep the node for this thread's next task, up to the cache limit
+  if (nodeCache.nodes.size() < NodeCache::MAX_NODES) {
+    if (nodeCache.nodes.capacity() == 0) {
+      nodeCache.nodes.reserve(NodeCache::MAX_NODES);
+    }
+    nodeCache.nodes.push_back(node);
+    return;
+  }
+
+  // Otherwise hand it to the threads that submit without reusing nodes
+  if (sharedCount.fetch_add(1, std::memory_order_relaxed) >=
+      MAX_SHARED_NODES) {
+    sharedCount.fetch_sub(1, std::memory_order_relaxed);
+    ::operator delete(node);
+    return;
+  }
+  SpareNode* spare = reinterpret_cast<SpareNode*>(node);
+  spare->next = sharedNodes.load(std::memory_order_relaxed);
+  while (!sharedNodes.compare_exchange_weak(spare->next, spare,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+  }
+}
+
+void ThreadPool::_push_(TaskNode* node) {
+  // Count the task before it becomes visible so no worker misses it
+  _pending_.fetch_add(1);
+
+  // Workers push onto their own deque, everyone else uses the shared queue
+  if (_currentPool_ == this && _deques_[_currentIndex_]->push(node)) return;
+
+  std::lock_guard<std::mutex> guard(_injectMutex_);
+  _injected_.push_back(node);
+  _injectedSize_.fetch_add(1);
+}
+
+void ThreadPool::_wake_(size_t count) {
+  // Skip the mutex entirely while every worker is busy
+  if (_sleeping_.load() == 0) return;
+
+  std::lock_guard<std::mutex> guard(_queueMutex_);
+  if (count == 1) {
+    _condition_.notify_one();
+  } else {
+    _condition_.notify_all();
+  }
+}
+
+ThreadPool::TaskNode* ThreadPool::_findTask_(size_t index) {
+  // Prefer the most recent task of this worker
+  TaskNode* task = _deques_[index]->pop();
+  if (task) return task;
+
+  // Then take tasks submitted from outside the pool
+  if (_injectedSize_.load() > 0) {
+    std::lock_guard<std::mutex> guard(_injectMutex_);
+    if (!_injected_.empty()) {
+      task = _injected_.front();
+      _injected_.pop_front();
+      _injectedSize_.fetch_sub(1);
+      return task;
+    }
+  }
+
+  // Finally steal the oldest task of another worker
+  for (size_t i = 1; i < _deques_.size(); ++i) {
+    task = _deques_[(index + i) % _deques_.size()]->steal();
+    if (task) return task;
+  }
+  return nullptr;
+}
+
+void ThreadPool::_workerLoop_(size_t index) {
+  _currentPool_ = this;
+  _currentIndex_ = index;
+
+  while (true) {
+    TaskNode* task = _findTask_(index);
+    if (task) {
+      _pending_.fetch_sub(1);
+
+      // Execute the task, which must not let exceptions escape
+      try {
+        task->run(task);
+      } catch (...) {
+      }
+      _releaseNode_(task);
+      continue;
+    }
+
+    // Lock the mutex
+    std::unique_lock<std::mutex> lock(_queueMutex_);
+    // Wait until the next task or the pool is stopped
+    _sleeping_.fetch_add(1);
+    _condition_.wait(lock, [this] { return _stop_ || _pending_.load() > 0; });
+    _sleeping_.fetch_sub(1);
+    // Exit the thread if not needed
+    if (_stop_ && _pending_.load() == 0) return;
+  }
+}
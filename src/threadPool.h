@@ -1,14 +1,21 @@
 // Copyright 2023 Stewart Charles Fisher II
 
 // Include libraries
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
 #include <type_traits>
+#include <utility>
 #include <vector>
 
 #ifndef SRC_THREADPOOL_H_
@@ -16,30 +23,114 @@
 
 class ThreadPool {
  private:
+  // Define a type-erased task with inline storage for small callables
+  struct TaskNode {
+    static const size_t INLINE_SIZE = 64;
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+
+    // Runs the stored callable and destroys it
+    void (*run)(TaskNode* node);
+  };
+
+  // Define a lock-free work-stealing deque of tasks (Chase-Lev), where the
+  // owning worker pushes and pops at the bottom and thieves steal at the top
+  class WorkDeque {
+   private:
+    static const int64_t CAPACITY = 4096;
+    std::atomic<int64_t> _top_{0};
+    std::atomic<int64_t> _bottom_{0};
+    std::unique_ptr<std::atomic<TaskNode*>[]> _buffer_;
+
+   public:
+    WorkDeque();
+
+    // Push a task, failing when the deque is full (owner only)
+    bool push(TaskNode* task);
+
+    // Pop the most recently pushed task (owner only)
+    TaskNode* pop();
+
+    // Steal the oldest task (any thread)
+    TaskNode* steal();
+  };
+
   // Define a vector to store worker threads
   std::vector<std::thread> _workers_;
-  
-  // Define a queue to store tasks
-  std::queue<std::function<void()>> _tasks_;
 
-  // Define a mutex to protect task queue
+  // Define a deque of tasks for each worker
+  std::vector<std::unique_ptr<WorkDeque>> _deques_;
+
+  // Define a queue for tasks submitted from outside the pool
+  std::deque<TaskNode*> _injected_;
+  std::mutex _injectMutex_;
+  std::atomic<size_t> _injectedSize_{0};
+
+  // Define a mutex and condition variable for sleeping workers
   std::mutex _queueMutex_;
-  
-  // Define a condition variable for thread synchronisation
   std::condition_variable _condition_;
-  
+
+  // Define counters of queued tasks and sleeping workers
+  std::atomic<int64_t> _pending_{0};
+  std::atomic<int> _sleeping_{0};
+
   // Define a flag to control the stopping of the thread pool
-  bool _stop_;
+  std::atomic<bool> _stop_{false};
+
+  // Define the pool and deque index of the current worker thread
+  static thread_local ThreadPool* _currentPool_;
+  static thread_local size_t _currentIndex_;
+
+  // Define functions to recycle task nodes through a per-thread cache and
+  // a list shared by every thread
+  static TaskNode* _allocateNode_();
+  static void _releaseNode_(TaskNode* node);
+
+  // Define a function to wrap a callable in a task node
+  template <class F>
+  static TaskNode* _makeNode_(F&& f);
+
+  // Define functions to queue task nodes and wake sleeping workers
+  void _push_(TaskNode* node);
+  void _wake_(size_t count);
+
+  // Define a function to find the next task for a worker
+  TaskNode* _findTask_(size_t index);
+
+  // Define the loop run by each worker thread
+  void _workerLoop_(size_t index);
 
  public:
   // Initialise the thread pool and start the threads
   ThreadPool(size_t threads);
   ~ThreadPool();
 
+  // Return the number of worker threads
+  size_t size() const;
+
+  // Return the tasks waiting for a worker and the workers that are not
+  // asleep, read without locking so they are only approximate
+  size_t queuedTasks() const;
+  size_t busyWorkers() const;
+
   // Define a template to enqueue a task into the thread pool
   template <class F, class... Args>
   auto enqueue(F&& f, Args&&... args)
       -> std::future<typename std::result_of<F(Args...)>::type>;
+
+  // Define a template to run a task without a future, which does not
+  // allocate when the callable fits in a task node
+  template <class F>
+  void execute(F&& f);
+
+  // Define a template to run f(0) to f(count - 1) as separate tasks with a
+  // single wake-up
+  template <class F>
+  void executeBulk(size_t count, const F& f);
+
+  // Define a template to run body(first, last) over chunks of at most grain
+  // indices in [begin, end), with the calling thread taking part
+  template <class F>
+  void parallelFor(size_t begin, size_t end, size_t grain, const F& body);
 };
 
 // Include template
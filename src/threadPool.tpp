@@ -1,5 +1,36 @@
 // Copyright 2023 Stewart Charles Fisher II
 
+// ThreadPool node template
+template <class F>
+ThreadPool::TaskNode* ThreadPool::_makeNode_(F&& f) {
+    using Callable = typename std::decay<F>::type;
+    TaskNode* node = _allocateNode_();
+
+    if constexpr (sizeof(Callable) <= TaskNode::INLINE_SIZE &&
+                  alignof(Callable) <= alignof(std::max_align_t)) {
+        // Store small callables inside the node
+        new (node->storage) Callable(std::forward<F>(f));
+        node->run = [](TaskNode* self) {
+            Callable* callable = reinterpret_cast<Callable*>(self->storage);
+            struct Destroy {
+                Callable* callable;
+                ~Destroy() { callable->~Callable(); }
+            } destroy{callable};
+            (*callable)();
+        };
+    } else {
+        // Fall back to the heap for large callables
+        new (node->storage) Callable*(new Callable(std::forward<F>(f)));
+        node->run = [](TaskNode* self) {
+            std::unique_ptr<Callable> callable(
+                *reinterpret_cast<Callable**>(self->storage));
+            (*callable)();
+        };
+    }
+
+    return node;
+}
+
 // ThreadPool enqueue template
 template <class F, class... Args>
 auto ThreadPool::enqueue(F&& f, Args&&... args)
@@ -12,20 +43,92 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
 
     // Get the future for the task's result
     std::future<return_type> res = task->get_future();
-    {
-        // Lock the mutex
-        std::unique_lock<std::mutex> lock(_queueMutex_);
-        
-        // If the pool has stopped, throw an exception
-        if (_stop_) throw std::runtime_error("enqueue on stopped ThreadPool");
-
-        // Add the task to the queue
-        _tasks_.emplace([task]() { (*task)(); });
-    }
-    // Notify a waiting thread
-    _condition_.notify_one();
+
+    // Add the task to the pool
+    execute([task]() { (*task)(); });
 
     // Return the future
     return res;
 }
 
+// ThreadPool execute template
+template <class F>
+void ThreadPool::execute(F&& f) {
+    // If the pool has stopped, throw an exception
+    if (_stop_) throw std::runtime_error("enqueue on stopped ThreadPool");
+
+    _push_(_makeNode_(std::forward<F>(f)));
+
+    // Notify a waiting thread
+    _wake_(1);
+}
+
+// ThreadPool bulk execute template
+template <class F>
+void ThreadPool::executeBulk(size_t count, const F& f) {
+    if (_stop_) throw std::runtime_error("enqueue on stopped ThreadPool");
+    if (count == 0) return;
+
+    // Queue every task before waking the workers once
+    for (size_t i = 0; i < count; ++i) {
+        _push_(_makeNode_([f, i]() { f(i); }));
+    }
+    _wake_(count);
+}
+
+// ThreadPool parallel for template
+template <class F>
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain,
+                             const F& body) {
+    if (end <= begin) return;
+    grain = std::max<size_t>(grain, 1);
+    size_t chunks = (end - begin + grain - 1) / grain;
+
+    // Run small ranges on the calling thread
+    if (chunks == 1 || _workers_.empty()) {
+        body(begin, end);
+        return;
+    }
+
+    // Define the state shared by the caller and the helper tasks, kept
+    // alive by the helpers in case they start after the caller has finished
+    struct LoopState {
+        std::atomic<size_t> next{0};
+        size_t completed = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto state = std::make_shared<LoopState>();
+    const F* loopBody = &body;
+
+    // Claim and run chunks until none are left
+    auto work = [state, loopBody, begin, end, grain, chunks]() {
+        size_t chunk;
+        while ((chunk = state->next.fetch_add(1)) < chunks) {
+            size_t first = begin + chunk * grain;
+            size_t last = std::min(end, first + grain);
+            try {
+                (*loopBody)(first, last);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(state->mutex);
+                if (!state->error) state->error = std::current_exception();
+            }
+
+            // Record the finished chunk
+            std::lock_guard<std::mutex> guard(state->mutex);
+            if (++state->completed == chunks) state->done.notify_all();
+        }
+    };
+
+    // Helpers that start late find no chunks left and return at once, so
+    // the caller never waits on a task that is still queued behind it
+    size_t helpers = std::min(chunks - 1, _workers_.size());
+    executeBulk(helpers, [work](size_t) { work(); });
+    work();
+
+    // Wait for chunks still running on helper threads
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&] { return state->completed == chunks; });
+    if (state->error) std::rethrow_exception(state->error);
+}
@@ -0,0 +1,125 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "tileExecutor.h"
+
+TileExecutor::TileExecutor(ThreadPool& pool) : _pool_(pool) {}
+
+int TileExecutor::_stripeRows_(const cv::Mat& image, int halo) const {
+  // Fit a stripe in the cache, but keep the halo overhead small
+  size_t rowBytes = image.cols * image.elemSize();
+  int rows = static_cast<int>(STRIPE_BYTES / std::max<size_t>(rowBytes, 1));
+  return std::max({rows, MIN_STRIPE_ROWS, 8 * halo});
+}
+
+void TileExecutor::applyFilter(ImageFilter& filter, cv::Mat& image,
+                               cv::Mat& newImage) {
+  TileMode mode = filter.tileMode();
+
+  // Small images and whole-image filters run on the calling thread
+  if (mode == TileMode::Whole || _pool_.size() < 2 ||
+      image.total() < MIN_TILED_PIXELS) {
+    filter.applyFilter(image, newImage);
+    return;
+  }
+
+  if (mode == TileMode::Geometric) {
+    // Allocate the whole output and cut the stripes from it
+    cv::Mat output;
+    filter.allocateOutput(image, output);
+    int stripeRows = _stripeRows_(output, 0);
+
+    auto filterStripe = [&](size_t first, size_t last) {
+      cv::Range rows(static_cast<int>(first), static_cast<int>(last));
+      filter.applyFilterRows(image, output, rows);
+    };
+
+    _pool_.parallelFor(0, output.rows, stripeRows, filterStripe);
+
+    newImage = output;
+    return;
+  }
+
+  // Local filters read their stripe plus a halo of neighbouring rows
+  int halo = filter.haloRows();
+  int stripeRows = _stripeRows_(image, halo);
+
+  // The output type is only known once a stripe has been filtered
+  cv::Mat output;
+  std::once_flag allocated;
+
+  auto filterStripe = [&](size_t first, size_t last) {
+    _filterLocalStripe_(filter, image, image.rows, output, allocated, halo,
+                        static_cast<int>(first), static_cast<int>(last));
+  };
+
+  _pool_.parallelFor(0, image.rows, stripeRows, filterStripe);
+
+  newImage = output;
+}
+
+void TileExecutor::_filterLocalStripe_(ImageFilter& filter,
+                                       const cv::Mat& image, int outputRows,
+                                       cv::Mat& output,
+                                       std::once_flag& allocated, int halo,
+                                       int start, int end) {
+  int haloStart = std::max(0, start - halo);
+  int haloEnd = std::min(image.rows, end + halo);
+
+  // Filter the stripe together with its halo
+  cv::Mat source = image.rowRange(haloStart, haloEnd);
+  cv::Mat filtered;
+  filter.applyFilter(source, filtered);
+
+  // Keep only the rows that belong to this stripe
+  std::call_once(allocated, [&] {
+    output.create(outputRows, filtered.cols, filtered.type());
+  });
+  filtered.rowRange(start - haloStart, end - haloStart)
+      .copyTo(output.rowRange(start, end));
+}
+
+bool TileExecutor::applyStreaming(
+    ImageFilter& filter, cv::Mat& image,
+    const std::function<int(int rows)>& waitForRows,
+    const std::function<bool(const cv::Mat& output, int first, int last)>&
+        emitRows) {
+  int halo = filter.haloRows();
+  int stripeRows = _stripeRows_(image, halo);
+
+  cv::Mat output;
+  std::once_flag allocated;
+  int done = 0;
+
+  while (done < image.rows) {
+    // Wait for the next stripe and the halo below it
+    int needed = std::min(image.rows, done + stripeRows + halo);
+    int arrived = waitForRows(needed);
+    if (arrived < needed) {
+      return false;
+    }
+
+    // Filter every whole stripe whose halo has arrived in one go
+    int end = image.rows;
+    if (arrived < image.rows) {
+      end = done + (arrived - halo - done) / stripeRows * stripeRows;
+    }
+
+    // Only let the filters see the rows that have arrived
+    cv::Mat received(arrived, image.cols, image.type(), image.data,
+                     image.step);
+    auto filterStripe = [&](size_t first, size_t last) {
+      _filterLocalStripe_(filter, received, image.rows, output, allocated,
+                          halo, static_cast<int>(first),
+                          static_cast<int>(last));
+    };
+    _pool_.parallelFor(done, end, stripeRows, filterStripe);
+
+    // Pass the finished rows on while later rows are still arriving
+    if (!emitRows(output, done, end)) {
+      return false;
+    }
+    done = end;
+  }
+
+  return true;
+}
@@ -0,0 +1,57 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+
+#include "processing.h"
+#include "threadPool.h"
+
+#ifndef SRC_TILEEXECUTOR_H_
+#define SRC_TILEEXECUTOR_H_
+
+// Define an executor that splits one image into row stripes and filters the
+// stripes across the thread pool
+class TileExecutor {
+ private:
+  // Define the smallest image worth splitting
+  const size_t MIN_TILED_PIXELS = 1024 * 1024;
+
+  // Define the target stripe size, chosen to fit in a core's cache
+  const size_t STRIPE_BYTES = 256 * 1024;
+
+  // Define the smallest stripe height
+  const int MIN_STRIPE_ROWS = 16;
+
+  // Define the pool that runs the stripes
+  ThreadPool& _pool_;
+
+  // Define a function to choose the stripe height for an image
+  int _stripeRows_(const cv::Mat& image, int halo) const;
+
+  // Define a function to filter one stripe of a local filter with its halo
+  // and copy the stripe's rows into the output
+  void _filterLocalStripe_(ImageFilter& filter, const cv::Mat& image,
+                           int outputRows, cv::Mat& output,
+                           std::once_flag& allocated, int halo, int start,
+                           int end);
+
+ public:
+  TileExecutor(ThreadPool& pool);
+
+  // Apply a filter, splitting it into stripes for large images
+  void applyFilter(ImageFilter& filter, cv::Mat& image, cv::Mat& newImage);
+
+  // Apply a local filter while the input rows are still arriving, waiting
+  // for rows through the first callback and passing each band of finished
+  // output rows on in order through the second
+  bool applyStreaming(
+      ImageFilter& filter, cv::Mat& image,
+      const std::function<int(int rows)>& waitForRows,
+      const std::function<bool(const cv::Mat& output, int first, int last)>&
+          emitRows);
+};
+
+#endif  // SRC_TILEEXECUTOR_H_
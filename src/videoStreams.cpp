@@ -0,0 +1,81 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+#include "videoStreams.h"
+
+VideoStreams::VideoStreams(size_t maxStreams, std::chrono::seconds idleTimeout)
+    : _maxStreams_(maxStreams), _idleTimeout_(idleTimeout) {}
+
+bool VideoStreams::_sameSteps_(const std::vector<FilterStep>& a,
+                               const std::vector<FilterStep>& b) {
+  return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                    [](const FilterStep& left, const FilterStep& right) {
+                      return left.opcode == right.opcode &&
+                             left.param == right.param;
+                    });
+}
+
+std::unique_ptr<FilterChain> VideoStreams::acquire(
+    uint64_t id, const std::vector<FilterStep>& steps,
+    const ChainFactory& build) {
+  _frames_++;
+  {
+    std::lock_guard<std::mutex> guard(_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    auto it = _index_.find(id);
+    if (it == _index_.end()) {
+      // Open the stream on its first frame
+      _streams_.push_front({id, steps, {}, now});
+      _index_[id] = _streams_.begin();
+    } else {
+      // Mark the stream as most recently used, starting over if its steps
+      // changed
+      _streams_.splice(_streams_.begin(), _streams_, it->second);
+      Stream& stream = *it->second;
+      stream.lastUsed = now;
+      if (!_sameSteps_(stream.steps, steps)) {
+        stream.steps = steps;
+        stream.idle.clear();
+      } else if (!stream.idle.empty()) {
+        std::unique_ptr<FilterChain> chain = std::move(stream.idle.back());
+        stream.idle.pop_back();
+        return chain;
+      }
+    }
+    _expire_(now);
+  }
+
+  // Build the chain without holding the lock
+  std::unique_ptr<FilterChain> chain = build();
+  if (chain) {
+    _chainsBuilt_++;
+  }
+  return chain;
+}
+
+void VideoStreams::release(uint64_t id, const std::vector<FilterStep>& steps,
+                           std::unique_ptr<FilterChain> chain) {
+  if (!chain) {
+    return;
+  }
+
+  // Drop chains of streams that were closed or changed their steps since
+  std::lock_guard<std::mutex> guard(_mutex_);
+  auto it = _index_.find(id);
+  if (it != _index_.end() && _sameSteps_(it->second->steps, steps)) {
+    it->second->idle.push_back(std::move(chain));
+  }
+}
+
+void VideoStreams::_expire_(std::chrono::steady_clock::time_point now) {
+  while (!_streams_.empty() && (_streams_.size() > _maxStreams_ ||
+                                now - _streams_.back().lastUsed >
+                                    _idleTimeout_)) {
+    _index_.erase(_streams_.back().id);
+    _streams_.pop_back();
+  }
+}
+
+size_t VideoStreams::streamCount() {
+  std::lock_guard<std::mutex> guard(_mutex_);
+  return _streams_.size();
+}
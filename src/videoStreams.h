@@ -0,0 +1,85 @@
+// Copyright 2023 Stewart Charles Fisher II
+
+// Include libraries
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "filterRegistry.h"
+#include "processing.h"
+
+#ifndef SRC_VIDEOSTREAMS_H_
+#define SRC_VIDEOSTREAMS_H_
+
+// Define a table of the video streams being filtered, which keeps the
+// filter chains built for each stream so its frames reuse them. A stream
+// holds one chain for every frame it has had in flight at once, as frames
+// are filtered on several workers together.
+class VideoStreams {
+ public:
+  // Define the callback that builds a chain when none is free
+  using ChainFactory = std::function<std::unique_ptr<FilterChain>()>;
+
+ private:
+  // Define a struct for one stream
+  struct Stream {
+    uint64_t id;
+    std::vector<FilterStep> steps;
+    std::vector<std::unique_ptr<FilterChain>> idle;
+    std::chrono::steady_clock::time_point lastUsed;
+  };
+
+  // Define the most streams kept at once, and how long an unused stream is
+  // kept before its chains are dropped
+  size_t _maxStreams_;
+  std::chrono::seconds _idleTimeout_;
+
+  // Define the streams, most recently used first, and their index
+  std::list<Stream> _streams_;
+  std::unordered_map<uint64_t, std::list<Stream>::iterator> _index_;
+
+  // Define a mutex to synchronise access to the tables
+  std::mutex _mutex_;
+
+  // Define the counters reported by the server
+  std::atomic<uint64_t> _frames_{0};
+  std::atomic<uint64_t> _chainsBuilt_{0};
+
+  // Define a function to drop streams beyond the limit or unused for too
+  // long, oldest first
+  void _expire_(std::chrono::steady_clock::time_point now);
+
+  // Define a function to compare the steps of a frame with its stream
+  static bool _sameSteps_(const std::vector<FilterStep>& a,
+                          const std::vector<FilterStep>& b);
+
+ public:
+  VideoStreams(size_t maxStreams, std::chrono::seconds idleTimeout);
+
+  // Borrow a chain for a frame of a stream, building one only when every
+  // chain of the stream is in use or the stream changed its steps, and
+  // returning nullptr if the steps are unusable
+  std::unique_ptr<FilterChain> acquire(uint64_t id,
+                                       const std::vector<FilterStep>& steps,
+                                       const ChainFactory& build);
+
+  // Give a chain back once its frame is filtered
+  void release(uint64_t id, const std::vector<FilterStep>& steps,
+               std::unique_ptr<FilterChain> chain);
+
+  // Report the open streams, the frames filtered and the chains built
+  size_t streamCount();
+  uint64_t frames() const { return _frames_; }
+  uint64_t chainsBuilt() const { return _chainsBuilt_; }
+};
+
+#endif  // SRC_VIDEOSTREAMS_H_